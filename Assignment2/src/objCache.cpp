@@ -0,0 +1,546 @@
+/* objCache.cpp
+ *
+ * Binary cache of a wfModel and its OpenGL vertex buffers
+ *
+ * The cache file is a CacheHeader followed by sections, each of
+ * which is a 64-bit count and then that many elements, padded to a
+ * multiple of 8 bytes:
+ *
+ *   mtllib name (chars)
+ *   vertices, normals, texcoords, facetnorms (vec3s)
+ *   for each group: name (chars), material name (chars),
+ *                   triangles (wfTriangles),
+ *                   OpenGL vertices (floats), face indices (GLuints)
+ *
+ * The file is mapped into memory and each section is copied into
+ * its array with one allocation per array.  The header records the
+ * sizes of the stored classes, so a cache written by a differently
+ * compiled program is rejected rather than misread.
+ */
+
+
+#include "headers.h"
+#include "wavefront.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+#endif
+
+
+bool wfModel::useCache = true;
+
+
+#define CACHE_MAGIC   "WFCACHE"	// 8 bytes, with the '\0'
+#define CACHE_VERSION 1
+
+#define RECENT_EDIT_TIME 2000000000LL	// nanoseconds; see readCache()
+
+
+class CacheHeader {
+
+public:
+
+  char      magic[8];
+  int       version;
+  int       classSizes[3];	// vec3, wfTriangle, GLfloat
+
+  long long objSize;		// of the .obj file
+  long long objModTime;		// in nanoseconds
+  unsigned long long objHash;
+
+  int       verticesAreCW;	// wfModel settings that change the geometry
+  int       newGroupWithNewMaterial;
+
+  int       numGroups;
+  int       hasVertexNormals;
+  int       hasVertexTexCoords;
+  float     radius;
+  vec3      centre, min, max;
+  mat4      objToWorldTransform;
+
+  void setClassSizes() {
+    classSizes[0] = sizeof(vec3);
+    classSizes[1] = sizeof(wfTriangle);
+    classSizes[2] = sizeof(GLfloat);
+  }
+};
+
+
+// Hash of a file's content, and its size.  Each 8-byte word is
+// combined with the hash so far and the result is fully mixed (with
+// the SplitMix64 finalizer), so that a change to any byte of the
+// file changes every bit of the hash.
+
+static inline unsigned long long mixWord( unsigned long long h )
+
+{
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+
+static bool hashFile( const char *filename, unsigned long long &hash, long long &size )
+
+{
+  FILE *f = fopen( filename, "rb" );
+  if (f == NULL)
+    return false;
+
+  const int bufferWords = 1 << 17; // 1 MB
+  unsigned long long *buffer = new unsigned long long[ bufferWords ];
+
+  hash = 14695981039346656037ULL;
+  size = 0;
+
+  size_t n;
+  while ((n = fread( buffer, 1, bufferWords * sizeof(unsigned long long), f )) > 0) {
+
+    if (n % sizeof(unsigned long long) != 0) // zero the end of the last word
+      memset( (char *) buffer + n, 0, sizeof(unsigned long long) - n % sizeof(unsigned long long) );
+
+    int numWords = (n + sizeof(unsigned long long) - 1) / sizeof(unsigned long long);
+
+    for (int i=0; i<numWords; i++)
+      hash = mixWord( hash ^ buffer[i] );
+
+    size += n;
+  }
+
+  delete [] buffer;
+  fclose( f );
+
+  return true;
+}
+
+
+// A file's size and modification time, in nanoseconds (as precise
+// as the platform and file system record it)
+
+static bool fileStats( const char *filename, long long &size, long long &modTime )
+
+{
+  struct stat st;
+
+  if (stat( filename, &st ) != 0)
+    return false;
+
+  size = st.st_size;
+
+#if defined(_WIN32)
+  modTime = st.st_mtime * 1000000000LL;
+#elif defined(__APPLE__)
+  modTime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+  modTime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+
+  return true;
+}
+
+
+// Sequential writing and (bounds-checked) reading of sections
+
+class CacheWriter {
+
+  FILE *file;
+  bool  ok;
+
+public:
+
+  CacheWriter( FILE *f ) { file = f; ok = true; }
+
+  bool succeeded() { return ok; }
+
+  void write( const void *data, size_t size ) {
+    if (size > 0 && fwrite( data, size, 1, file ) != 1)
+      ok = false;
+  }
+
+  void section( const void *data, long long count, size_t elementSize ) {
+    static const char zeros[8] = { 0 };
+    write( &count, sizeof(count) );
+    write( data, count * elementSize );
+    write( zeros, (8 - (count * elementSize) % 8) % 8 );
+  }
+
+  template <class T> void section( seq<T> &s ) {
+    section( (s.size() > 0 ? &s[0] : NULL), s.size(), sizeof(T) );
+  }
+
+  void section( const char *str ) {
+    section( str, (str != NULL ? strlen( str ) : 0), 1 );
+  }
+};
+
+
+class CacheReader {
+
+  char *next, *end;
+  bool  ok;
+
+public:
+
+  CacheReader( char *data, size_t size ) { next = data; end = data + size; ok = true; }
+
+  bool succeeded() { return ok; }
+
+  // Return the elements of the next section, or NULL if the file is
+  // too short
+
+  char *section( long long &count, size_t elementSize ) {
+
+    count = 0;
+
+    if (!ok || end - next < (long long) sizeof(count)) {
+      ok = false;
+      return NULL;
+    }
+
+    memcpy( &count, next, sizeof(count) );
+
+    long long size = count * elementSize;
+
+    if (count < 0 || end - next - (long long) sizeof(count) < size) {
+      ok = false;
+      count = 0;
+      return NULL;
+    }
+
+    char *data = next + sizeof(count);
+    next = data + size + (8 - size % 8) % 8;
+    if (next > end)
+      next = end;
+
+    return data;
+  }
+
+  template <class T> void section( seq<T> &s ) {
+    long long count;
+    T *data = (T *) section( count, sizeof(T) );
+    s = seq<T>( count > 1 ? count : 1 );
+    for (long long i=0; i<count; i++)
+      s.add( data[i] );
+  }
+
+  template <class T> T *array( long long &count ) { // a new copy of the next section
+    T *data = (T *) section( count, sizeof(T) );
+    if (count == 0)
+      return NULL;
+    T *copy = new T[ count ];
+    memcpy( copy, data, count * sizeof(T) );
+    return copy;
+  }
+
+  char *string() {
+    long long count;
+    char *data = section( count, 1 );
+    if (!ok || count == 0)
+      return NULL;
+    char *str = new char[ count+1 ];
+    memcpy( str, data, count );
+    str[count] = '\0';
+    return str;
+  }
+};
+
+
+// Read the model and its groups' vertex buffers from the cache.
+// Return false if there is no cache, if it is not for this .obj
+// file, or if it is damaged, in which case the caller reads the .obj
+// file and writes a new cache.
+
+bool wfModel::readCache( char *filename )
+
+{
+  long long objSize, objModTime;
+
+  if (!fileStats( filename, objSize, objModTime ))
+    return false;
+
+  char *cacheFilename = new char[ strlen(filename) + strlen(WAVEFRONT_CACHE_SUFFIX) + 1 ];
+  sprintf( cacheFilename, "%s%s", filename, WAVEFRONT_CACHE_SUFFIX );
+
+  long long cacheSize, cacheModTime;
+
+  if (!fileStats( cacheFilename, cacheSize, cacheModTime ) || cacheSize == 0) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+  // Get the cache file's contents
+
+  char  *data = NULL;
+  size_t dataSize = cacheSize;
+
+#ifdef _WIN32
+
+  FILE *f = fopen( cacheFilename, "rb" );
+
+  if (f == NULL) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+  data = new char[ dataSize ];
+
+  if (fread( data, 1, dataSize, f ) != dataSize) {
+    fclose( f );
+    delete [] data;
+    delete [] cacheFilename;
+    return false;
+  }
+
+  fclose( f );
+
+#else
+
+  int fd = open( cacheFilename, O_RDONLY );
+
+  if (fd < 0) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+  data = (char *) mmap( NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+
+  if (data == (char *) MAP_FAILED) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+#endif
+
+  // Check that the cache goes with this file and these settings
+
+  CacheHeader header, expected;
+  expected.setClassSizes();
+
+  bool valid = (dataSize >= sizeof(CacheHeader));
+
+  if (valid) {
+    memcpy( &header, data, sizeof(CacheHeader) );
+
+    valid = (memcmp( header.magic, CACHE_MAGIC, sizeof(header.magic) ) == 0 &&
+	     header.version == CACHE_VERSION &&
+	     memcmp( header.classSizes, expected.classSizes, sizeof(header.classSizes) ) == 0 &&
+	     header.objSize == objSize &&
+	     header.verticesAreCW == (int) verticesAreCW &&
+	     header.newGroupWithNewMaterial == (int) newGroupWithNewMaterial);
+  }
+
+  // A file with a new modification time (e.g. after being copied) is
+  // still the same if its content is.  The content is also checked if
+  // the cache was written within RECENT_EDIT_TIME of the file's
+  // modification time, since a file system with coarse times could
+  // give a later edit the same time.
+
+  bool hashChecked = false;
+
+  if (valid && (header.objModTime != objModTime || cacheModTime - objModTime < RECENT_EDIT_TIME)) {
+    unsigned long long objHash;
+    valid = (hashFile( filename, objHash, objSize ) && objHash == header.objHash);
+    hashChecked = true;
+  }
+
+  // Rebuild the model from the sections
+
+  if (valid) {
+
+    CacheReader in( data + sizeof(CacheHeader), dataSize - sizeof(CacheHeader) );
+
+    pathname   = strdup( filename );
+    mtllibname = in.string();
+
+    materials.clear();
+    groups.clear();
+
+    materials.add( new wfMaterial( "default" ) );
+    if (mtllibname != NULL)
+      readMaterialLibrary( mtllibname );
+
+    in.section( vertices );
+    in.section( normals );
+    in.section( texcoords );
+    in.section( facetnorms );
+
+    hasVertexNormals    = header.hasVertexNormals;
+    hasVertexTexCoords  = header.hasVertexTexCoords;
+    objToWorldTransform = header.objToWorldTransform;
+    centre = header.centre;
+    radius = header.radius;
+    min    = header.min;
+    max    = header.max;
+
+    unsigned int size = vertexSize();
+
+    for (int g=0; g<header.numGroups && in.succeeded(); g++) {
+
+      char *groupName    = in.string();
+      char *materialName = in.string();
+
+      wfGroup *group = new wfGroup( groupName != NULL ? groupName : (char *) "" );
+      group->material = (materialName != NULL ? findMaterial( materialName ) : materials[0]);
+
+      in.section( group->triangles );
+
+      long long numFloats, numIndices;
+
+      group->vertexBuffer    = in.array<GLfloat>( numFloats );
+      group->faceIndexBuffer = in.array<GLuint>( numIndices );
+      group->numVerts        = numFloats / size;
+
+      if (numIndices != 3 * group->triangles.size())
+	valid = false;
+
+      for (long long i=0; i<numIndices; i++)
+	if (group->faceIndexBuffer[i] >= group->numVerts)
+	  valid = false;
+
+      groups.add( group );
+
+      delete [] groupName;
+      delete [] materialName;
+    }
+
+    // A damaged cache is discarded and rebuilt by the caller
+
+    if (!in.succeeded() || !valid) {
+
+      cerr << "The cache for " << filename << " is damaged, so it will be rebuilt." << endl;
+
+      for (int g=0; g<groups.size(); g++) {
+	delete [] groups[g]->vertexBuffer;
+	delete [] groups[g]->faceIndexBuffer;
+	delete groups[g];
+      }
+
+      for (int i=0; i<materials.size(); i++)
+	delete materials[i];
+
+      groups.clear();
+      materials.clear();
+
+      free( pathname );
+      delete [] mtllibname;
+      pathname = mtllibname = NULL;
+
+      objToWorldTransform = identity4();
+
+      valid = false;
+    }
+  }
+
+#ifdef _WIN32
+  delete [] data;
+#else
+  munmap( data, dataSize );
+#endif
+
+  // If the .obj file was found to be the same by its hash, record its
+  // modification time.  This also updates the cache's own time, so
+  // that later runs needn't hash it again once the file is no longer
+  // recently modified.
+
+  if (valid && hashChecked) {
+
+    FILE *f = fopen( cacheFilename, "r+b" );
+
+    if (f != NULL) {
+      if (fseek( f, offsetof( CacheHeader, objModTime ), SEEK_SET ) == 0)
+	fwrite( &objModTime, sizeof(objModTime), 1, f );
+      fclose( f );
+    }
+  }
+
+  delete [] cacheFilename;
+
+  return valid;
+}
+
+
+// Write the model and its groups' vertex buffers to the cache.  If
+// the cache can't be written (e.g. the directory is read-only), the
+// model is simply read from the .obj file next time.
+
+void wfModel::writeCache( char *filename )
+
+{
+  CacheHeader header;
+
+  memset( (void *) &header, 0, sizeof(header) ); // so that the padding is written as zeros
+  memcpy( header.magic, CACHE_MAGIC, sizeof(header.magic) );
+  header.version = CACHE_VERSION;
+  header.setClassSizes();
+
+  if (!fileStats( filename, header.objSize, header.objModTime ) ||
+      !hashFile( filename, header.objHash, header.objSize ))
+    return;
+
+  header.verticesAreCW           = verticesAreCW;
+  header.newGroupWithNewMaterial = newGroupWithNewMaterial;
+
+  header.numGroups           = groups.size();
+  header.hasVertexNormals    = hasVertexNormals;
+  header.hasVertexTexCoords  = hasVertexTexCoords;
+  header.objToWorldTransform = objToWorldTransform;
+  header.centre              = centre;
+  header.radius              = radius;
+  header.min                 = min;
+  header.max                 = max;
+
+  // Write to a temporary file, then rename it, so that a partial
+  // cache is never read
+
+  char *cacheFilename = new char[ strlen(filename) + strlen(WAVEFRONT_CACHE_SUFFIX) + 1 ];
+  char *tempFilename  = new char[ strlen(filename) + strlen(WAVEFRONT_CACHE_SUFFIX) + 5 ];
+
+  sprintf( cacheFilename, "%s%s", filename, WAVEFRONT_CACHE_SUFFIX );
+  sprintf( tempFilename, "%s.tmp", cacheFilename );
+
+  FILE *f = fopen( tempFilename, "wb" );
+
+  if (f != NULL) {
+
+    CacheWriter out( f );
+
+    out.write( &header, sizeof(header) );
+
+    out.section( mtllibname );
+
+    out.section( vertices );
+    out.section( normals );
+    out.section( texcoords );
+    out.section( facetnorms );
+
+    unsigned int size = vertexSize();
+
+    for (int g=0; g<groups.size(); g++) {
+
+      wfGroup *group = groups[g];
+
+      out.section( group->name );
+      out.section( group->material->name );
+      out.section( group->triangles );
+      out.section( group->vertexBuffer, (long long) group->numVerts * size, sizeof(GLfloat) );
+      out.section( group->faceIndexBuffer, (group->faceIndexBuffer != NULL ? 3 * group->triangles.size() : 0), sizeof(GLuint) );
+    }
+
+    bool ok = out.succeeded();
+
+    if (fclose( f ) == 0 && ok) {
+      remove( cacheFilename ); // rename() on Windows won't replace a file
+      rename( tempFilename, cacheFilename );
+    } else
+      remove( tempFilename );
+  }
+
+  delete [] cacheFilename;
+  delete [] tempFilename;
+}
@@ -16,6 +16,7 @@
 #endif
 
 #include "wavefront.h"
+#include "objParser.h"
 
 
 bool          wfModel::newGroupWithNewMaterial = false;
@@ -33,9 +34,6 @@ unsigned char wfMaterial::defaultTexmap[] = { 255, 255, 255, 255, 255, 255,
 void wfModel::read( char *filename )
 
 {
-  FILE* file;
-  char  buf[1000];
-  float x, y, z;
   wfGroup    *currentGroup;
   wfMaterial *currentMaterial;
   int   nextGroupNum = 0;
@@ -66,275 +64,108 @@ void wfModel::read( char *filename )
 
   currentGroup->material = currentMaterial;
 
-  /* open the file */
+  /* parse the file, in parallel chunks */
 
-  file = fopen(filename, "rb");
-  if (!file) {
+  seq<ObjChunk*> chunks;
+
+  if (!parseObjFile( filename, chunks )) {
     char path[PATH_MAX];
     _getcwd( path, PATH_MAX );
     cerr << "wfModel::read() failed: can't open data file '" << filename << "'.  Current working directory is " << path << endl;
     exit(-1);
   }
 
-  /* process each line */
+  /* merge the chunks in order */
 
-  lineNum = 0;
+  int firstLine = 0;		// line number before the chunk
 
-  while(fscanf(file, "%s", buf) != EOF) {
+  for (int k=0; k<chunks.size(); k++) {
 
-    lineNum++;
+    ObjChunk *chunk = chunks[k];
 
-    cout << "\r" << lineNum << " "; cout.flush();
+    for (int i=0; i<chunk->vertices.size(); i++)
+      vertices.add( chunk->vertices[i] );
+    for (int i=0; i<chunk->normals.size(); i++)
+      normals.add( chunk->normals[i] );
+    for (int i=0; i<chunk->texcoords.size(); i++)
+      texcoords.add( chunk->texcoords[i] );
 
-    if (strncmp( buf, "transform", 9 ) == 0) {
+    // Faces may refer only to vertices that come before them
 
-      for (int r=0; r<4; r++)
-	for (int c=0; c<4; c++) {
-	  float val;
-	  fscanf( file, "%f", &val );
-	  objToWorldTransform[r][c] = val;
-	}
+    if (chunk->maxVindex >= 0) {
+      lineNum = firstLine + chunk->maxVindexLine;
+      checkVindex( chunk->maxVindex );
+    }
 
-    } else {
-      int v = 0, n = 0, t = 0;
-      wfTriangle *tri, *prevTri;
+    if (chunk->minVindex < 0) {
+      lineNum = firstLine + chunk->minVindexLine;
+      checkVindex( chunk->minVindex );
+    }
 
-      switch(buf[0]) {
+    // Replay the chunk's statements, adding the triangles before each
+    // to the current group
 
-      case '#':				/* comment */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	break;
+    int nextTriangle = 0;
 
-      case 's':				/* smoothing group ... ignore */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	break;
+    for (int i=0; i<=chunk->statements.size(); i++) {
 
-      case 'v':				/* v, vn, vt */
-	switch(buf[1]) {
+      int numTriangles = (i < chunk->statements.size() ? chunk->statements[i].numTrianglesBefore : chunk->triangles.size());
 
-	case '\0':			/* vertex */
-	  fscanf(file, "%f %f %f", &x, &y, &z );
-	  vertices.add( vec3(x,y,z) );
-	  break;
+      for (; nextTriangle<numTriangles; nextTriangle++)
+	currentGroup->triangles.add( chunk->triangles[nextTriangle] );
 
-	case 'n':				/* normal */
-	  fscanf(file, "%f %f %f", &x, &y, &z );
-	  normals.add( vec3(x,y,z).normalize() );
-	  break;
+      if (i == chunk->statements.size())
+	break;
 
-	case 't':				/* texcoord */
-	  fscanf(file, "%f %f", &x, &y );
-	  texcoords.add( vec3(x,y,0) );
-	  fgets(buf, sizeof(buf), file); // skip rest of line
-	  break;
-	}
+      ObjStatement &s = chunk->statements[i];
+
+      switch (s.type) {
+
+      case OBJ_TRANSFORM:
+	for (int r=0; r<4; r++)
+	  for (int c=0; c<4; c++)
+	    objToWorldTransform[r][c] = s.transform[4*r+c];
 	break;
 
-      case 'm':			        /* mtllib filename */
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s %s", buf, buf);
-	mtllibname = strdup(buf);
-	readMaterialLibrary( buf );
+      case OBJ_MTLLIB:			/* mtllib filename */
+	mtllibname = strdup(s.name);
+	readMaterialLibrary( s.name );
 	break;
 
-      case 'u':			        /* usemtl name */
+      case OBJ_USEMTL:			/* usemtl name */
 
 	if (newGroupWithNewMaterial) {
 	  char buffer[100];
 	  sprintf( buffer, "g%d", nextGroupNum++ );
 	  currentGroup = findGroup( buffer );
 	}
-      
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s %s", buf, buf);
-	currentGroup->material = currentMaterial = findMaterial( buf );
+
+	currentGroup->material = currentMaterial = findMaterial( s.name );
 	break;
 
-      case 'g':				/* group */
-	/* eat up rest of line */
-	fgets(buf, sizeof(buf), file);
-	sscanf(buf, "%s", buf);
-	if (buf[0] == '\n')
+      case OBJ_GROUP:			/* group */
+	if (s.name == NULL)
 	  currentGroup = findGroup( "default" );
 	else
-	  currentGroup = findGroup( buf );
+	  currentGroup = findGroup( s.name );
 	currentGroup->material = currentMaterial;
 	break;
+      }
+    }
 
-      case 'f':				/* face */
-
-	fscanf(file, "%s", buf);
-
-	/* can be one of %d, %d//%d, %d/%d, or %d/%d/%d */
-
-	tri = new wfTriangle();
-
-	if (buf[strlen(buf)-1] == '/' && buf[strlen(buf)-2] == '/' ) {	/* v// */
-
-	  numV++;
-
-	  sscanf(buf,  "%d//", &v); v--; checkVindex(v); tri->vindices[0] = v;
-	  fscanf(file, "%d//", &v); v--; checkVindex(v); tri->vindices[1] = v;
-	  fscanf(file, "%d//", &v); v--; checkVindex(v); tri->vindices[2] = v;
-
-	  currentGroup->triangles.add( tri );
-	
-	  while(fscanf(file, "%d//", &v) > 0) {
-
-	    v--; checkVindex(v);
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
-
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->vindices[2] = v;
-
-	    currentGroup->triangles.add( tri );
-	  }
-
-	} else if (strstr(buf, "//")) {	/* v//n */
-
-	  numVN++;
-
-	  /* First three vertices define a triangle */
-
-	  sscanf(buf, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[0] = v; tri->nindices[0] = n;
-	  fscanf(file, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[1] = v; tri->nindices[1] = n;
-	  fscanf(file, "%d//%d", &v, &n);	v--; checkVindex(v); n--; tri->vindices[2] = v; tri->nindices[2] = n;
-
-	  currentGroup->triangles.add( tri );
-
-	  /* More vertices (a convex polygon) are converted to a fan of triangles: */
-
-	  while(fscanf(file, "%d//%d", &v, &n) > 0) {
-
-	    v--; checkVindex(v); n--;
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
-
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->nindices[0] = prevTri->nindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->nindices[1] = prevTri->nindices[2];
-	    tri->vindices[2] = v;
-	    tri->nindices[2] = n;
-
-	    currentGroup->triangles.add( tri );
-	  }
-	
-	} else if (sscanf(buf, "%d/%d/%d", &v, &t, &n) == 3) {  /* v/t/n */
-
-	  numVTN++;
-
-	  v--; checkVindex(v); n--; t--;
-
-	  tri->vindices[0] = v;
-	  tri->tindices[0] = t;
-	  tri->nindices[0] = n;
-	  fscanf(file, "%d/%d/%d", &v, &t, &n);	v--; checkVindex(v); n--; t--;
-	  tri->vindices[1] = v;
-	  tri->tindices[1] = t;
-	  tri->nindices[1] = n;
-	  fscanf(file, "%d/%d/%d", &v, &t, &n);	v--; checkVindex(v); n--; t--;
-	  tri->vindices[2] = v;
-	  tri->tindices[2] = t;
-	  tri->nindices[2] = n;
-
-	  currentGroup->triangles.add( tri );
-	
-	  while(fscanf(file, "%d/%d/%d", &v, &t, &n) > 0) {
-
-	    v--; checkVindex(v); n--; t--;
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
-
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->tindices[0] = prevTri->tindices[0];
-	    tri->nindices[0] = prevTri->nindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->tindices[1] = prevTri->tindices[2];
-	    tri->nindices[1] = prevTri->nindices[2];
-	    tri->vindices[2] = v;
-	    tri->tindices[2] = t;
-	    tri->nindices[2] = n;
-
-	    currentGroup->triangles.add( tri );
-	  }
-	
-	} else if (sscanf(buf, "%d/%d", &v, &t) == 2) { /* v/t */
-
-	  numVT++;
-
-	  v--; checkVindex(v); t--;
-
-	  tri->vindices[0] = v;
-	  tri->tindices[0] = t;
-	  fscanf(file, "%d/%d", &v, &t);	v--; checkVindex(v); t--;
-	  tri->vindices[1] = v;
-	  tri->tindices[1] = t;
-	  fscanf(file, "%d/%d", &v, &t);	v--; checkVindex(v); t--;
-	  tri->vindices[2] = v;
-	  tri->tindices[2] = t;
-
-	  currentGroup->triangles.add( tri );
-
-	  while(fscanf(file, "%d/%d", &v, &t) > 0) {
-
-	    v--; checkVindex(v); t--;
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
-
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->tindices[0] = prevTri->tindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->tindices[1] = prevTri->tindices[2];
-	    tri->vindices[2] = v;
-	    tri->tindices[2] = t;
-
-	    currentGroup->triangles.add( tri );
-	  }
-	
-	} else {	/* v */
-
-	  numV++;
-
-	  sscanf(buf,  "%d", &v); v--; checkVindex(v); tri->vindices[0] = v;
-	  fscanf(file, "%d", &v); v--; checkVindex(v); tri->vindices[1] = v;
-	  fscanf(file, "%d", &v); v--; checkVindex(v); tri->vindices[2] = v;
-
-	  currentGroup->triangles.add( tri );
-	
-	  while(fscanf(file, "%d", &v) > 0) {
-
-	    v--; checkVindex(v);
-
-	    prevTri = tri;
-	    tri = new wfTriangle();
+    for (int i=0; i<chunk->warnings.size(); i++)
+      cerr << "Warning: unrecognized Wavefront command on line " << firstLine + chunk->warnings[i].line << ": " << chunk->warnings[i].command << endl;
 
-	    tri->vindices[0] = prevTri->vindices[0];
-	    tri->vindices[1] = prevTri->vindices[2];
-	    tri->vindices[2] = v;
+    numVTN += chunk->numVTN;
+    numVT  += chunk->numVT;
+    numVN  += chunk->numVN;
+    numV   += chunk->numV;
 
-	    currentGroup->triangles.add( tri );
-	  }
-	}
-	break;
+    firstLine += chunk->numLines;
 
-      default:
-	cerr << "Warning: unrecognized Wavefront command on line " << lineNum << ": " << buf << endl;
-	break;
-      }
-    }
+    delete chunk;
   }
 
-  cout << "\r          \r"; cout.flush();
-
   // Determine a consistent format for each vertex
 
   hasVertexNormals   = (numVTN > 0 || numVN > 0);
@@ -345,7 +176,7 @@ void wfModel::read( char *filename )
   for (int g=0; g<groups.size(); g++)
     for (int i=0; i<groups[g]->triangles.size(); i++) {
 
-      wfTriangle &tri = *groups[g]->triangles[i];
+      wfTriangle &tri = groups[g]->triangles[i];
 
       vec3 d01 = vertices[ tri.vindices[1] ] - vertices[ tri.vindices[0] ];
       vec3 d02 = vertices[ tri.vindices[2] ] - vertices[ tri.vindices[0] ];
@@ -370,7 +201,7 @@ void wfModel::read( char *filename )
     
     for (int g=0; g<groups.size(); g++)
       for (int i=0; i<groups[g]->triangles.size(); i++) {
-	wfTriangle &tri = *groups[g]->triangles[i];
+	wfTriangle &tri = groups[g]->triangles[i];
 	for (int k=0; k<3; k++) {
 	  int idx = tri.vindices[k];
 	  normals[idx] = normals[idx] + facetnorms[ tri.findex ];
@@ -625,25 +456,36 @@ namespace std {
 }
 
 
-void wfModel::setupVAO( TextureMode textureMode )
+// Note that positions, normals, and texture coordinates can all be
+// indexed differently in a Wavefront file.  But OpenGL permits only
+// one index per vertex, and the OpenGL vertex encapsulates all
+// attributes, including position, normal, and texture coordinates.
+//
+// So we have to create *another* array of vertices where each
+// vertex stores position, normal, and texture coordinates and the
+// face indices index into this new array.  buildVertexBuffers()
+// builds these arrays for each group (and they can be cached), and
+// setupVAO() hands them to OpenGL.
 
-{
-  // Note that positions, normals, and texture coordinates can all be
-  // indexed differently in a Wavefront file.  But OpenGL permits only
-  // one index per vertex, and the OpenGL vertex encapsulates all
-  // attributes, including position, normal, and texture coordinates.
-  //
-  // So we have to create *another* array of vertices where each
-  // vertex stores position, normal, and texture coordinates and the
-  // face indices index into this new array.
+unsigned int wfModel::vertexSize()
 
-  unsigned int vertexSize = 3;
+{
+  unsigned int size = 3;
 
   if (hasVertexNormals)
-    vertexSize += 3;
+    size += 3;
 
   if (hasVertexTexCoords)
-    vertexSize += 2;
+    size += 2;
+
+  return size;
+}
+
+
+void wfModel::buildVertexBuffers()
+
+{
+  unsigned int vertexSize = this->vertexSize();
 
   // Count triangles;
 
@@ -653,8 +495,6 @@ void wfModel::setupVAO( TextureMode textureMode )
 
   // Process each group separately
 
-  std::unordered_map< VertexSignature, GLuint > hash;
-
   for (int i=0; i<groups.size(); i++) {
 
     wfGroup *thisGroup = groups[i];
@@ -669,14 +509,14 @@ void wfModel::setupVAO( TextureMode textureMode )
       unsigned int nVerts = 0;
       int nFaces = 0;
 
-      VertexSignature *vertSig = new VertexSignature[ numTriangles * 3 ];
+      std::unordered_map< VertexSignature, GLuint > hash; // vertices of this group only
 
       for (int j=0; j<thisGroup->triangles.size(); j++) {
 
 	cout << "\r" << n << " "; cout.flush();
 	n--;
       
-	wfTriangle *tri = thisGroup->triangles[j];
+	wfTriangle &tri = thisGroup->triangles[j];
 
 	for (int k=0; k<3; k++) {
 
@@ -684,9 +524,9 @@ void wfModel::setupVAO( TextureMode textureMode )
 
 	  VertexSignature vs;
 
-	  vs.sig[0] = tri->vindices[k];
-	  vs.sig[1] = tri->nindices[k];
-	  vs.sig[2] = tri->tindices[k];
+	  vs.sig[0] = tri.vindices[k];
+	  vs.sig[1] = tri.nindices[k];
+	  vs.sig[2] = tri.tindices[k];
 
 	  auto search = hash.find( vs );
 	  
@@ -696,19 +536,18 @@ void wfModel::setupVAO( TextureMode textureMode )
 
 	  else { // not found: add this vertex
 
-	    * (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri->vindices[k] ];
+	    * (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri.vindices[k] ];
 
 	    if (hasVertexNormals)
-	      * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri->nindices[k] ];
+	      * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri.nindices[k] ];
 
 	    if (hasVertexTexCoords) {
 	      if (hasVertexNormals)
-		* (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri->tindices[k] ];
+		* (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri.tindices[k] ];
 	      else
-		* (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri->tindices[k] ];
+		* (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri.tindices[k] ];
 	    }
 	  
-	    vertSig[ nVerts ] = vs;
 	    hash.insert( { vs, nVerts } ); // nVerts is the index of this vertex
 	    faceIndexBuffer[ nFaces * 3 + k ] = nVerts; // Store this vertex index
 	    nVerts++;
@@ -720,6 +559,30 @@ void wfModel::setupVAO( TextureMode textureMode )
 
       cout << "\r       " << endl;
 
+      thisGroup->vertexBuffer    = vertexBuffer;
+      thisGroup->faceIndexBuffer = faceIndexBuffer;
+      thisGroup->numVerts        = nVerts;
+    }
+  }
+}
+
+
+// Give each group's vertex buffers to OpenGL, then free them
+
+void wfModel::setupVAO( TextureMode textureMode )
+
+{
+  unsigned int vertexSize = this->vertexSize();
+
+  for (int i=0; i<groups.size(); i++) {
+
+    wfGroup *thisGroup = groups[i];
+
+    if (thisGroup->vertexBuffer != NULL) {
+      
+      int nFaces = thisGroup->triangles.size();
+      unsigned int nVerts = thisGroup->numVerts;
+
       // Set up the VAO
 
       glGenVertexArrays( 1, &thisGroup->VAO );
@@ -731,12 +594,12 @@ void wfModel::setupVAO( TextureMode textureMode )
       // store faces
 
       glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, bufferIDs[0] );
-      glBufferData( GL_ELEMENT_ARRAY_BUFFER, nFaces * 3 * sizeof(GLuint), faceIndexBuffer, GL_STATIC_DRAW );
+      glBufferData( GL_ELEMENT_ARRAY_BUFFER, nFaces * 3 * sizeof(GLuint), thisGroup->faceIndexBuffer, GL_STATIC_DRAW );
 
       // store vertices
 
       glBindBuffer( GL_ARRAY_BUFFER, bufferIDs[1] );
-      glBufferData( GL_ARRAY_BUFFER, nVerts * vertexSize * sizeof(GLfloat), vertexBuffer, GL_STATIC_DRAW );
+      glBufferData( GL_ARRAY_BUFFER, nVerts * vertexSize * sizeof(GLfloat), thisGroup->vertexBuffer, GL_STATIC_DRAW );
 
       // define attributes
 
@@ -770,9 +633,11 @@ void wfModel::setupVAO( TextureMode textureMode )
 
       thisGroup->VAOinitialized = true;
 
-      delete [] vertexBuffer;
-      delete [] faceIndexBuffer;
-      delete [] vertSig;
+      delete [] thisGroup->vertexBuffer;
+      delete [] thisGroup->faceIndexBuffer;
+
+      thisGroup->vertexBuffer    = NULL;
+      thisGroup->faceIndexBuffer = NULL;
 
       glBindVertexArray( 0 );
     }
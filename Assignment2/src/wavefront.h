@@ -2,6 +2,14 @@
  *
  * A Wavefront object defined from a .OBJ file.  This can represent
  * only a subset of all Wavefront objects.
+ *
+ * Parsing a large .obj file and merging its vertex attributes for
+ * OpenGL is slow, so the result is saved in a binary cache file next
+ * to the .obj file (with WAVEFRONT_CACHE_SUFFIX appended to its
+ * name).  Later runs read the cache instead, as long as the .obj
+ * file has the same size and modification time (or, failing that,
+ * the same content hash).  Materials and textures are always read
+ * from the .mtl file.
  */
 
 
@@ -17,6 +25,9 @@
 #include "linalg.h"
 
 
+#define WAVEFRONT_CACHE_SUFFIX ".wfcache"
+
+
 /* A material with lighting properties and perhaps a texture map
  */
 
@@ -93,17 +104,24 @@ class wfTriangle {
 class wfGroup {
  public:
   char             *name;       /* name of this group */
-  seq<wfTriangle*> triangles;   /* triangles of this group */
+  seq<wfTriangle>  triangles;   /* triangles of this group */
   wfMaterial       *material;   /* material for group */
   GLuint           VAO;
   bool             VAOinitialized;
 
+  GLfloat         *vertexBuffer;    /* OpenGL vertices, until setupVAO() (or NULL) */
+  GLuint          *faceIndexBuffer; /* three per triangle, into vertexBuffer */
+  unsigned int     numVerts;        /* in vertexBuffer */
+
   wfGroup() {}
 
   wfGroup( char *gname ) {
     name = new char[ strlen(gname)+1 ];
     strcpy( name, gname );
     VAOinitialized = false;
+    vertexBuffer = NULL;
+    faceIndexBuffer = NULL;
+    numVerts = 0;
   }
 
   ~wfGroup() {
@@ -152,6 +170,11 @@ class wfModel {
   wfGroup*    findGroup( char *name );               /* find a named group */
   void        readMaterialLibrary( char *filename ); /* read all materials */
 
+  unsigned int vertexSize();                /* floats per OpenGL vertex */
+  void         buildVertexBuffers();        /* merge the attributes of each group's vertices */
+  bool         readCache( char *filename ); /* read the model and vertex buffers from the cache */
+  void         writeCache( char *filename );
+
   int lineNum;
 
   //unsigned int nFaces;
@@ -165,6 +188,7 @@ class wfModel {
 
   static bool newGroupWithNewMaterial; /* create a new group each time the material changes */
   static bool verticesAreCW;           /* calculate opposite-to-usual face normals */
+  static bool useCache;                /* read and write WAVEFRONT_CACHE_SUFFIX files */
 
   vec3 min, max;                /* extents */
 
@@ -178,7 +202,12 @@ class wfModel {
     texturesInitialized = false;
     pathname = mtllibname = NULL;
     objToWorldTransform = identity4();
-    read( filename );
+    if (!useCache || !readCache( filename )) {
+      read( filename );
+      buildVertexBuffers();
+      if (useCache)
+        writeCache( filename );
+    }
     setupVAO( textureMode );
   }
 
@@ -0,0 +1,111 @@
+// accumBuffer.cpp
+
+
+#include "headers.h"
+#include "accumBuffer.h"
+
+
+static float luminance( vec3 &c )
+
+{
+  return 0.2126 * c.x + 0.7152 * c.y + 0.0722 * c.z;
+}
+
+
+AccumBuffer::AccumBuffer( int w, int h, int _minSamples, int _maxSamples, float _threshold )
+
+{
+  width      = w;
+  height     = h;
+  maxSamples = MAX( _maxSamples, 1 );
+  minSamples = MIN( MAX( _minSamples, 2 ), maxSamples ); // need two samples for a variance
+  threshold  = _threshold;
+
+  sum      = new vec3[ w * h ];
+  sumLumSq = new float[ w * h ];
+  count    = new int[ w * h ];
+  done     = new bool[ w * h ];
+
+  for (int i=0; i<w*h; i++) {
+    sum[i]      = vec3(0,0,0);
+    sumLumSq[i] = 0;
+    count[i]    = 0;
+    done[i]     = false;
+  }
+}
+
+
+AccumBuffer::~AccumBuffer()
+
+{
+  delete [] sum;
+  delete [] sumLumSq;
+  delete [] count;
+  delete [] done;
+}
+
+
+// Add a sample to pixel (x,y) and decide whether the pixel is done.
+// Each pixel is touched by only one thread at a time.
+
+void AccumBuffer::add( int x, int y, vec3 colour )
+
+{
+  int i = x + y * width;
+
+  sum[i] = sum[i] + colour;
+  sumLumSq[i] += luminance( colour ) * luminance( colour );
+  count[i]++;
+
+  if (count[i] >= maxSamples)
+    done[i] = true;
+  else if (count[i] >= minSamples && relativeError( x, y ) < threshold)
+    done[i] = true;
+}
+
+
+// Standard error of the pixel's mean luminance, relative to that
+// luminance (or to ADAPTIVE_DARK_LUMINANCE for dark pixels)
+
+float AccumBuffer::relativeError( int x, int y )
+
+{
+  int i = x + y * width;
+  int n = count[i];
+
+  if (n < 2)
+    return MAXFLOAT;
+
+  float meanLum  = luminance( sum[i] ) / n;
+  float variance = (sumLumSq[i] - n * meanLum * meanLum) / (n - 1);
+
+  if (variance < 0) // from rounding
+    variance = 0;
+
+  return sqrt( variance / n ) / MAX( meanLum, ADAPTIVE_DARK_LUMINANCE );
+}
+
+
+int AccumBuffer::numActive()
+
+{
+  int n = 0;
+
+  for (int i=0; i<width*height; i++)
+    if (!done[i])
+      n++;
+
+  return n;
+}
+
+
+long long AccumBuffer::totalSamples()
+
+{
+  long long n = 0;
+
+  for (int i=0; i<width*height; i++)
+    n += count[i];
+
+  return n;
+}
@@ -0,0 +1,65 @@
+// accumBuffer.h
+//
+// HDR accumulation buffer for progressive, adaptive rendering
+//
+// Each pass of the render engine adds one more sample to every pixel
+// that is still active.  The buffer keeps the sum of each pixel's
+// samples (in floating point, so nothing is clamped) and the sum of
+// their squared luminances, from which it estimates the standard
+// error of the pixel's mean.  A pixel stops once it has at least
+// minSamples and its error is below 'threshold' times its
+// luminance, or once it has maxSamples.
+
+
+#ifndef ACCUMBUFFER_H
+#define ACCUMBUFFER_H
+
+#include "linalg.h"
+
+
+#define ADAPTIVE_MIN_SAMPLES 8		// samples before a pixel's error is trusted
+#define ADAPTIVE_DARK_LUMINANCE 0.1	// error in pixels darker than this is relative to this
+
+
+class AccumBuffer {
+
+  int    width, height;
+
+  vec3  *sum;			// sum of samples
+  float *sumLumSq;		// sum of squared sample luminances
+  int   *count;			// number of samples
+  bool  *done;			// pixel has converged (or has maxSamples)
+
+  int    minSamples, maxSamples;
+  float  threshold;
+
+ public:
+
+  AccumBuffer( int w, int h, int _minSamples, int _maxSamples, float _threshold );
+  ~AccumBuffer();
+
+  bool isActive( int x, int y ) {
+    return !done[ x + y * width ];
+  }
+
+  int numSamples( int x, int y ) {
+    return count[ x + y * width ];
+  }
+
+  int maxPixelSamples() {
+    return maxSamples;
+  }
+
+  vec3 mean( int x, int y ) {
+    int i = x + y * width;
+    return (count[i] > 0 ? (1.0f / count[i]) * sum[i] : vec3(0,0,0));
+  }
+
+  void  add( int x, int y, vec3 colour );
+  float relativeError( int x, int y );
+  int   numActive();
+  long long totalSamples();
+};
+
+
+#endif
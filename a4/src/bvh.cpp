@@ -3,6 +3,12 @@
 
 #include "bvh.h"
 #include "triangle.h"
+#include "rayPacket.h"
+#include "threadPool.h"
+#include "main.h"
+
+#include <climits>
+#include <atomic>
 
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
@@ -10,18 +16,261 @@
 
 
 
-// Build the BVH
-//
-// Each level has <= k children clustered with k-means.
-//
-// Upon call, there is guaranteed to be at least one triangle.  
-
-
 #define K                          8 // number of means in k-means
 #define NUM_RANDOM_CANDIDATES     20 // number of candidates for next random seed of K seeds
 #define NUM_CLUSTERING_ITERATIONS  4 // number of times to shift cluster means
-#define LEAF_COUNT_THRESHOLD       2 // max number of triangles in a leaf
 
+#define NUM_SAH_BINS              16 // number of centroid bins per axis in the SAH builder
+#define SAH_TRAVERSAL_COST         1 // cost of visiting a node, relative to ...
+#define SAH_INTERSECTION_COST      1 // ... the cost of one ray/triangle test
+
+#define PARALLEL_BUILD_MIN    65536 // BVHs with fewer triangles are built on one thread
+#define PARALLEL_SUBTREE_MIN   4096 // SAH nodes with at least this many primitives build their children as separate jobs
+#define PARALLEL_BINNING_MIN 262144 // SAH nodes with at least this many primitives bin them in parallel
+
+
+static_assert( sizeof(BVH_flatNode) == BVH_NODE_ALIGNMENT, "BVH_flatNode should fill exactly one aligned block" );
+
+
+BVHBuildMethod BVH::buildMethod = BVH_SAH;
+int            BVH::maxLeafSize = 4;
+
+
+
+// Build the BVH with 'buildMethod', then flatten it.
+//
+// The triangle bounding boxes are computed once here, rather than
+// each time a builder needs them.  After flattening, 'triangles' is
+// reordered so that the triangles of each leaf are contiguous.
+
+void BVH::buildTree()
+
+{
+  // cout << "Building with " << vertices->size() << " vertices, " << texcoords->size() << " texcoords, " << materials.size() << " materials, " << triangles.size() << " triangles." << endl;
+
+  if (triangles.size() == 0) {
+    nodes = NULL;
+    numNodes = 0;
+    wideNodes = NULL;
+    numWideNodes = 0;
+    return;
+  }
+
+  int n = triangles.size();
+
+  triBoxes     = new BBox[n];
+  triCentroids = new vec3[n];
+
+  for (int i=0; i<n; i++) {
+
+    vec3 &v0 = (*vertices)[triangles[i].v0];
+    vec3 &v1 = (*vertices)[triangles[i].v1];
+    vec3 &v2 = (*vertices)[triangles[i].v2];
+
+    vec3 min( MIN(v0.x,MIN(v1.x,v2.x)),
+	      MIN(v0.y,MIN(v1.y,v2.y)),
+	      MIN(v0.z,MIN(v1.z,v2.z)) );
+
+    vec3 max( MAX(v0.x,MAX(v1.x,v2.x)),
+	      MAX(v0.y,MAX(v1.y,v2.y)),
+	      MAX(v0.z,MAX(v1.z,v2.z)) );
+
+    triBoxes[i]     = BBox( min, max );
+    triCentroids[i] = 0.5 * (min + max);
+  }
+
+  BVH_node *root;
+
+  if (buildMethod == BVH_SAH) {
+
+    int *triangleIndices = new int[n];
+    for (int i=0; i<n; i++)
+      triangleIndices[i] = i;
+
+    // Use as many threads as the scene renders with (-n), or one per
+    // core if that isn't set.  The calling thread works too, so the
+    // pool needs one fewer.
+
+    int numThreads = (scene != NULL && scene->numThreads > 0 ? scene->numThreads : ThreadPool::numCores());
+
+    ThreadPool *pool = NULL;
+
+    if (n >= PARALLEL_BUILD_MIN && numThreads > 1)
+      pool = new ThreadPool( numThreads - 1 );
+
+    root = buildSubtreeSAH( triBoxes, triCentroids, triangleIndices, n, 0, pool );
+
+    delete pool;
+    delete [] triangleIndices;
+
+  } else {
+
+    seq<int> triangleIndices( n );
+    for (int i=0; i<n; i++)
+      triangleIndices.add( i );
+
+    root = buildSubtree( triangleIndices, 0 );
+  }
+
+  delete [] triBoxes;
+  delete [] triCentroids;
+
+  triBoxes = NULL;
+  triCentroids = NULL;
+
+  // Flatten the tree
+
+  int maxPending;
+  numNodes = countNodes( root, maxPending );
+
+  if (maxPending > BVH_STACK_SIZE) {
+    cerr << "BVH is too deep to traverse (increase BVH_STACK_SIZE)" << endl;
+    exit(1);
+  }
+
+  nodes = allocNodes( numNodes );
+
+  seq<int> leafOrder( n );
+  int nextFreeNode = 1;
+
+  flattenTree( root, nodes, 0, nextFreeNode, leafOrder );
+
+  // Reorder the triangles to match the leaves
+
+  seq<BVH_triangle>     orderedTriangles( n );
+  seq<BVH_triangleData> orderedTriangleData( n );
+
+  for (int i=0; i<leafOrder.size(); i++) {
+    orderedTriangles.add( triangles[ leafOrder[i] ] );
+    orderedTriangleData.add( triangleData[ leafOrder[i] ] );
+  }
+
+  triangles    = orderedTriangles;
+  triangleData = orderedTriangleData;
+
+  freeTree( root );
+
+  // Collapse to wide nodes for traversal
+
+  wideNodes = buildWideBVH( nodes, numWideNodes, maxPending );
+
+  if (maxPending > BVH_STACK_SIZE) {
+    cerr << "Wide BVH is too deep to traverse (increase BVH_STACK_SIZE)" << endl;
+    exit(1);
+  }
+}
+
+
+
+// Count the nodes in a subtree.  Also find 'maxPending', the most
+// nodes that can be on the traversal stack at once: each non-leaf on
+// a path pushes all of its children and then pops one.
+
+int BVH::countNodes( BVH_node *n, int &maxPending )
+
+{
+  maxPending = 0;
+
+  if (n->isLeaf)
+    return 1;
+
+  int count = 1;
+
+  for (int i=0; i<n->children->size(); i++) {
+    int childPending;
+    count += countNodes( (*n->children)[i], childPending );
+    maxPending = MAX( maxPending, childPending );
+  }
+
+  maxPending += n->children->size();
+
+  return count;
+}
+
+
+
+// Copy node 'n' into nodes[nodeIndex] and its subtree into the
+// following free nodes.  The children of a node are allocated
+// together before any of them is filled in, so they are contiguous.
+// The primitive indices of the leaves are appended to 'leafOrder',
+// and leaf offsets are positions in 'leafOrder'.
+
+void BVH::flattenTree( BVH_node *n, BVH_flatNode *nodes, int nodeIndex, int &nextFreeNode, seq<int> &leafOrder )
+
+{
+  BVH_flatNode &f = nodes[nodeIndex];
+
+  f.bbox = n->bbox;
+
+  if (n->isLeaf) {
+
+    if (n->triangles->size() > SHRT_MAX) {
+      cerr << "BVH leaf has too many triangles (" << n->triangles->size() << ")" << endl;
+      exit(1);
+    }
+
+    f.isLeaf = 1;
+    f.offset = leafOrder.size();
+    f.count  = n->triangles->size();
+
+    for (int i=0; i<n->triangles->size(); i++)
+      leafOrder.add( (*n->triangles)[i] );
+
+  } else {
+
+    f.isLeaf = 0;
+    f.offset = nextFreeNode;
+    f.count  = n->children->size();
+
+    nextFreeNode += n->children->size();
+
+    for (int i=0; i<n->children->size(); i++)
+      flattenTree( (*n->children)[i], nodes, f.offset+i, nextFreeNode, leafOrder );
+  }
+}
+
+
+
+// Allocate aligned nodes, so that each node fits in one cache line
+
+BVH_flatNode * BVH::allocNodes( int n )
+
+{
+  void *mem;
+
+#ifdef _WIN32
+  mem = _aligned_malloc( n * sizeof(BVH_flatNode), BVH_NODE_ALIGNMENT );
+#else
+  if (posix_memalign( &mem, BVH_NODE_ALIGNMENT, n * sizeof(BVH_flatNode) ) != 0)
+    mem = NULL;
+#endif
+
+  if (mem == NULL) {
+    cerr << "Could not allocate " << n << " BVH nodes" << endl;
+    exit(1);
+  }
+
+  return (BVH_flatNode *) mem;
+}
+
+
+void BVH::freeNodes( BVH_flatNode *nodes )
+
+{
+#ifdef _WIN32
+  _aligned_free( nodes );
+#else
+  free( nodes );
+#endif
+}
+
+
+
+// Build a BVH subtree with k-means
+//
+// Each level has <= k children clustered with k-means.
+//
+// Upon call, there is guaranteed to be at least one triangle.  
 
 
 BVH_node * BVH::makeLeafNode( seq<int> &triangleIndices )
@@ -37,12 +286,28 @@ BVH_node * BVH::makeLeafNode( seq<int> &triangleIndices )
 }
 
 
+BVH_node * BVH::makeLeafNode( BBox *boxes, int *indices, int numIndices )
+
+{
+  BVH_node *n = new BVH_node();
+  
+  n->isLeaf    = true;
+  n->triangles = new seq<int>( numIndices );
+  n->bbox      = boxesBBox( boxes, indices, numIndices );
+
+  for (int i=0; i<numIndices; i++)
+    n->triangles->add( indices[i] );
+    
+  return n;
+}
+
+
 BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
 
 {
   // Return a leaf node if there are sufficiently few triangles
 
-  if (triangleIndices.size() <= LEAF_COUNT_THRESHOLD)
+  if (triangleIndices.size() <= maxLeafSize)
     return makeLeafNode( triangleIndices );
   
   // Find K seed boxes
@@ -257,35 +522,350 @@ BVH_node * BVH::buildSubtree( seq<int> &triangleIndices, int depth )
 
 
 
-// Distance between two bounding boxes (stored in nodes) from Meister
-// and Bittner "Parallel BVH Construction ..." paper.
+// Build a BVH subtree with the binned surface area heuristic (SAH)
+//
+// 'indices' are the primitives of the subtree, and 'boxes' and
+// 'centroids' are indexed by primitive.
+//
+// The primitive centroids are put into NUM_SAH_BINS bins along each
+// axis.  Each of the NUM_SAH_BINS-1 planes between bins is a
+// candidate split, with cost
+//
+//   SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * (A_left N_left + A_right N_right) / A
+//
+// for surface areas A and primitive counts N.  The cheapest split is
+// used, unless a leaf is cheaper and small enough.  The indices are
+// partitioned in place, so each level takes linear time.
+//
+// With a thread pool, the two children of a large node are built as
+// separate jobs, and the few nodes near the root (which have too many
+// primitives for the subtree jobs to keep the threads busy) also
+// find their bounds and fill their bins in parallel.  The tree is
+// the same as that built on one thread.
+//
+// Upon call, there is guaranteed to be at least one primitive.
 
-float BVH::boxBoxDistance( BBox &b1, BBox &b2 )
+
+static float surfaceArea( BBox &b )
 
 {
-  return (b1.min - b2.min).squaredLength() + (b1.max - b2.max).squaredLength();
+  vec3 d = b.max - b.min;
+  return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
 }
 
 
+static void growBox( BBox &b, BBox &other )
+
+{
+  b.min.x = MIN( b.min.x, other.min.x );
+  b.min.y = MIN( b.min.y, other.min.y );
+  b.min.z = MIN( b.min.z, other.min.z );
+
+  b.max.x = MAX( b.max.x, other.max.x );
+  b.max.y = MAX( b.max.y, other.max.y );
+  b.max.z = MAX( b.max.z, other.max.z );
+}
+
 
-// Return a bounding box around a triangle
+// Run job(0) ... job(numJobs-1), job(0) on this thread and the others
+// on the pool.  While waiting, this thread runs queued jobs, which
+// may be the ones it submitted, and sleeps when there are none.
 
-BBox BVH::triangleBBox( int triIndex )
+static void runInParallel( ThreadPool *pool, int numJobs, std::function<void(int)> job )
 
 {
-  vec3 &v0 = (*vertices)[triangles[triIndex].v0];
-  vec3 &v1 = (*vertices)[triangles[triIndex].v1];
-  vec3 &v2 = (*vertices)[triangles[triIndex].v2];
+  std::atomic<int> numDone( 0 );
+
+  for (int i=1; i<numJobs; i++)
+    pool->submit( [&job,&numDone,i]() { job(i); numDone++; } );
+
+  job(0);
+  numDone++;
+
+  pool->runJobsUntil( [&]() { return numDone == numJobs; } );
+}
+
+
+// The bins of all three axes
+
+class SAHBins {
+
+public:
+
+  BBox boxes[3][NUM_SAH_BINS];
+  int  counts[3][NUM_SAH_BINS];
+
+  SAHBins() {
+    for (int axis=0; axis<3; axis++)
+      for (int b=0; b<NUM_SAH_BINS; b++)
+	counts[axis][b] = 0;
+  }
+
+  void add( SAHBins &other ) {
+    for (int axis=0; axis<3; axis++)
+      for (int b=0; b<NUM_SAH_BINS; b++)
+	if (other.counts[axis][b] > 0) {
+	  if (counts[axis][b] == 0)
+	    boxes[axis][b] = other.boxes[axis][b];
+	  else
+	    growBox( boxes[axis][b], other.boxes[axis][b] );
+	  counts[axis][b] += other.counts[axis][b];
+	}
+  }
+};
+
+
+// Bounds of the primitives and of their centroids
+
+static void findBounds( BBox *boxes, vec3 *centroids, int *indices, int numIndices, BBox &bbox, BBox &centroidBox )
+
+{
+  bbox = boxes[ indices[0] ];
+  centroidBox = BBox( centroids[ indices[0] ], centroids[ indices[0] ] );
+
+  for (int i=1; i<numIndices; i++) {
+    vec3 &c = centroids[ indices[i] ];
+    BBox cBox( c, c );
+    growBox( bbox, boxes[ indices[i] ] );
+    growBox( centroidBox, cBox );
+  }
+}
+
+
+// Put the primitives into the bins of each axis on which the
+// centroids are not all in the same plane
+
+static void fillBins( BBox *boxes, vec3 *centroids, int *indices, int numIndices, BBox &centroidBox, SAHBins &bins )
+
+{
+  for (int axis=0; axis<3; axis++) {
+
+    float cmin = centroidBox.min[axis];
+    float cmax = centroidBox.max[axis];
+
+    if (cmax <= cmin)
+      continue;
+
+    float binScale = NUM_SAH_BINS / (cmax - cmin);
+
+    BBox *binBoxes  = bins.boxes[axis];
+    int  *binCounts = bins.counts[axis];
+
+    for (int i=0; i<numIndices; i++) {
+
+      int t = indices[i];
+      int b = (int) ((centroids[t][axis] - cmin) * binScale);
+      if (b >= NUM_SAH_BINS)
+	b = NUM_SAH_BINS-1;
+
+      if (binCounts[b] == 0)
+	binBoxes[b] = boxes[t];
+      else
+	growBox( binBoxes[b], boxes[t] );
+      binCounts[b]++;
+    }
+  }
+}
+
+
+BVH_node * BVH::buildSubtreeSAH( BBox *boxes, vec3 *centroids, int *indices, int numIndices, int depth, ThreadPool *pool )
+
+{
+  if (numIndices <= 1)
+    return makeLeafNode( boxes, indices, numIndices );
+
+  // Bounds of the triangles and of their centroids, and the bins.
+  // Near the root, each job does a contiguous range of the indices.
+
+  BBox    bbox, centroidBox;
+  SAHBins bins;
+
+  if (pool != NULL && numIndices >= PARALLEL_BINNING_MIN) {
+
+    int numJobs = pool->size() + 1;
+
+    BBox    *jobBoxes         = new BBox[ numJobs ];
+    BBox    *jobCentroidBoxes = new BBox[ numJobs ];
+    SAHBins *jobBins          = new SAHBins[ numJobs ];
+
+    auto jobStart = [=]( int i ) { return (int) ((long long) numIndices * i / numJobs); };
+
+    runInParallel( pool, numJobs, [&]( int i ) {
+	findBounds( boxes, centroids, indices + jobStart(i), jobStart(i+1) - jobStart(i), jobBoxes[i], jobCentroidBoxes[i] );
+      } );
+
+    bbox = jobBoxes[0];
+    centroidBox = jobCentroidBoxes[0];
+
+    for (int i=1; i<numJobs; i++) {
+      growBox( bbox, jobBoxes[i] );
+      growBox( centroidBox, jobCentroidBoxes[i] );
+    }
+
+    runInParallel( pool, numJobs, [&]( int i ) {
+	fillBins( boxes, centroids, indices + jobStart(i), jobStart(i+1) - jobStart(i), centroidBox, jobBins[i] );
+      } );
+
+    for (int i=0; i<numJobs; i++)
+      bins.add( jobBins[i] );
+
+    delete [] jobBoxes;
+    delete [] jobCentroidBoxes;
+    delete [] jobBins;
+
+  } else {
 
-  vec3 min( MIN(v0.x,MIN(v1.x,v2.x)),
-	    MIN(v0.y,MIN(v1.y,v2.y)),
-	    MIN(v0.z,MIN(v1.z,v2.z)) );
+    findBounds( boxes, centroids, indices, numIndices, bbox, centroidBox );
+    fillBins( boxes, centroids, indices, numIndices, centroidBox, bins );
+  }
+
+  // Find the cheapest split over all axes
+
+  float bestCost  = MAXFLOAT;
+  int   bestAxis  = -1;
+  int   bestSplit = -1;  // split after this bin
+
+  for (int axis=0; axis<3; axis++) {
+
+    if (centroidBox.max[axis] <= centroidBox.min[axis])
+      continue; // all centroids are in the same plane on this axis
+
+    BBox *binBoxes  = bins.boxes[axis];
+    int  *binCounts = bins.counts[axis];
+
+    // Sweep from the right to get the area and count to the right of each plane
+
+    float rightArea[NUM_SAH_BINS];
+    int   rightCount[NUM_SAH_BINS];
+
+    BBox box;
+    int  count = 0;
+
+    for (int b=NUM_SAH_BINS-1; b>0; b--) {
+      if (binCounts[b] > 0) {
+	if (count == 0)
+	  box = binBoxes[b];
+	else
+	  growBox( box, binBoxes[b] );
+	count += binCounts[b];
+      }
+      rightArea[b]  = (count > 0 ? surfaceArea( box ) : 0);
+      rightCount[b] = count;
+    }
+
+    // Sweep from the left and evaluate the cost of each plane
+
+    count = 0;
+
+    for (int b=0; b<NUM_SAH_BINS-1; b++) {
+      if (binCounts[b] > 0) {
+	if (count == 0)
+	  box = binBoxes[b];
+	else
+	  growBox( box, binBoxes[b] );
+	count += binCounts[b];
+      }
+
+      if (count == 0 || rightCount[b+1] == 0)
+	continue;
+
+      float cost = count * surfaceArea( box ) + rightCount[b+1] * rightArea[b+1];
+
+      if (cost < bestCost) {
+	bestCost  = cost;
+	bestAxis  = axis;
+	bestSplit = b;
+      }
+    }
+  }
+
+  // Make a leaf if it is no more expensive than the best split and
+  // is small enough.
+
+  float parentArea = surfaceArea( bbox );
+
+  if (bestAxis >= 0)
+    bestCost = SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * bestCost / (parentArea > 0 ? parentArea : 1);
+
+  if (numIndices <= maxLeafSize && (bestAxis < 0 || SAH_INTERSECTION_COST * numIndices <= bestCost))
+    return makeLeafNode( boxes, indices, numIndices );
+
+  int numLeft;
+
+  if (bestAxis < 0)
+
+    // No plane separates the centroids, since they all coincide.
+    // Split the indices in half, so that the leaves stay small.
+
+    numLeft = numIndices / 2;
+
+  else {
+
+    // Partition the indices about the split plane
+
+    float cmin     = centroidBox.min[bestAxis];
+    float binScale = NUM_SAH_BINS / (centroidBox.max[bestAxis] - cmin);
+
+    int *left  = indices;
+    int *right = indices + numIndices - 1;
+
+    while (left <= right) {
+
+      int b = (int) ((centroids[*left][bestAxis] - cmin) * binScale);
+      if (b >= NUM_SAH_BINS)
+	b = NUM_SAH_BINS-1;
+
+      if (b <= bestSplit)
+	left++;
+      else {
+	int temp = *left; *left = *right; *right = temp;
+	right--;
+      }
+    }
+
+    numLeft = left - indices;
+  }
+
+  // Build the node.  The children have disjoint ranges of the
+  // indices, so they can be built at the same time.
+
+  BVH_node *children[2];
+
+  if (pool != NULL && numIndices >= PARALLEL_SUBTREE_MIN)
+
+    runInParallel( pool, 2, [&]( int i ) {
+	if (i == 0)
+	  children[0] = buildSubtreeSAH( boxes, centroids, indices, numLeft, depth+1, pool );
+	else
+	  children[1] = buildSubtreeSAH( boxes, centroids, indices + numLeft, numIndices - numLeft, depth+1, pool );
+      } );
+
+  else {
+    children[0] = buildSubtreeSAH( boxes, centroids, indices, numLeft, depth+1, pool );
+    children[1] = buildSubtreeSAH( boxes, centroids, indices + numLeft, numIndices - numLeft, depth+1, pool );
+  }
+
+  BVH_node *n = new BVH_node();
 
-  vec3 max( MAX(v0.x,MAX(v1.x,v2.x)),
-	    MAX(v0.y,MAX(v1.y,v2.y)),
-	    MAX(v0.z,MAX(v1.z,v2.z)) );
+  n->isLeaf   = false;
+  n->bbox     = bbox;
+  n->children = new seq<BVH_node*>( 2 );
 
-  return BBox(min,max);
+  n->children->add( children[0] );
+  n->children->add( children[1] );
+
+  return n;
+}
+
+
+
+// Distance between two bounding boxes (stored in nodes) from Meister
+// and Bittner "Parallel BVH Construction ..." paper.
+
+float BVH::boxBoxDistance( BBox &b1, BBox &b2 )
+
+{
+  return (b1.min - b2.min).squaredLength() + (b1.max - b2.max).squaredLength();
 }
 
 
@@ -314,19 +894,33 @@ BBox BVH::trianglesBBox( seq<int> &triangleIndices )
 }
 
 
+BBox BVH::boxesBBox( BBox *boxes, int *indices, int numIndices )
+
+{
+  BBox bbox = boxes[ indices[0] ];
+
+  for (int i=1; i<numIndices; i++)
+    growBox( bbox, boxes[ indices[i] ] );
+
+  return bbox;
+}
+
+
 // Intersect a ray with an axis-aligned bounding box (only the box).
 //
 // Box is [vmin,vmax].  Ray parameters are restricted to [tmin,tmax].
 // Return true iff ray intersects box (even if starting from the inside).
+// 'invDir' is 1/rayDir, per component.  'tEntry' is the parameter at
+// which the ray enters the box (or tmin if it starts inside).
 
-bool BVH::rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox &bbox )
+bool BVH::rayBoxInt( vec3 &rayStart, vec3 &invDir, float tmin, float tmax, BBox &bbox, float &tEntry )
 
 {
   // ---------------- START SOLUTION CODE ----------------
 
   for (int i=0; i<3; ++i) {
 
-    float invD = 1.0f / rayDir[i]; // handles division by zero correctly (i.e. IEEE Inf)
+    float invD = invDir[i];
 
     float t0 = (bbox.min[i] - rayStart[i]) * invD;
     float t1 = (bbox.max[i] - rayStart[i]) * invD;
@@ -338,12 +932,14 @@ bool BVH::rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox
     tmin = (t0 > tmin) ? t0 : tmin; // farthest min distance
     tmax = (t1 < tmax) ? t1 : tmax; // closest max distance
 
-    if (tmax <= tmin) // crossing outside an edge (or corner)
-       return false;
+    if (tmax < tmin) // crossing outside an edge (or corner).  Not <=, since a flat box
+       return false; // (e.g. around an axis-aligned triangle) has tmax == tmin.
   }
 
   // ---------------- END SOLUTION CODE ----------------
 
+  tEntry = tmin;
+
   return true;
 }
 
@@ -352,15 +948,17 @@ bool BVH::rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox
 // Draw a certain number of levels of the BVH.
 
 
-void BVH::renderSubtreeGL( BVH_node *n, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining )
+void BVH::renderSubtreeGL( int nodeIndex, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining )
 
 {
   if (levelsRemaining < 0)
     return;
 
+  BVH_flatNode *n = &nodes[nodeIndex];
+
   if (!n->isLeaf)
-    for (int i=0; i<n->children->size(); i++)
-      renderSubtreeGL( (*n->children)[i], WCS_to_VCS, WCS_to_CCS, lightDir, levelsRemaining-1 );
+    for (int i=0; i<n->count; i++)
+      renderSubtreeGL( n->offset+i, WCS_to_VCS, WCS_to_CCS, lightDir, levelsRemaining-1 );
 
   if (levelsRemaining == 0)
     n->bbox.renderGL( WCS_to_VCS, WCS_to_CCS, lightDir );
@@ -373,107 +971,375 @@ void BVH::renderSubtreeGL( BVH_node *n, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3
 // 'sourceTriangleIndex' is passed in as the triangleIndex of the
 // originating triangle.  Do not check for intersection with this
 // triangle.
+//
+// The wide tree is traversed with an explicit stack.  All children
+// of a node are tested at once with wideBoxTest(), and those hit are
+// pushed farthest-first, so the nearest is visited first and its hit
+// shortens the ray for the others.  Each stack entry keeps its box
+// entry parameter, so entries beyond the closest hit so far are
+// skipped when popped.  An entry is either a wide node or a leaf's
+// range of triangles.
+
 
+class BVH_stackEntry {
+public:
+  int   child;			// wide node index, or first triangle
+  int   count;			// 0 for a node, or number of triangles
+  float tEntry;
+};
 
-bool BVH::rayIntBVH( BVH_node*n, vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 & intTexCoords, float & intParam, Material * &intMaterial, int &intTriangleIndex )
+
+bool BVH::rayIntBVH( vec3 &rayStart, vec3 &rayDir, int sourceTriangleIndex, float maxParam, HitRecord &hit )
 
 {
-  bool hit = false;
+  bool found = false;
+
+  WideBVH_ray ray( rayStart, rayDir );
+
+  BVH_stackEntry stack[ BVH_STACK_SIZE ];
+
+  stack[0].child  = 0;
+  stack[0].count  = 0;
+  stack[0].tEntry = 0;
+  int numPending = 1;
+
+  while (numPending > 0) {
+
+    BVH_stackEntry entry = stack[ --numPending ];
+
+    if (entry.tEntry >= maxParam) // box is beyond the closest hit so far
+      continue;
 
-  if (n->isLeaf) { // A leaf, so check all the triangles
+    if (entry.count > 0) { // A leaf, so check all the triangles
 
-    for (int i=0; i<n->triangles->size(); i++) {
-      int triangleIndex = (*n->triangles)[i];
-      if (triangleIndex != sourceTriangleIndex) { // this isn't the triangle from which the ray started
+      for (int triangleIndex=entry.child; triangleIndex<entry.child+entry.count; triangleIndex++)
+	if (triangleIndex != sourceTriangleIndex) { // this isn't the triangle from which the ray started
 
-	float param, alpha, beta, gamma;
-	vec3 point, normal, texcoords;
+	  float param, alpha, beta;
 
-	if (triangleInt( rayStart, rayDir, triangleIndex, maxParam, param, point, normal, texcoords, alpha, beta, gamma )) { // returns param, point, alpha, beta, gamma
+	  if (triangleHit( rayStart, rayDir, triangleIndex, maxParam, param, alpha, beta )) {
 
-	  // found a new closest point
+	    // found a new closest point.  Its normal, etc. are found
+	    // later by hitInfo(), if it is still the closest.
 
-	  intParam  = param;
-	  intPoint  = point;
-	  intNormal = normal;
-	  intTexCoords = texcoords;
-	  intTriangleIndex = triangleIndex;
-	  intMaterial = materials[ triangles[ (*n->triangles)[i] ].materialID ]; 
+	    hit.t         = param;
+	    hit.partIndex = triangleIndex;
+	    hit.alpha     = alpha;
+	    hit.beta      = beta;
 
-	  maxParam = param;
-	  hit = true;
+	    maxParam = param;
+	    found = true;
+	  }
+	}
+
+    } else { // A node, so push the children that the ray hits
+
+      WideBVH_node &n = wideNodes[ entry.child ];
+
+      float tEntry[ WIDE_BVH_WIDTH ];
+      int mask = wideBoxTest( n, ray, maxParam, tEntry );
+
+      int firstPushed = numPending;
+
+      for (int i=0; mask != 0; i++, mask >>= 1)
+	if (mask & 1) {
+
+	  // Insert in order of decreasing t, so the nearest child is on top
+
+	  float t = tEntry[i];
+
+	  int j = numPending++;
+	  while (j > firstPushed && stack[j-1].tEntry < t) {
+	    stack[j] = stack[j-1];
+	    j--;
+	  }
+	  stack[j].child  = n.child[i];
+	  stack[j].count  = n.count[i];
+	  stack[j].tEntry = t;
 	}
-      }
     }
+  }
+
+  return found;
+}
+  
+
+
+// Is any triangle other than 'sourceTriangleIndex' hit with
+// parameter in [0,maxParam)?
+//
+// This is for shadow rays.  It returns at the first hit found, so the
+// children are pushed in any order, and no intersection point,
+// normal, or texture coordinates are computed.
 
-    // Note that bump mapping is not implemented yet, but should be
-    // done here to return the bump-mapped normal.
 
-  } else { // Not a leaf, so recurse into children
+bool BVH::occluded( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam )
 
-    for (int i=0; i<n->children->size(); i++) {
-      BVH_node *thisNode = (*n->children)[i];
-      if (rayBoxInt( rayStart, rayDir, 0, maxParam, thisNode->bbox )) {
-	if (rayIntBVH( thisNode, rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, intMaterial, intTriangleIndex )) {
-	  maxParam = intParam;
-	  hit = true;
+{
+  if (wideNodes == NULL)
+    return false;
+
+  WideBVH_ray ray( rayStart, rayDir );
+
+  int stack[ BVH_STACK_SIZE ];  // wide node indices
+  int numPending = 0;
+
+  stack[numPending++] = 0;
+
+  while (numPending > 0) {
+
+    WideBVH_node &n = wideNodes[ stack[--numPending] ];
+
+    float tEntry[ WIDE_BVH_WIDTH ];
+    int mask = wideBoxTest( n, ray, maxParam, tEntry );
+
+    for (int i=0; mask != 0; i++, mask >>= 1)
+      if (mask & 1) {
+
+	if (n.count[i] == 0) // a node
+	  stack[numPending++] = n.child[i];
+
+	else // a leaf
+
+	  for (int triangleIndex=n.child[i]; triangleIndex<n.child[i]+n.count[i]; triangleIndex++)
+	    if (triangleIndex != sourceTriangleIndex) {
+	      float param, alpha, beta;
+	      if (triangleHit( rayStart, rayDir, triangleIndex, maxParam, param, alpha, beta ))
+		return true;
+	    }
+      }
+  }
+
+  return false;
+}
+
+
+
+// Trace rays [first,last] of a coherent packet.
+//
+// This traverses the binary tree, not the wide one.  A node is
+// skipped if the packet's frustum misses it, or if no ray in the
+// range hits its box; otherwise the range is narrowed to the rays
+// that do, and passed to the children.  The children are visited in
+// order of their distance along the packet's average direction.
+//
+// A ray starting on this object skips its originating triangle.
+
+
+void BVH::rayIntPacket( RayPacket &packet, int objIndex, int first, int last )
+
+{
+  if (nodes == NULL)
+    return;
+
+  struct {
+    int   nodeIndex;
+    int   first, last;
+    float dist;
+  } stack[ BVH_STACK_SIZE ];
+
+  stack[0].nodeIndex = 0;
+  stack[0].first     = first;
+  stack[0].last      = last;
+  int numPending = 1;
+
+  while (numPending > 0) {
+
+    numPending--;
+
+    BVH_flatNode &n = nodes[ stack[numPending].nodeIndex ];
+    first = stack[numPending].first;
+    last  = stack[numPending].last;
+
+    if (packet.frustumMisses( n.bbox ) || !packet.findRange( n.bbox, first, last ))
+      continue;
+
+    if (n.isLeaf) { // A leaf, so check each ray against all the triangles
+
+      for (int r=first; r<=last; r++) {
+
+	int sourceTriangleIndex = (packet.thisObjIndex[r] == objIndex ? packet.thisObjPartIndex[r] : -1);
+
+	for (int triangleIndex=n.offset; triangleIndex<n.offset+n.count; triangleIndex++)
+	  if (triangleIndex != sourceTriangleIndex) {
+
+	    float param, alpha, beta;
+
+	    if (triangleHit( packet.origin[r], packet.dir[r], triangleIndex, packet.maxParam[r], param, alpha, beta )) {
+
+	      HitRecord &hit = packet.hit[r];
+
+	      hit.t         = param;
+	      hit.objIndex  = objIndex;
+	      hit.partIndex = triangleIndex;
+	      hit.alpha     = alpha;
+	      hit.beta      = beta;
+
+	      packet.maxParam[r] = param;
+	      packet.found[r] = true;
+	    }
+	  }
+      }
+
+    } else { // Not a leaf, so push the children, farthest first
+
+      int firstPushed = numPending;
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+
+	float dist = packet.distance( nodes[i].bbox );
+
+	int j = numPending++;
+	while (j > firstPushed && stack[j-1].dist < dist) {
+	  stack[j] = stack[j-1];
+	  j--;
 	}
+	stack[j].nodeIndex = i;
+	stack[j].first     = first;
+	stack[j].last      = last;
+	stack[j].dist      = dist;
       }
     }
   }
+}
+
+
+
+// Find the rays [first,last] of a coherent packet that are blocked.
+//
+// A blocked ray is made inactive, and traversal stops once no rays
+// are active.
+
 
-  return hit;
+void BVH::occludedPacket( RayPacket &packet, int objIndex, int first, int last )
+
+{
+  if (nodes == NULL)
+    return;
+
+  struct {
+    int nodeIndex;
+    int first, last;
+  } stack[ BVH_STACK_SIZE ];
+
+  stack[0].nodeIndex = 0;
+  stack[0].first     = first;
+  stack[0].last      = last;
+  int numPending = 1;
+
+  while (numPending > 0 && packet.numActive > 0) {
+
+    numPending--;
+
+    BVH_flatNode &n = nodes[ stack[numPending].nodeIndex ];
+    first = stack[numPending].first;
+    last  = stack[numPending].last;
+
+    if (packet.frustumMisses( n.bbox ) || !packet.findRange( n.bbox, first, last ))
+      continue;
+
+    if (n.isLeaf) {
+
+      for (int r=first; r<=last; r++)
+	if (packet.active[r]) {
+
+	  int sourceTriangleIndex = (packet.thisObjIndex[r] == objIndex ? packet.thisObjPartIndex[r] : -1);
+
+	  for (int triangleIndex=n.offset; triangleIndex<n.offset+n.count; triangleIndex++)
+	    if (triangleIndex != sourceTriangleIndex) {
+
+	      float param, alpha, beta;
+
+	      if (triangleHit( packet.origin[r], packet.dir[r], triangleIndex, packet.maxParam[r], param, alpha, beta )) {
+		packet.found[r]  = true;
+		packet.active[r] = false;
+		packet.numActive--;
+		break;
+	      }
+	    }
+	}
+
+    } else
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+	stack[numPending].nodeIndex = i;
+	stack[numPending].first     = first;
+	stack[numPending].last      = last;
+	numPending++;
+      }
+  }
 }
-  
+
 
 
 // Adapted from triangle.cpp for use by BVH
+//
+// triangleHit() finds only the parameter and barycentric coordinates
+// of an intersection with parameter in [0,maxParam).  hitInfo() finds
+// the point, normal, and texture coordinates of the closest one.
 
-bool BVH::triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, vec3 &point, vec3 &normal, vec3 &texCoord, float &alpha, float &beta, float &gamma )
+bool BVH::triangleHit( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, float &alpha, float &beta )
 
 {
-  BVH_triangle &tri = triangles[triangleIndex];
+  // Moller-Trumbore: solve rayStart + t rayDir = v0 + alpha edge1 + beta edge2
+  // by Cramer's rule, rejecting as early as possible.
 
-  vec3 &v0 = (*vertices)[ tri.v0 ];
-  vec3 &v1 = (*vertices)[ tri.v1 ];
-  vec3 &v2 = (*vertices)[ tri.v2 ];
+  BVH_triangleData &tri = triangleData.array()[ triangleIndex ];
 
-  vec3 faceNormal = (*facetnorms)[ tri.faceID ];
+  vec3 pvec = rayDir ^ tri.edge2;
+  float det = tri.edge1 * pvec;
+
+  if (fabs(det) < tri.minDet) // allows intersection from behind the plane
+    return false; // ray is parallel to plane.
 
-  // Compute ray/plane intersection
+  float invDet = 1 / det;
 
-  float dn = rayDir * faceNormal;
+  vec3 tvec = rayStart - tri.v0;
 
-  if (fabs(dn) < 0.0001) // 'fabs' allows intersection from behind the plane.
-    return false; // ray is parallel to plane.
+  float thisAlpha = (tvec * pvec) * invDet; // for v1
+  if (thisAlpha < 0 || thisAlpha > 1)
+    return false; // outside of triangle
+
+  vec3 qvec = tvec ^ tri.edge1;
+
+  float thisBeta = (rayDir * qvec) * invDet; // for v2
+  if (thisBeta < 0 || thisAlpha + thisBeta > 1)
+    return false; // outside of triangle
+
+  float t = (tri.edge2 * qvec) * invDet;
 
-  float t = (faceNormal*(v0-rayStart)) / dn;
   if (t < 0)
     return false; // plane is behind starting point
 
   if (t >= maxParam)
     return false; // a closer intersection (at 'maxParam') has already been detected in other code
-  
-  vec3 thisPoint = rayStart + t * rayDir;
 
-  // Compute barycentric coords
+  param  = t;
+  alpha  = thisAlpha;
+  beta   = thisBeta;
 
-  float denom = ((v1-v0) ^ (v2-v0)) * faceNormal; // should cache this cross product.
+  return true;
+}
 
-  float thisBeta  = (((v1-v0) ^ (thisPoint - v0)) * faceNormal) / denom; // for v2
-  float thisAlpha = (((thisPoint-v0) ^ (v2 - v0)) * faceNormal) / denom; // for v1
-  float thisGamma = 1 - thisAlpha - thisBeta; // for v0
 
-  if (thisAlpha < 0 || thisBeta < 0 || thisGamma < 0)
-    return false; // outside of triangle
+void BVH::hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit, vec3 &point, vec3 &normal, vec3 &texCoord, Material * &mat )
+
+{
+  BVH_triangle &tri = triangles[ hit.partIndex ];
+
+  vec3 faceNormal = (*facetnorms)[ tri.faceID ];
+
+  float alpha = hit.alpha;
+  float beta  = hit.beta;
+  float gamma = 1 - alpha - beta;
 
   // Return intersection info
 
-  param  = t;
-  point  = thisPoint;
-  alpha  = thisAlpha;
-  beta   = thisBeta;
-  gamma  = thisGamma;
+  point = rayStart + hit.t * rayDir;
+  mat   = materials[ tri.materialID ];
+
+  // Note that bump mapping is not implemented yet, but should be
+  // done here to return the bump-mapped normal.
 
   if (!obj->hasVertexNormals)
     
@@ -496,6 +1362,4 @@ bool BVH::triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float ma
 
     texCoord = gamma*t0 + alpha*t1 + beta*t2;
   }
-
-  return true;
 }
@@ -12,6 +12,11 @@
 #include "bbox.h"
 #include "main.h"
 #include "wavefront.h"
+#include "wideBVH.h"
+
+
+class RayPacket;
+class ThreadPool;
 
 
 class BVH_triangle {
@@ -40,6 +45,35 @@ public:
 
 
 
+// Intersection data for a triangle, precomputed so that
+// BVH::triangleHit() does not gather vertices through the indices in
+// BVH_triangle or recompute the edges for every ray.
+//
+// BVH::triangleData[i] goes with BVH::triangles[i].
+
+class BVH_triangleData {
+
+public:
+
+  vec3  v0;			// first vertex
+  vec3  edge1, edge2;		// v1-v0 and v2-v0
+  float minDet;			// rays with |determinant| below this are parallel to the triangle
+
+  BVH_triangleData() {}
+
+  BVH_triangleData( vec3 &_v0, vec3 &v1, vec3 &v2 ) {
+    v0     = _v0;
+    edge1  = v1 - v0;
+    edge2  = v2 - v0;
+    minDet = 0.0001 * (edge1 ^ edge2).length(); // i.e. |rayDir * unit normal| < 0.0001
+  }
+};
+
+
+
+// A node of the tree while it is being built.  buildTree() then
+// flattens the tree into an array of BVH_flatNodes.
+
 class BVH_node {
 
 public:
@@ -54,27 +88,80 @@ public:
 
 
 
-class BVH {
+// A node of the flattened tree
+//
+// Nodes are stored depth-first in one array, except that the children
+// of a node are stored next to each other, so that a node needs only
+// the index of its first child.  The triangles of a leaf are likewise
+// contiguous in BVH::triangles.
+//
+// This is exactly 32 bytes, so a node never straddles a cache line.
+
+class BVH_flatNode {
+
+public:
+
+  BBox  bbox;			// 24 bytes
+  int   offset;			// leaf: index of first triangle; non-leaf: index of first child
+  short count;			// leaf: number of triangles; non-leaf: number of children
+  short isLeaf;
+};
+
+#define BVH_NODE_ALIGNMENT 32
+#define BVH_STACK_SIZE    256	// max number of nodes pending during traversal
 
-  bool rayBoxInt( vec3 &rayStart, vec3 &rayDir, float tmin, float tmax, BBox &bbox );
 
-  void freeTree( BVH_node *n ) {
-    if (!n->isLeaf)
-      for (int i=0; i<n->children->size(); i++)
-	freeTree( (*n->children)[i] );
-    delete n;
-  }
+
+// How the BVH is built
+
+enum BVHBuildMethod {
+  BVH_KMEANS,			// up to K children per node, clustered with k-means
+  BVH_SAH			// two children per node, split with the binned surface area heuristic
+};
+
+
+class BVH {
 
   BVH_node *buildSubtree( seq<int> &triangleIndices, int depth );
   BVH_node *makeLeafNode( seq<int> &triangleIndices );
 
-  BBox triangleBBox( int triIndex );
+  BBox *triBoxes;		// bounding box of each triangle (only during buildTree())
+  vec3 *triCentroids;		// centre of each triangle's bounding box (only during buildTree())
+
+  BBox triangleBBox( int triIndex ) {
+    return triBoxes[triIndex];
+  }
+
   BBox trianglesBBox( seq<int> &triangleIndices );
 
   float boxBoxDistance( BBox &b1, BBox &b2 );
 
+  static BVH_node *makeLeafNode( BBox *boxes, int *indices, int numIndices );
+  static BBox boxesBBox( BBox *boxes, int *indices, int numIndices );
+
 public:
 
+  // Building blocks that are shared with the scene's ObjectBVH.  The
+  // SAH builder works on any primitives, given their 'boxes' and
+  // 'centroids', and puts primitive indices in the leaves.  With a
+  // 'pool', large subtrees are built in parallel.
+
+  static BVH_node *buildSubtreeSAH( BBox *boxes, vec3 *centroids, int *indices, int numIndices, int depth, ThreadPool *pool = NULL );
+
+  static int  countNodes( BVH_node *n, int &maxPending );
+  static void flattenTree( BVH_node *n, BVH_flatNode *nodes, int nodeIndex, int &nextFreeNode, seq<int> &leafOrder );
+  static BVH_flatNode *allocNodes( int n );
+  static void freeNodes( BVH_flatNode *nodes );
+
+  static void freeTree( BVH_node *n ) {
+    if (!n->isLeaf)
+      for (int i=0; i<n->children->size(); i++)
+	freeTree( (*n->children)[i] );
+    delete n;
+  }
+
+  static bool rayBoxInt( vec3 &rayStart, vec3 &invDir, float tmin, float tmax, BBox &bbox, float &tEntry );
+
   wfModel   *obj;
   seq<vec3> *vertices;
   seq<vec3> *texcoords;
@@ -82,43 +169,52 @@ public:
   seq<vec3> *facetnorms;
   seq<Material*> materials;
   seq<BVH_triangle> triangles;
+  seq<BVH_triangleData> triangleData;
+
+  BVH_flatNode *nodes;		// flattened tree; nodes[0] is the root
+  int           numNodes;
+
+  WideBVH_node *wideNodes;	// the same tree collapsed to 8-wide nodes, for traversal
+  int           numWideNodes;
 
-  BVH_node *root;
+  static BVHBuildMethod buildMethod; // BVH_SAH by default
+  static int            maxLeafSize; // max number of triangles in a leaf
 
   BVH() {
-    root = NULL;
+    nodes = NULL;
+    numNodes = 0;
+    wideNodes = NULL;
+    numWideNodes = 0;
+    triBoxes = NULL;
+    triCentroids = NULL;
   }
 
   ~BVH() {
-    if (root != NULL)
-      freeTree( root );
+    if (nodes != NULL)
+      freeNodes( nodes );
+    if (wideNodes != NULL)
+      freeWideNodes( wideNodes );
     // Note that vertices, texcoords, and materials are stored
     // elsewhere and should not be deleted here.
   }
 
-  void buildTree() {
-    // cout << "Building with " << vertices->size() << " vertices, " << texcoords->size() << " texcoords, " << materials.size() << " materials, " << triangles.size() << " triangles." << endl;
-    if (triangles.size() == 0)
-      root = NULL;
-    else {
-      // Create a sequence of all triangle indices
-      seq<int> triangleIndices( triangles.size() );
-      for (int i=0; i<triangles.size(); i++)
-	triangleIndices.add( i );
-      // Build the tree
-      root = buildSubtree( triangleIndices, 0 );
-    }
-  };
+  void buildTree();
   
-  bool rayInt( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 &intPoint, vec3 &intNormal, vec3 &intTexCoords, float &intParam, Material * &mat, int &intTriangleIndex ) {
-    if (root == NULL)
+  bool rayInt( vec3 &rayStart, vec3 &rayDir, int sourceTriangleIndex, float maxParam, HitRecord &hit ) {
+    if (wideNodes == NULL)
       return false;
-    return rayIntBVH( root, rayStart, rayDir, sourceTriangleIndex, maxParam, intPoint, intNormal, intTexCoords, intParam, mat, intTriangleIndex );
+    return rayIntBVH( rayStart, rayDir, sourceTriangleIndex, maxParam, hit );
+  }
+
+  BBox bbox() {
+    if (nodes == NULL)
+      return BBox( vec3(0,0,0), vec3(0,0,0) ); // no triangles
+    return nodes[0].bbox;
   }
 
   void renderGL( mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir ) {
-    if (root != NULL)
-      renderSubtreeGL( root, WCS_to_VCS, WCS_to_CCS, lightDir, scene->bvhDisplayDepth );
+    if (nodes != NULL)
+      renderSubtreeGL( 0, WCS_to_VCS, WCS_to_CCS, lightDir, scene->bvhDisplayDepth );
   }
 
   // Determine the texture colour at a point
@@ -131,11 +227,21 @@ public:
       return materials[ triangles[triangleIndex].materialID ]->texture->texel( texCoords.x, texCoords.y, alpha );
   }
 
-  bool rayIntBVH( BVH_node *n, vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam, vec3 & intPoint, vec3 & intNormal, vec3 &intTexCoords, float & intParam, Material * &mat, int &intTriangleIndex );
+  bool rayIntBVH( vec3 &rayStart, vec3 &rayDir, int sourceTriangleIndex, float maxParam, HitRecord &hit );
+
+  void renderSubtreeGL( int nodeIndex, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining );
+
+  bool occluded( vec3 rayStart, vec3 rayDir, int sourceTriangleIndex, float maxParam );
+
+  // Trace rays [first,last] of a packet (see rayPacket.h) against the
+  // triangles.  'objIndex' is this object's index in the scene.
+
+  void rayIntPacket( RayPacket &packet, int objIndex, int first, int last );
+  void occludedPacket( RayPacket &packet, int objIndex, int first, int last );
 
-  void renderSubtreeGL( BVH_node *root, mat4 &WCS_to_VCS, mat4 &WCS_to_CCS, vec3 lightDir, int levelsRemaining );
+  bool triangleHit( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, float &alpha, float &beta );
 
-  bool triangleInt( vec3 &rayStart, vec3 &rayDir, int triangleIndex, float maxParam, float &param, vec3 &point, vec3 &normal, vec3 &texcoords, float &alpha, float &beta, float &gamma );
+  void hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit, vec3 &point, vec3 &normal, vec3 &texcoords, Material * &mat );
 
 };
 
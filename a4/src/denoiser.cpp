@@ -0,0 +1,200 @@
+// denoiser.cpp
+
+
+#include "headers.h"
+#include "denoiser.h"
+#include "threadPool.h"
+
+
+#define MIN_ALBEDO 0.01		// avoid dividing by (nearly) zero albedo
+#define ROWS_PER_JOB 16		// rows filtered by each thread pool job
+
+
+Denoiser::Denoiser( int w, int h )
+
+{
+  width  = w;
+  height = h;
+
+  albedo = new vec3[ w * h ];
+  normal = new vec3[ w * h ];
+  depth  = new float[ w * h ];
+
+  for (int i=0; i<w*h; i++) {
+    albedo[i] = vec3(1,1,1);
+    normal[i] = vec3(0,0,0);
+    depth[i]  = 0;
+  }
+}
+
+
+Denoiser::~Denoiser()
+
+{
+  delete [] albedo;
+  delete [] normal;
+  delete [] depth;
+}
+
+
+static vec3 demodulate( vec3 colour, vec3 &albedo )
+
+{
+  return vec3( colour.x / MAX( albedo.x, MIN_ALBEDO ),
+	       colour.y / MAX( albedo.y, MIN_ALBEDO ),
+	       colour.z / MAX( albedo.z, MIN_ALBEDO ) );
+}
+
+
+static vec3 modulate( vec3 lighting, vec3 &albedo )
+
+{
+  return vec3( lighting.x * MAX( albedo.x, MIN_ALBEDO ),
+	       lighting.y * MAX( albedo.y, MIN_ALBEDO ),
+	       lighting.z * MAX( albedo.z, MIN_ALBEDO ) );
+}
+
+
+// Filter the image in place.  The rows of each pass are split among
+// the workers of 'pool' (or filtered on this thread if 'pool' is
+// NULL).
+
+void Denoiser::denoise( vec4 *image, ThreadPool *pool )
+
+{
+  vec3 *in  = new vec3[ width * height ];
+  vec3 *out = new vec3[ width * height ];
+
+  for (int i=0; i<width*height; i++)
+    in[i] = demodulate( vec3( image[i].x, image[i].y, image[i].z ), albedo[i] );
+
+  float colourSigma = DENOISE_COLOUR_SIGMA;
+
+  for (int pass=0, step=1; pass<DENOISE_ITERATIONS; pass++, step*=2) {
+
+    for (int y=0; y<height; y+=ROWS_PER_JOB) {
+      int y1 = MIN( y+ROWS_PER_JOB, height );
+      if (pool != NULL)
+	pool->submit( [=]() { filterRows( in, out, y, y1, step, colourSigma ); } );
+      else
+	filterRows( in, out, y, y1, step, colourSigma );
+    }
+
+    if (pool != NULL)
+      pool->wait();
+
+    vec3 *temp = in;
+    in  = out;
+    out = temp;
+
+    colourSigma /= 2;
+  }
+
+  for (int i=0; i<width*height; i++) {
+    vec3 c = modulate( in[i], albedo[i] );
+    image[i] = vec4( c.x, c.y, c.z, image[i].w );
+  }
+
+  delete [] in;
+  delete [] out;
+}
+
+
+// One a-trous pass over rows [y0,y1) with taps 'step' pixels apart
+
+void Denoiser::filterRows( vec3 *in, vec3 *out, int y0, int y1, int step, float colourSigma )
+
+{
+  static const float kernel[5] = { 1/16.0, 1/4.0, 3/8.0, 1/4.0, 1/16.0 };
+
+  float invColourSigmaSq = 1.0 / (colourSigma * colourSigma);
+
+  for (int y=y0; y<y1; y++)
+    for (int x=0; x<width; x++) {
+
+      int   p  = x + y * width;
+      vec3 &cp = in[p];
+      vec3 &np = normal[p];
+      float dp = depth[p];
+
+      vec3  sum         = vec3(0,0,0);
+      float totalWeight = 0;
+
+      for (int j=-2; j<=2; j++) {
+
+	int qy = y + j * step;
+	if (qy < 0 || qy >= height)
+	  continue;
+
+	for (int i=-2; i<=2; i++) {
+
+	  int qx = x + i * step;
+	  if (qx < 0 || qx >= width)
+	    continue;
+
+	  int   q  = qx + qy * width;
+	  float dq = depth[q];
+
+	  if ((dp == 0) != (dq == 0)) // one is background, the other is not
+	    continue;
+
+	  float weight = kernel[i+2] * kernel[j+2];
+
+	  // Colour
+
+	  vec3 dc = in[q] - cp;
+	  weight *= exp( -(dc * dc) * invColourSigmaSq );
+
+	  // Normal and depth
+
+	  if (dp != 0) {
+
+	    float cosAngle = np * normal[q];
+	    if (cosAngle <= 0)
+	      continue;
+	    weight *= pow( cosAngle, DENOISE_NORMAL_POWER );
+
+	    float tapDist = step * MAX( abs(i), abs(j) );
+	    weight *= exp( -fabs( dq - dp ) / (DENOISE_DEPTH_SIGMA * dp * MAX( tapDist, 1 )) );
+	  }
+
+	  sum = sum + weight * in[q];
+	  totalWeight += weight;
+	}
+      }
+
+      out[p] = (totalWeight > 0 ? (1.0f / totalWeight) * sum : cp); // the centre always has weight > 0
+    }
+}
+
+
+// Convert an AOV into an image, e.g. to write it to a file
+
+void Denoiser::aovImage( AOV aov, vec4 *image )
+
+{
+  float maxDepth = 0;
+
+  for (int i=0; i<width*height; i++)
+    maxDepth = MAX( maxDepth, depth[i] );
+
+  for (int i=0; i<width*height; i++) {
+
+    vec3 c = vec3(0,0,0);
+
+    switch (aov) {
+    case AOV_ALBEDO:
+      c = albedo[i];
+      break;
+    case AOV_NORMAL:
+      c = 0.5 * (normal[i] + vec3(1,1,1));
+      break;
+    case AOV_DEPTH:
+      float d = (maxDepth > 0 ? depth[i] / maxDepth : 0);
+      c = vec3( d, d, d );
+      break;
+    }
+
+    image[i] = vec4( c.x, c.y, c.z, 1 );
+  }
+}
@@ -0,0 +1,65 @@
+// denoiser.h
+//
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al., "Edge-
+// Avoiding A-Trous Wavelet Transform for Fast Global Illumination
+// Filtering", HPG 2010)
+//
+// While the image is traced, each pixel also records the albedo,
+// normal, and depth of the surface that its centre ray hits.  These
+// are the pixel's AOVs ("arbitrary output variables").
+//
+// After the image is done, denoise() runs DENOISE_ITERATIONS passes of
+// a 5x5 B-spline filter whose taps are 1, 2, 4, ... pixels apart.
+// Each neighbour's weight is reduced by how much it differs from the
+// centre pixel in colour, normal, and depth, so noise is smoothed
+// within a surface but not across edges.  The filter works on the
+// colour divided by the albedo (i.e. on the lighting), so texture
+// detail is not blurred, and multiplies the albedo back in at the end.
+
+
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "linalg.h"
+
+
+class ThreadPool;
+
+
+#define DENOISE_ITERATIONS   5		// filter passes (the last has taps 16 pixels apart)
+#define DENOISE_COLOUR_SIGMA 0.25	// colour difference at which weights fall off (halved each pass)
+#define DENOISE_NORMAL_POWER 64		// weight is (normal . normal)^DENOISE_NORMAL_POWER
+#define DENOISE_DEPTH_SIGMA  0.02	// relative depth difference (per pixel of tap distance) at which weights fall off
+
+
+enum AOV { AOV_ALBEDO, AOV_NORMAL, AOV_DEPTH };
+
+
+class Denoiser {
+
+  int    width, height;
+
+  vec3  *albedo;		// albedo of the first surface hit
+  vec3  *normal;		// normal of the first surface hit
+  float *depth;			// distance to the first surface hit (or 0 if none)
+
+  void filterRows( vec3 *in, vec3 *out, int y0, int y1, int step, float colourSigma );
+
+ public:
+
+  Denoiser( int w, int h );
+  ~Denoiser();
+
+  void setAOVs( int x, int y, vec3 pixelAlbedo, vec3 pixelNormal, float pixelDepth ) {
+    int i = x + y * width;
+    albedo[i] = pixelAlbedo;
+    normal[i] = pixelNormal;
+    depth[i]  = pixelDepth;
+  }
+
+  void denoise( vec4 *image, ThreadPool *pool );
+  void aovImage( AOV aov, vec4 *image ); // for viewing: normals in [0,1]^3, depth in [0,1]
+};
+
+
+#endif
@@ -0,0 +1,85 @@
+// emitter.cpp
+
+
+#include "headers.h"
+#include "emitter.h"
+
+
+// Build the alias table.  Emitters of zero power are never chosen
+// (unless all of them have zero power, in which case all are equally
+// likely).
+
+void EmitterTable::build( seq<Emitter> &emitters )
+
+{
+  int n = emitters.size();
+
+  prob.clear();
+  alias.clear();
+  pdfs.clear();
+
+  float totalPower = 0;
+
+  for (int i=0; i<n; i++) {
+    pdfs.add( emitters[i].power() );
+    totalPower += pdfs[i];
+  }
+
+  for (int i=0; i<n; i++) {
+    pdfs[i] = (totalPower > 0 ? pdfs[i] / totalPower : 1.0 / n);
+    prob.add( 1 );
+    alias.add( i );
+  }
+
+  // Split the buckets into those with less than the average
+  // probability (1/n) and those with more.  Each small bucket is
+  // topped up with the excess of a large one.
+
+  seq<int>   small, large;
+  seq<float> scaled;		// n * pdf, so the average is 1
+
+  for (int i=0; i<n; i++) {
+    scaled.add( n * pdfs[i] );
+    if (scaled[i] < 1)
+      small.add( i );
+    else
+      large.add( i );
+  }
+
+  while (small.size() > 0 && large.size() > 0) {
+
+    int s = small[ small.size()-1 ];
+    int l = large[ large.size()-1 ];
+
+    small.remove();
+
+    prob[s]  = scaled[s];
+    alias[s] = l;
+
+    scaled[l] -= (1 - scaled[s]);
+
+    if (scaled[l] < 1) {
+      large.remove();
+      small.add( l );
+    }
+  }
+
+  // Whatever is left has (up to rounding) probability 1, and keeps
+  // its own bucket
+}
+
+
+int EmitterTable::sample( float u, float &pdf )
+
+{
+  int   n = prob.size();
+  float x = u * n;
+  int   i = MIN( (int) x, n-1 );
+
+  if (x - i >= prob[i])
+    i = alias[i];
+
+  pdf = pdfs[i];
+
+  return i;
+}
@@ -0,0 +1,67 @@
+// emitter.h
+//
+// Emitting triangles, for sampling area lights
+//
+// The scene collects every triangle that emits light (scene triangles
+// with an emitting material, and triangles of Wavefront objects whose
+// material has a 'Ke') into a list of Emitters when it is read.  Each
+// shading point then sends a fixed number of shadow rays, choosing
+// the emitter for each from an EmitterTable, which picks emitters in
+// proportion to their power (emission times area).  So the cost of
+// soft shadows does not grow with the number of emitters.
+//
+// The table is an alias table (Vose, "A Linear Algorithm for
+// Generating Random Samples from a Set of Finite Elements", IEEE TSE
+// 1991), which picks an emitter in constant time.
+
+
+#ifndef EMITTER_H
+#define EMITTER_H
+
+#include "linalg.h"
+#include "seq.h"
+
+
+class Emitter {
+
+ public:
+
+  vec3  verts[3];		// triangle vertices
+  vec3  Ie;			// emitted colour
+  int   objIndex;		// object that the triangle belongs to
+  int   partIndex;		// triangle within a Wavefront object (or -1)
+
+  Emitter() {}
+
+  Emitter( vec3 &v0, vec3 &v1, vec3 &v2, vec3 &_Ie, int _objIndex, int _partIndex ) {
+    verts[0] = v0; verts[1] = v1; verts[2] = v2;
+    Ie = _Ie;
+    objIndex = _objIndex;
+    partIndex = _partIndex;
+  }
+
+  float power() {
+    return (0.2126 * Ie.x + 0.7152 * Ie.y + 0.0722 * Ie.z) * 0.5 * ((verts[1] - verts[0]) ^ (verts[2] - verts[0])).length();
+  }
+};
+
+
+class EmitterTable {
+
+  seq<float> prob;		// probability of keeping bucket i (instead of taking its alias)
+  seq<int>   alias;		// the other emitter in bucket i
+  seq<float> pdfs;		// probability of choosing emitter i
+
+ public:
+
+  void build( seq<Emitter> &emitters );
+
+  int sample( float u, float &pdf ); // choose an emitter for u in [0,1)
+
+  float pdf( int i ) {
+    return pdfs[i];
+  }
+};
+
+
+#endif
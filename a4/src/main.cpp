@@ -24,6 +24,9 @@
 #include "gpuProgram.h"
 #include "strokefont.h"
 #include "pixelZoom.h"
+#include "bvh.h"
+#include "sampler.h"
+#include "wavefrontobj.h"
 
 
 // window dimensions
@@ -42,9 +45,15 @@ StrokeFont *strokeFont;
 
 char *filename[2] = { NULL, NULL }; // from command line
 
+char *outputFilename = NULL;	    // batch mode: raytrace to this file without a window
+int   batchWidth  = 800;	    // batch mode: image dimensions
+int   batchHeight = 600;
+bool  writeAOVs   = false;	    // batch mode: also write the denoiser's AOVs
+
 
 void skipComments( istream &in );
 void parseOptions( int argc, char **argv );
+void readScene();
 
 
 // Error callback
@@ -84,6 +93,30 @@ int main( int argc, char **argv )
     exit(1);
   }
 
+  // Set up the scene (which needs no OpenGL)
+
+  scene = new Scene(); // must exist before parseOptions() is called
+  parseOptions( argc, argv );
+
+  // In batch mode, raytrace the scene to a file without creating a
+  // window or an OpenGL context
+
+  if (outputFilename != NULL) {
+
+    windowWidth  = batchWidth;
+    windowHeight = batchHeight;
+
+    readScene();
+
+    scene->renderBatch( batchWidth, batchHeight );
+    scene->writeImage( outputFilename );
+
+    if (writeAOVs)
+      scene->writeAOVs( outputFilename );
+
+    return 0;
+  }
+
   // Initialize the window
 
   glfwSetErrorCallback( errorCallback );
@@ -126,10 +159,7 @@ int main( int argc, char **argv )
 
   strokeFont = new StrokeFont();
 
-  // Set up the scene
-
-  scene = new Scene(); // must exist before parseOptions() is called
-  parseOptions( argc, argv );
+  // Set up the window
 
   rtWindow = new RTwindow( 20, 50, 1200, 800, filename[0], scene, window ); // production
 
@@ -141,33 +171,7 @@ int main( int argc, char **argv )
   
   // Read the scene file
 
-  {
-    ifstream in( filename[0] );
-
-    if (!in) {
-      cerr << "Error opening " << filename[0] << ".  Check that it exists and that the permissions are set to allow you to read it." << endl;
-      exit(1);
-    }
-
-    char *basename = strdup(filename[0]);
-    char *p = strrchr( basename, '/' );
-    if (p != NULL)
-      *p = '\0';
-    else {
-        p = strrchr(basename, '\\');
-        if (p != NULL)
-            *p = '\0';
-    }
-
-    scene->read( basename, in );
-  }
-
-  // Output the scene if a second filename is present on the command line
-
-  if (filename[1] != NULL) {
-    ofstream out( filename[1] );
-    scene->write( out );
-  }
+  readScene();
 
   // Main loop
 
@@ -175,8 +179,6 @@ int main( int argc, char **argv )
 
   while (!glfwWindowShouldClose( window )) {
 
-    glfwPollEvents();
-
     mat4 WCS_to_VCS = rtWindow->arcball->V;
 
     mat4 VCS_to_CCS = perspective( rtWindow->fovy, 
@@ -198,6 +200,15 @@ int main( int argc, char **argv )
     prevButtonDown = scene->buttonDown;
 
     rtWindow->redisplay = false;
+
+    // Sleep until there's an event.  While raytracing, wake up every
+    // DISPLAY_INTERVAL to show the partial image (and the render
+    // engine posts an empty event when a pass is done).
+
+    if (scene->stop)
+      glfwWaitEvents();
+    else
+      glfwWaitEventsTimeout( DISPLAY_INTERVAL );
   }
 
   // Clean up
@@ -210,6 +221,40 @@ int main( int argc, char **argv )
 
 
 
+// Read the scene file named on the command line
+
+void readScene()
+
+{
+  ifstream in( filename[0] );
+
+  if (!in) {
+    cerr << "Error opening " << filename[0] << ".  Check that it exists and that the permissions are set to allow you to read it." << endl;
+    exit(1);
+  }
+
+  char *basename = strdup(filename[0]);
+  char *p = strrchr( basename, '/' );
+  if (p != NULL)
+    *p = '\0';
+  else {
+      p = strrchr(basename, '\\');
+      if (p != NULL)
+          *p = '\0';
+  }
+
+  scene->read( basename, in );
+
+  // Output the scene if a second filename is present on the command line
+
+  if (filename[1] != NULL) {
+    ofstream out( filename[1] );
+    scene->write( out );
+  }
+}
+
+
+
 // Parse the command-line options
 
 void parseOptions( int argc, char **argv )
@@ -247,10 +292,121 @@ void parseOptions( int argc, char **argv )
       Texture::useMipMaps = !Texture::useMipMaps;
       break;
 
+    case 'n':			// number of raytracing threads
+      argc--; argv++;
+      scene->numThreads = atoi( *argv );
+      break;
+
+    case 'o':			// batch mode: raytrace to this file (.ppm or .pfm) and exit
+      argc--; argv++;
+      outputFilename = *argv;
+      break;
+
+    case 'w':			// batch mode: image width
+      argc--; argv++;
+      batchWidth = atoi( *argv );
+      break;
+
+    case 'h':			// batch mode: image height
+      argc--; argv++;
+      batchHeight = atoi( *argv );
+      break;
+
+    case 's':			// pixel samples (s x s rays per pixel)
+      argc--; argv++;
+      scene->numPixelSamples = atoi( *argv );
+      break;
+
+    case 'r':			// sample rays (shadows and glossy)
+      argc--; argv++;
+      scene->numRaySamples = atof( *argv );
+      break;
+
+    case 'j':			// jitter pixel samples?
+      scene->jitter = !scene->jitter;
+      break;
+
+    case 'p':			// trace primary and shadow rays in packets?
+      scene->usePackets = !scene->usePackets;
+      break;
+
+    case 'q':			// sample pattern for jitter, glossy, and soft shadow rays
+      argc--; argv++;
+      if (!Sampler::setPattern( *argv ))
+	cerr << "Unknown sample pattern '" << *argv << "' (use random, stratified, halton, or sobol)" << endl;
+      break;
+
+    case 'a':			// adaptive pixel sampling with up to # samples per pixel (0 = off)
+      argc--; argv++;
+      scene->adaptiveMaxSamples = atoi( *argv );
+      break;
+
+    case 'e':			// relative error at which adaptive sampling stops
+      argc--; argv++;
+      scene->adaptiveThreshold = atof( *argv );
+      break;
+
+    case 'f':			// denoise?
+      scene->denoise = !scene->denoise;
+      break;
+
+    case 'v':			// batch mode: also write the AOVs
+      writeAOVs = true;
+      break;
+
+    case 'u':			// path tracing?
+      scene->pathTracing = !scene->pathTracing;
+      break;
+
+    case 'z':			// Russian roulette?
+      scene->russianRoulette = !scene->russianRoulette;
+      break;
+
+    case 'c':			// coarse-to-fine preview?
+      scene->progressivePreview = !scene->progressivePreview;
+      break;
+
+    case 'x':			// edge-adaptive antialiasing?
+      scene->edgeAntialiasing = !scene->edgeAntialiasing;
+      break;
+
+    case 'k':			// build BVHs with k-means instead of SAH
+      BVH::buildMethod = BVH_KMEANS;
+      break;
+
+    case 'l':			// max triangles in a BVH leaf
+      argc--; argv++;
+      BVH::maxLeafSize = atoi( *argv );
+      break;
+
+    case 'b':			// binary cache of Wavefront objects and their BVHs?
+      WavefrontObj::useCache = !WavefrontObj::useCache;
+      break;
+
     default:
       cerr << "Unrecognized option -" << argv[0][1] << ".  Options are:" << endl;
       cerr << "  -d #   set max depth\n" << endl;
       cerr << "  -t     toggle texture transparency\n" << endl;
+      cerr << "  -n #   set number of raytracing threads (default: one per core)\n" << endl;
+      cerr << "  -s #   set pixel sampling (# x # rays per pixel)\n" << endl;
+      cerr << "  -r #   set number of sample rays (shadows and glossy)\n" << endl;
+      cerr << "  -j     toggle pixel sample jittering\n" << endl;
+      cerr << "  -p     toggle packet tracing of primary and point light shadow rays\n" << endl;
+      cerr << "  -q p   set sample pattern p: random, stratified, halton, or sobol (default)\n" << endl;
+      cerr << "  -a #   adaptive pixel sampling with up to # rays per pixel (0 = off)\n" << endl;
+      cerr << "  -e #   set relative error at which adaptive sampling stops (default 0.01)\n" << endl;
+      cerr << "  -u     toggle path tracing (one glossy reflection ray per bounce)\n" << endl;
+      cerr << "  -z     toggle Russian roulette termination of deep rays (default on)\n" << endl;
+      cerr << "  -f     toggle AOV-guided denoising of the raytraced image\n" << endl;
+      cerr << "  -x     toggle edge-adaptive antialiasing (subdivides edges down to the -s pixel sampling)\n" << endl;
+      cerr << "  -c     toggle coarse-to-fine preview in the window (default on)\n" << endl;
+      cerr << "  -k     build BVHs with k-means clustering instead of SAH\n" << endl;
+      cerr << "  -l #   set max number of triangles in a BVH leaf\n" << endl;
+      cerr << "  -b     toggle the cache of Wavefront objects and their BVHs in .obj.rtcache files (default on)\n" << endl;
+      cerr << "  -o f   batch mode: raytrace to file f (.ppm or .pfm) without a window, then exit\n" << endl;
+      cerr << "  -w #   batch mode: image width\n" << endl;
+      cerr << "  -h #   batch mode: image height\n" << endl;
+      cerr << "  -v     batch mode: also write the albedo, normal, and depth AOVs (with -f) to f_albedo, etc.\n" << endl;
       break;
     }
   }
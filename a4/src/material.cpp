@@ -22,7 +22,7 @@ void Material::setMaterialForOpenGL( GPUProgram *gpuProg )
     // Always use texture unit 0 for the object texture
       
     glActiveTexture( GL_TEXTURE0 );
-    glBindTexture( GL_TEXTURE_2D, texture->textureID );
+    glBindTexture( GL_TEXTURE_2D, texture->texID() );
     gpuProg->setInt( "objTexture", 0 );
 
     if (texture->hasAlpha) {
@@ -0,0 +1,668 @@
+// objParser.cpp
+
+
+#include "headers.h"
+#include "objParser.h"
+
+#include <thread>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+#endif
+
+
+#define PROGRESS_BYTES (1 << 20)	// a chunk reports its progress after each PROGRESS_BYTES
+#define MAX_EXACT_DIGITS 15		// significant digits that a double always holds exactly
+
+
+// ---------------- Scanning ----------------
+//
+// Each scanner starts at 'p', skips blanks (but not newlines), reads
+// its token, and leaves 'p' after it.  None reads past 'end', since
+// the mapped file is not null-terminated.
+
+
+static inline bool isBlank( char c )
+
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+static inline bool isDigit( char c )
+
+{
+  return c >= '0' && c <= '9';
+}
+
+
+static inline void skipBlanks( const char *&p, const char *end )
+
+{
+  while (p < end && isBlank( *p ))
+    p++;
+}
+
+
+static inline void skipToEndOfLine( const char *&p, const char *end )
+
+{
+  while (p < end && *p != '\n')
+    p++;
+}
+
+
+// Read a word (up to the next blank or newline) into a new string
+
+static char *scanWord( const char *&p, const char *end )
+
+{
+  skipBlanks( p, end );
+
+  const char *start = p;
+
+  while (p < end && !isBlank( *p ) && *p != '\n')
+    p++;
+
+  if (p == start)
+    return NULL;
+
+  char *word = (char *) malloc( p - start + 1 );
+  memcpy( word, start, p - start );
+  word[ p - start ] = '\0';
+
+  return word;
+}
+
+
+static bool scanInt( const char *&p, const char *end, int &value )
+
+{
+  skipBlanks( p, end );
+
+  bool negative = false;
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  if (p == end || !isDigit( *p ))
+    return false;
+
+  int v = 0;
+  while (p < end && isDigit( *p ))
+    v = 10 * v + (*p++ - '0');
+
+  value = (negative ? -v : v);
+  return true;
+}
+
+
+// Read the index after a '/' in a face, which has to follow it
+// directly (so "1// 2// 3//" has no normal indices)
+
+static inline bool scanIndex( const char *&p, const char *end, int &value )
+
+{
+  if (p == end || isBlank( *p ) || *p == '\n')
+    return false;
+
+  return scanInt( p, end, value );
+}
+
+
+// Read [+-]digits[.digits][(e|E)[+-]digits].  If there are at most
+// 15 significant digits and the exponent is within +-22, the digits
+// are gathered into an integer that a double holds exactly, which is
+// then scaled by an exact power of ten, so the result is the
+// correctly rounded double rounded to a float.  Anything else (e.g.
+// more digits, "1e-30" or "inf") is left to strtod().
+
+static bool scanFloat( const char *&p, const char *end, float &value )
+
+{
+  static const double powersOf10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                       1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                       1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+  skipBlanks( p, end );
+
+  const char *start = p;
+
+  bool negative = false;
+
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+
+  unsigned long long mantissa = 0;
+  int numDigits = 0;		// significant digits in 'mantissa'
+  int exponent  = 0;
+  bool anyDigits = false;
+
+  while (p < end && isDigit( *p )) {
+    if (numDigits < MAX_EXACT_DIGITS) {
+      mantissa = 10 * mantissa + (*p - '0');
+      if (mantissa > 0)
+	numDigits++;
+    } else {
+      numDigits++;		// too many for the fast path
+      exponent++;
+    }
+    anyDigits = true;
+    p++;
+  }
+
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && isDigit( *p )) {
+      if (numDigits < MAX_EXACT_DIGITS) {
+	mantissa = 10 * mantissa + (*p - '0');
+	if (mantissa > 0)
+	  numDigits++;
+	exponent--;
+      } else
+	numDigits++;
+      anyDigits = true;
+      p++;
+    }
+  }
+
+  if (anyDigits && p < end && (*p == 'e' || *p == 'E')) {
+    const char *e = p+1;
+    int exp;
+    if (e < end && (*e == '+' || isDigit( *e ) || *e == '-') && scanInt( e, end, exp )) {
+      exponent += exp;
+      p = e;
+    }
+  }
+
+  if (!anyDigits || numDigits > MAX_EXACT_DIGITS || exponent > 22 || exponent < -22) {
+
+    // Not a plain number, or not exact with the fast path
+
+    char buffer[64];
+    int  n = 0;
+
+    p = start;
+    while (p < end && !isBlank( *p ) && *p != '\n' && n < 63)
+      buffer[n++] = *p++;
+    buffer[n] = '\0';
+
+    char *after;
+    value = strtod( buffer, &after );
+
+    return (after != buffer);
+  }
+
+  double v = (double) mantissa;
+
+  if (exponent > 0)
+    v *= powersOf10[exponent];
+  else if (exponent < 0)
+    v /= powersOf10[-exponent];
+
+  value = (float) (negative ? -v : v);
+  return true;
+}
+
+
+
+// ---------------- Chunk parsing ----------------
+
+
+// Parse the lines in [start,end), which start at the beginning of a
+// line.  If 'progress' is not NULL, add the number of bytes parsed to
+// it every PROGRESS_BYTES.
+
+void ObjChunk::parse( const char *start, const char *end, ObjProgress *progress )
+
+{
+  const char *p = start;
+  const char *lastReport = start;
+
+  numLines = 0;
+
+  while (p < end) {
+
+    numLines++;
+
+    if (progress != NULL && p - lastReport > PROGRESS_BYTES) {
+      progress->add( p - lastReport );
+      lastReport = p;
+    }
+
+    skipBlanks( p, end );
+
+    // Read the command
+
+    const char *command = p;
+
+    while (p < end && !isBlank( *p ) && *p != '\n')
+      p++;
+
+    int commandLength = p - command;
+
+    if (commandLength == 0) {	// blank line
+      if (p < end)
+	p++;
+      continue;
+    }
+
+    if (commandLength == 9 && strncmp( command, "transform", 9 ) == 0) {
+
+      // 16 numbers, which may be on the following lines
+
+      ObjStatement s;
+      s.type = OBJ_TRANSFORM;
+      s.numTrianglesBefore = triangles.size();
+      s.line = numLines;
+      s.name = NULL;
+
+      for (int i=0; i<16; i++) {
+	while (p < end && (isBlank( *p ) || *p == '\n'))
+	  if (*p++ == '\n')
+	    numLines++;
+	if (!scanFloat( p, end, s.transform[i] ))
+	  s.transform[i] = 0;
+      }
+
+      statements.add( s );
+
+    } else {
+
+      switch (command[0]) {
+
+      case '#':			// comment
+      case 's':			// smoothing group ... ignore
+	break;
+
+      case 'v':			// v, vn, vt
+	if (commandLength == 1) {
+
+	  vec3 v(0,0,0);
+	  scanFloat( p, end, v.x );
+	  scanFloat( p, end, v.y );
+	  scanFloat( p, end, v.z );
+	  vertices.add( v );
+
+	} else if (commandLength == 2 && command[1] == 'n') {
+
+	  vec3 n(0,0,0);
+	  scanFloat( p, end, n.x );
+	  scanFloat( p, end, n.y );
+	  scanFloat( p, end, n.z );
+	  normals.add( n.normalize() );
+
+	} else if (commandLength == 2 && command[1] == 't') {
+
+	  vec3 t(0,0,0);
+	  scanFloat( p, end, t.x );
+	  scanFloat( p, end, t.y );
+	  texcoords.add( t );
+
+	} else
+	  goto unrecognized;
+	break;
+
+      case 'm':			// mtllib filename
+      case 'u':			// usemtl name
+      case 'g': {		// group
+	ObjStatement s;
+	s.type = (command[0] == 'm' ? OBJ_MTLLIB : (command[0] == 'u' ? OBJ_USEMTL : OBJ_GROUP));
+	s.numTrianglesBefore = triangles.size();
+	s.line = numLines;
+	s.name = scanWord( p, end );
+	if (s.name == NULL && s.type != OBJ_GROUP) // a group may have no name
+	  goto unrecognized;
+	statements.add( s );
+	break;
+      }
+
+      case 'f': {		// face
+
+	// Each vertex can be one of v, v//n, v/t, or v/t/n.  The first
+	// vertex determines the face's format.  A convex polygon is
+	// converted to a fan of triangles.
+
+	wfTriangle tri;
+	int  numVerts = 0;
+	bool faceHasT = false, faceHasN = false;
+
+	while (true) {
+
+	  int v, t = 0, n = 0;
+	  bool hasT = false, hasN = false;
+
+	  if (!scanInt( p, end, v ))
+	    break;
+
+	  if (p < end && *p == '/') {
+	    p++;
+	    if (p < end && *p == '/') {
+	      p++;
+	      hasN = scanIndex( p, end, n );
+	    } else {
+	      hasT = scanIndex( p, end, t );
+	      if (p < end && *p == '/') {
+		p++;
+		hasN = scanIndex( p, end, n );
+	      }
+	    }
+	  }
+
+	  if (numVerts == 0) {
+	    faceHasT = hasT;
+	    faceHasN = hasN;
+	  }
+
+	  v--;			// indices start at 1 in the file
+	  t = (faceHasT ? t-1 : 0);
+	  n = (faceHasN ? n-1 : 0);
+
+	  if (v > maxVindex) {
+	    maxVindex = v;
+	    maxVindexLine = numLines;
+	  }
+
+	  if (v < minVindex) {
+	    minVindex = v;
+	    minVindexLine = numLines;
+	  }
+
+	  if (numVerts >= 3) {	// start the next triangle of the fan
+	    triangles.add( tri );
+	    tri.vindices[1] = tri.vindices[2];
+	    tri.tindices[1] = tri.tindices[2];
+	    tri.nindices[1] = tri.nindices[2];
+	  }
+
+	  int k = MIN( numVerts, 2 );
+
+	  tri.vindices[k] = v;
+	  tri.tindices[k] = t;
+	  tri.nindices[k] = n;
+	  tri.findex = 0;
+
+	  numVerts++;
+	}
+
+	if (numVerts < 3)
+	  goto unrecognized;
+
+	triangles.add( tri );
+
+	if (faceHasT && faceHasN)
+	  numVTN++;
+	else if (faceHasT)
+	  numVT++;
+	else if (faceHasN)
+	  numVN++;
+	else
+	  numV++;
+
+	break;
+      }
+
+      default:
+      unrecognized: {
+	ObjWarning w;
+	w.line = numLines;
+	w.command = (char *) malloc( commandLength + 1 );
+	memcpy( w.command, command, commandLength );
+	w.command[ commandLength ] = '\0';
+	warnings.add( w );
+	break;
+      }
+      }
+    }
+
+    skipToEndOfLine( p, end );
+
+    if (p < end)
+      p++;			// past the newline
+  }
+
+  if (progress != NULL)
+    progress->add( end - lastReport );
+}
+
+
+
+// ---------------- Splitting the file ----------------
+
+
+// Return the start of the first line at or after 'p' that starts a
+// statement.  Lines that start with a number continue a 'transform'
+// statement, so chunks never start with them.
+
+static const char *statementStart( const char *p, const char *start, const char *end )
+
+{
+  if (p > start && p[-1] != '\n') { // move to the start of the next line
+    skipToEndOfLine( p, end );
+    if (p < end)
+      p++;
+  }
+
+  while (p < end) {
+
+    const char *q = p;
+    skipBlanks( q, end );
+
+    if (q == end || *q == '#' || (*q >= 'a' && *q <= 'z') || (*q >= 'A' && *q <= 'Z'))
+      break;
+
+    skipToEndOfLine( p, end );
+    if (p < end)
+      p++;
+  }
+
+  return p;
+}
+
+
+// ---------------- Progress ----------------
+
+
+ObjProgress::ObjProgress( const char *_filename, size_t _size, bool _reportWhileParsing )
+
+{
+  filename           = _filename;
+  size               = _size;
+  bytesParsed        = 0;
+  numChunksDone      = 0;
+  reportWhileParsing = _reportWhileParsing;
+  reported           = false;
+  lastReport         = std::chrono::steady_clock::now();
+}
+
+
+// Erase the progress report, if there was one
+
+ObjProgress::~ObjProgress()
+
+{
+  if (reported) {
+    cout << "\r" << string( strlen( filename ) + 16, ' ' ) << "\r";
+    cout.flush();
+  }
+}
+
+
+// Print the percentage parsed, if OBJ_PROGRESS_INTERVAL has passed
+// since the last report.  This is only called on the calling thread.
+
+void ObjProgress::report()
+
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+  if (std::chrono::duration<float>( now - lastReport ).count() >= OBJ_PROGRESS_INTERVAL) {
+    cout << "\rreading " << filename << ": " << (int) (100.0 * bytesParsed / size) << "%  ";
+    cout.flush();
+    lastReport = now;
+    reported = true;
+  }
+}
+
+
+void ObjProgress::add( long long bytes )
+
+{
+  bytesParsed += bytes;
+
+  if (reportWhileParsing)
+    report();
+}
+
+
+void ObjProgress::chunkDone()
+
+{
+  doneLock.lock();
+  numChunksDone++;
+  doneLock.unlock();
+
+  chunkFinished.notify_one();
+}
+
+
+void ObjProgress::waitForChunks( int n )
+
+{
+  std::unique_lock<std::mutex> guard( doneLock );
+
+  while (numChunksDone < n) {
+    chunkFinished.wait_for( guard, std::chrono::duration<float>( OBJ_PROGRESS_INTERVAL ) );
+    report();
+  }
+}
+
+
+
+// ---------------- File parsing ----------------
+
+
+static void parseChunk( ObjChunk *chunk, const char *start, const char *end, ObjProgress *progress )
+
+{
+  chunk->parse( start, end, progress );
+  progress->chunkDone();
+}
+
+
+bool parseObjFile( const char *filename, seq<ObjChunk*> &chunks )
+
+{
+  chunks.clear();
+
+  // Map the file
+
+  const char *data;
+  size_t      size;
+
+#ifdef _WIN32
+
+  FILE *f = fopen( filename, "rb" );
+  if (f == NULL)
+    return false;
+
+  fseek( f, 0, SEEK_END );
+  size = ftell( f );
+  fseek( f, 0, SEEK_SET );
+
+  char *buffer = new char[ size+1 ];
+  size = fread( buffer, 1, size, f );
+  fclose( f );
+
+  data = buffer;
+
+#else
+
+  int fd = open( filename, O_RDONLY );
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat( fd, &st ) != 0) {
+    close( fd );
+    return false;
+  }
+
+  size = st.st_size;
+
+  if (size == 0)
+    data = NULL;
+  else {
+    void *mem = mmap( NULL, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if (mem == MAP_FAILED) {
+      close( fd );
+      return false;
+    }
+    data = (const char *) mem;
+    madvise( mem, size, MADV_SEQUENTIAL );
+  }
+
+  close( fd );
+
+#endif
+
+  const char *end = data + size;
+
+  // Split into chunks, one per thread
+
+  int numChunks = MAX( 1, MIN( (int) std::thread::hardware_concurrency(), (int) (size / OBJ_MIN_CHUNK_SIZE) ) );
+
+  seq<const char *> bounds;
+
+  bounds.add( data );
+  for (int i=1; i<numChunks; i++)
+    bounds.add( MAX( bounds[i-1], statementStart( data + (size / numChunks) * i, data, end ) ) );
+  bounds.add( end );
+
+  for (int i=0; i<numChunks; i++)
+    chunks.add( new ObjChunk() );
+
+  // Parse the chunks in parallel, reporting the progress on large
+  // files.  One chunk is parsed on this thread.
+
+  {
+    ObjProgress progress( filename, size, numChunks == 1 );
+
+    if (numChunks == 1)
+      chunks[0]->parse( data, end, &progress );
+
+    else {
+
+      std::thread *threads = new std::thread[ numChunks ];
+
+      for (int i=0; i<numChunks; i++)
+	threads[i] = std::thread( parseChunk, chunks[i], bounds[i], bounds[i+1], &progress );
+
+      progress.waitForChunks( numChunks );
+
+      for (int i=0; i<numChunks; i++)
+	threads[i].join();
+
+      delete [] threads;
+    }
+  }
+
+  // Unmap
+
+#ifdef _WIN32
+  delete [] buffer;
+#else
+  if (data != NULL)
+    munmap( (void *) data, size );
+#endif
+
+  return true;
+}
@@ -0,0 +1,143 @@
+// objParser.h
+//
+// Fast parsing of a Wavefront .obj file, for wfModel::read()
+//
+// The file is mapped into memory and split into line-aligned chunks,
+// which are parsed in parallel, one thread per chunk, with a
+// hand-written number scanner.  A file with only one chunk is parsed
+// on the calling thread.  Each chunk collects its vertices,
+// normals, texture coordinates, and triangles (polygons are split
+// into fans) in flat arrays, and records its other statements
+// (groups, materials, transforms) along with the number of triangles
+// that come before each one.  wfModel::read() then merges the chunks
+// in order, replaying the statements to assign triangles to groups.
+//
+// While the chunks are parsed, the calling thread reports the
+// progress at most every OBJ_PROGRESS_INTERVAL seconds (and not at
+// all for files that parse faster than that).  It waits on a
+// condition variable in between, so it wakes as soon as the last
+// chunk is done.
+
+
+#ifndef OBJPARSER_H
+#define OBJPARSER_H
+
+#include "seq.h"
+#include "linalg.h"
+#include "wavefront.h"
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+
+#define OBJ_MIN_CHUNK_SIZE    (1 << 20)	// bytes; smaller files are parsed on one thread
+#define OBJ_PROGRESS_INTERVAL 0.5	// seconds between progress reports
+
+
+// Progress of the parse of one file, shared by its chunks
+
+class ObjProgress {
+
+  const char *filename;
+  size_t      size;
+
+  std::atomic<long long> bytesParsed;
+
+  std::mutex              doneLock;
+  std::condition_variable chunkFinished;
+  int                     numChunksDone;
+
+  bool reportWhileParsing;	// report from add(), when parsing on the calling thread
+  bool reported;
+  std::chrono::steady_clock::time_point lastReport;
+
+  void report();
+
+ public:
+
+  ObjProgress( const char *filename, size_t size, bool reportWhileParsing );
+  ~ObjProgress();
+
+  void add( long long bytes );	// called by a chunk as it parses
+  void chunkDone();		// called by a chunk when it is finished
+  void waitForChunks( int n );	// report until n chunks are finished
+};
+
+
+// A statement that the merge has to replay in order
+
+enum ObjStatementType { OBJ_GROUP, OBJ_USEMTL, OBJ_MTLLIB, OBJ_TRANSFORM };
+
+class ObjStatement {
+
+ public:
+
+  ObjStatementType type;
+  int   numTrianglesBefore;	// number of the chunk's triangles before this statement
+  int   line;			// line number within the chunk (from 1)
+  char *name;			// group, material, or material library name (NULL for a group without a name)
+  float transform[16];		// for OBJ_TRANSFORM, row by row
+};
+
+
+// A warning about a line, which is printed when the chunks are merged
+
+class ObjWarning {
+
+ public:
+
+  int   line;			// line number within the chunk (from 1)
+  char *command;
+};
+
+
+// The parsed contents of one chunk
+
+class ObjChunk {
+
+ public:
+
+  seq<vec3>         vertices;
+  seq<vec3>         normals;
+  seq<vec3>         texcoords;
+  seq<wfTriangle>   triangles;
+  seq<ObjStatement> statements;
+  seq<ObjWarning>   warnings;
+
+  int numLines;
+
+  int numVTN, numVT, numVN, numV; // number of faces of each vertex format
+
+  int maxVindex;		// largest vertex index of a face (from 0) or -1, and its line
+  int maxVindexLine;
+  int minVindex;		// smallest vertex index of a face (from 0), and its line
+  int minVindexLine;
+
+  ObjChunk() {
+    numLines = 0;
+    numVTN = numVT = numVN = numV = 0;
+    maxVindex = -1;
+    minVindex = 0;
+    maxVindexLine = minVindexLine = 0;
+  }
+
+  ~ObjChunk() {
+    for (int i=0; i<statements.size(); i++)
+      free( statements[i].name );
+    for (int i=0; i<warnings.size(); i++)
+      free( warnings[i].command );
+  }
+
+  void parse( const char *start, const char *end, ObjProgress *progress = NULL );
+};
+
+
+// Parse the file into chunks (which the caller must delete).  Return
+// false if the file can't be read.
+
+bool parseObjFile( const char *filename, seq<ObjChunk*> &chunks );
+
+
+#endif
@@ -8,18 +8,67 @@
 #include "linalg.h"
 #include "material.h"
 #include "gpuProgram.h"
+#include "bbox.h"
+
+
+// The closest intersection found so far along a ray
+//
+// This is all that the intersection routines compute.  The point,
+// normal, texture coordinates, and material are found afterward by
+// Object::hitInfo(), and only for the closest hit.
+
+class HitRecord {
+
+ public:
+
+  float t;			// ray parameter
+  int   objIndex;		// index of object in Scene::objects (set by ObjectBVH)
+  int   partIndex;		// part of the object (e.g. triangle), or -1
+  float alpha, beta;		// barycentric coordinates of v1 and v2 (for triangles)
+};
+
+
+
+// The kind of each object, so that the scene's ObjectBVH can call the
+// right rayInt() directly, without a dynamic_cast per ray.
+
+enum ObjectType {
+  OBJ_SPHERE,
+  OBJ_TRIANGLE,
+  OBJ_WAVEFRONT
+};
 
 
 class Object {
 
  public:
 
-  Material *mat;
+  Material  *mat;
+  ObjectType type;
 
   Object() {}
 
-  virtual bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
-		       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * &mat, int &intPartIndex ) = 0;
+  // Find an intersection with parameter <= maxParam, skipping part
+  // 'objPartIndex'.  Fill in t, partIndex, alpha, and beta of 'hit'.
+
+  virtual bool rayInt( vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam, HitRecord &hit ) = 0;
+
+  // Find the point, normal, texture coordinates, and material of a
+  // hit returned by rayInt()
+
+  virtual void hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit,
+			vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, Material * &mat ) = 0;
+
+  // Is there any intersection with parameter in [0,maxParam)?  This
+  // is for shadow rays.  Subclasses should override it with something
+  // cheaper.
+
+  virtual bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam ) {
+    HitRecord hit;
+    return rayInt( rayStart, rayDir, objPartIndex, maxParam, hit ) && hit.t >= 0 && hit.t < maxParam;
+  }
+
+  virtual BBox bbox() = 0;	// bounding box in world coordinates
 
   virtual vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords ) {
     alpha = 1;
@@ -0,0 +1,424 @@
+// objectBVH.cpp
+
+
+#include "headers.h"
+#include "objectBVH.h"
+#include "bvh.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "wavefrontobj.h"
+#include "rayPacket.h"
+
+
+ObjectBVH::ObjectBVH( seq<Object*> &sceneObjects )
+
+{
+  int n = sceneObjects.size();
+
+  nodes         = NULL;
+  numNodes      = 0;
+  objectIndices = NULL;
+  objects       = sceneObjects.array();
+
+  if (n == 0)
+    return;
+
+  // Boxes and centroids of all objects
+
+  BBox *boxes     = new BBox[n];
+  vec3 *centroids = new vec3[n];
+  int  *indices   = new int[n];
+
+  for (int i=0; i<n; i++) {
+    boxes[i]     = objects[i]->bbox();
+    centroids[i] = 0.5 * (boxes[i].min + boxes[i].max);
+    indices[i]   = i;
+  }
+
+  BVH_node *root = BVH::buildSubtreeSAH( boxes, centroids, indices, n, 0 );
+
+  delete [] boxes;
+  delete [] centroids;
+  delete [] indices;
+
+  // Flatten it
+
+  int maxPending;
+  numNodes = BVH::countNodes( root, maxPending );
+
+  if (maxPending > BVH_STACK_SIZE) {
+    cerr << "Object BVH is too deep to traverse (increase BVH_STACK_SIZE)" << endl;
+    exit(1);
+  }
+
+  nodes = BVH::allocNodes( numNodes );
+
+  seq<int> leafOrder( n );
+  int nextFreeNode = 1;
+
+  BVH::flattenTree( root, nodes, 0, nextFreeNode, leafOrder );
+
+  objectIndices = new int[n];
+  for (int i=0; i<n; i++)
+    objectIndices[i] = leafOrder[i];
+
+  BVH::freeTree( root );
+}
+
+
+ObjectBVH::~ObjectBVH()
+
+{
+  if (nodes != NULL)
+    BVH::freeNodes( nodes );
+
+  if (objectIndices != NULL)
+    delete [] objectIndices;
+}
+
+
+
+// Call the object's own rayInt() according to its type.  The
+// qualified calls are not virtual, so the compiler can inline them.
+
+static inline bool objectRayInt( Object *o, vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam, HitRecord &hit )
+
+{
+  switch (o->type) {
+
+  case OBJ_SPHERE:
+    return static_cast<Sphere*>(o)->Sphere::rayInt( rayStart, rayDir, objPartIndex, maxParam, hit );
+
+  case OBJ_TRIANGLE:
+    return static_cast<Triangle*>(o)->Triangle::rayInt( rayStart, rayDir, objPartIndex, maxParam, hit );
+
+  case OBJ_WAVEFRONT:
+    return static_cast<WavefrontObj*>(o)->WavefrontObj::rayInt( rayStart, rayDir, objPartIndex, maxParam, hit );
+  }
+
+  return o->rayInt( rayStart, rayDir, objPartIndex, maxParam, hit );
+}
+
+
+
+static inline bool objectOccluded( Object *o, vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam )
+
+{
+  switch (o->type) {
+
+  case OBJ_SPHERE:
+    return static_cast<Sphere*>(o)->Sphere::occluded( rayStart, rayDir, objPartIndex, maxParam );
+
+  case OBJ_TRIANGLE:
+    return static_cast<Triangle*>(o)->Triangle::occluded( rayStart, rayDir, objPartIndex, maxParam );
+
+  case OBJ_WAVEFRONT:
+    return static_cast<WavefrontObj*>(o)->WavefrontObj::occluded( rayStart, rayDir, objPartIndex, maxParam );
+  }
+
+  return o->occluded( rayStart, rayDir, objPartIndex, maxParam );
+}
+
+
+
+// Find the closest object intersection with parameter < maxParam.
+// Only 'hit' is filled in; call the object's hitInfo() to get the
+// point, normal, etc.
+//
+// Do not check for intersection with the originating object
+// 'thisObjIndex' unless it is a Wavefront object (since the other
+// objects are convex).  For a Wavefront object, pass along the
+// originating part 'thisObjPartIndex' so that its BVH can skip it.
+//
+// The traversal is the same as in BVH::rayIntBVH().
+
+
+bool ObjectBVH::rayInt( vec3 &rayStart, vec3 &rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam, HitRecord &hit )
+
+{
+  if (nodes == NULL)
+    return false;
+
+  bool found = false;
+
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
+
+  struct {
+    int   nodeIndex;
+    float tEntry;
+  } stack[ BVH_STACK_SIZE ];
+
+  float tRoot;
+  if (!BVH::rayBoxInt( rayStart, invDir, 0, maxParam, nodes[0].bbox, tRoot ))
+    return false;
+
+  stack[0].nodeIndex = 0;
+  stack[0].tEntry    = tRoot;
+  int numPending = 1;
+
+  while (numPending > 0) {
+
+    numPending--;
+
+    if (stack[numPending].tEntry >= maxParam) // box is beyond the closest hit so far
+      continue;
+
+    BVH_flatNode &n = nodes[ stack[numPending].nodeIndex ];
+
+    if (n.isLeaf) { // A leaf, so check all the objects
+
+      for (int j=n.offset; j<n.offset+n.count; j++) {
+
+	int i = objectIndices[j];
+	Object *o = objects[i];
+
+	if (o->type == OBJ_WAVEFRONT || i != thisObjIndex) {
+
+	  if (objectRayInt( o, rayStart, rayDir, ((i != thisObjIndex) ? -1 : thisObjPartIndex), maxParam, hit )) {
+	    hit.objIndex = i;
+	    maxParam = hit.t;  // In future, don't intersect any farther than this
+	    found = true;
+	  }
+	}
+      }
+
+    } else { // Not a leaf, so push the children that the ray hits, farthest first
+
+      int firstPushed = numPending;
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+
+	float t;
+
+	if (BVH::rayBoxInt( rayStart, invDir, 0, maxParam, nodes[i].bbox, t )) {
+
+	  int j = numPending++;
+	  while (j > firstPushed && stack[j-1].tEntry < t) {
+	    stack[j] = stack[j-1];
+	    j--;
+	  }
+	  stack[j].nodeIndex = i;
+	  stack[j].tEntry    = t;
+	}
+      }
+    }
+  }
+
+  return found;
+}
+
+
+
+// Is there any object intersection with parameter in [0,maxParam)?
+//
+// This returns at the first hit found, so the children are pushed in
+// any order.  The originating object is skipped as in rayInt().
+
+
+bool ObjectBVH::occluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam )
+
+{
+  if (nodes == NULL)
+    return false;
+
+  vec3 invDir( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
+
+  int stack[ BVH_STACK_SIZE ];
+  int numPending = 0;
+
+  stack[numPending++] = 0;
+
+  while (numPending > 0) {
+
+    BVH_flatNode &n = nodes[ stack[--numPending] ];
+
+    float t;
+    if (!BVH::rayBoxInt( rayStart, invDir, 0, maxParam, n.bbox, t ))
+      continue;
+
+    if (n.isLeaf) {
+
+      for (int j=n.offset; j<n.offset+n.count; j++) {
+
+	int i = objectIndices[j];
+	Object *o = objects[i];
+
+	if ((o->type == OBJ_WAVEFRONT || i != thisObjIndex) &&
+	    objectOccluded( o, rayStart, rayDir, ((i != thisObjIndex) ? -1 : thisObjPartIndex), maxParam ))
+	  return true;
+      }
+
+    } else
+
+      for (int i=n.offset; i<n.offset+n.count; i++)
+	stack[numPending++] = i;
+  }
+
+  return false;
+}
+
+
+
+// Find the closest intersection of each ray in a packet.  Fill in
+// packet.found[] and packet.hit[].
+//
+// A coherent packet is traced together, as in BVH::rayIntPacket(),
+// and passed on to the triangle BVH of each Wavefront object that it
+// reaches.  An incoherent packet is traced one ray at a time.
+
+
+void ObjectBVH::rayIntPacket( RayPacket &packet )
+
+{
+  packet.computeBounds();
+
+  if (!packet.coherent) {
+    for (int r=0; r<packet.numRays; r++)
+      packet.found[r] = rayInt( packet.origin[r], packet.dir[r], packet.thisObjIndex[r], packet.thisObjPartIndex[r],
+				packet.maxParam[r], packet.hit[r] );
+    return;
+  }
+
+  if (nodes == NULL)
+    return;
+
+  struct {
+    int   nodeIndex;
+    int   first, last;
+    float dist;
+  } stack[ BVH_STACK_SIZE ];
+
+  stack[0].nodeIndex = 0;
+  stack[0].first     = 0;
+  stack[0].last      = packet.numRays-1;
+  int numPending = 1;
+
+  while (numPending > 0) {
+
+    numPending--;
+
+    BVH_flatNode &n = nodes[ stack[numPending].nodeIndex ];
+    int first = stack[numPending].first;
+    int last  = stack[numPending].last;
+
+    if (packet.frustumMisses( n.bbox ) || !packet.findRange( n.bbox, first, last ))
+      continue;
+
+    if (n.isLeaf) {
+
+      for (int j=n.offset; j<n.offset+n.count; j++) {
+
+	int i = objectIndices[j];
+	Object *o = objects[i];
+
+	if (o->type == OBJ_WAVEFRONT)
+
+	  static_cast<WavefrontObj*>(o)->bvh.rayIntPacket( packet, i, first, last );
+
+	else
+
+	  for (int r=first; r<=last; r++)
+	    if (i != packet.thisObjIndex[r] &&
+		objectRayInt( o, packet.origin[r], packet.dir[r], -1, packet.maxParam[r], packet.hit[r] )) {
+	      packet.hit[r].objIndex = i;
+	      packet.maxParam[r] = packet.hit[r].t;
+	      packet.found[r] = true;
+	    }
+      }
+
+    } else { // Not a leaf, so push the children, farthest first
+
+      int firstPushed = numPending;
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+
+	float dist = packet.distance( nodes[i].bbox );
+
+	int j = numPending++;
+	while (j > firstPushed && stack[j-1].dist < dist) {
+	  stack[j] = stack[j-1];
+	  j--;
+	}
+	stack[j].nodeIndex = i;
+	stack[j].first     = first;
+	stack[j].last      = last;
+	stack[j].dist      = dist;
+      }
+    }
+  }
+}
+
+
+
+// Find which rays of a packet are blocked before their maxParam.
+// Set packet.found[] for those.
+
+
+void ObjectBVH::occludedPacket( RayPacket &packet )
+
+{
+  packet.computeBounds();
+
+  if (!packet.coherent) {
+    for (int r=0; r<packet.numRays; r++)
+      packet.found[r] = occluded( packet.origin[r], packet.dir[r], packet.thisObjIndex[r], packet.thisObjPartIndex[r],
+				  packet.maxParam[r] );
+    return;
+  }
+
+  if (nodes == NULL)
+    return;
+
+  struct {
+    int nodeIndex;
+    int first, last;
+  } stack[ BVH_STACK_SIZE ];
+
+  stack[0].nodeIndex = 0;
+  stack[0].first     = 0;
+  stack[0].last      = packet.numRays-1;
+  int numPending = 1;
+
+  while (numPending > 0 && packet.numActive > 0) {
+
+    numPending--;
+
+    BVH_flatNode &n = nodes[ stack[numPending].nodeIndex ];
+    int first = stack[numPending].first;
+    int last  = stack[numPending].last;
+
+    if (packet.frustumMisses( n.bbox ) || !packet.findRange( n.bbox, first, last ))
+      continue;
+
+    if (n.isLeaf) {
+
+      for (int j=n.offset; j<n.offset+n.count; j++) {
+
+	int i = objectIndices[j];
+	Object *o = objects[i];
+
+	if (o->type == OBJ_WAVEFRONT)
+
+	  static_cast<WavefrontObj*>(o)->bvh.occludedPacket( packet, i, first, last );
+
+	else
+
+	  for (int r=first; r<=last; r++)
+	    if (packet.active[r] && i != packet.thisObjIndex[r] &&
+		objectOccluded( o, packet.origin[r], packet.dir[r], -1, packet.maxParam[r] )) {
+	      packet.found[r]  = true;
+	      packet.active[r] = false;
+	      packet.numActive--;
+	    }
+      }
+
+    } else
+
+      for (int i=n.offset; i<n.offset+n.count; i++) {
+	stack[numPending].nodeIndex = i;
+	stack[numPending].first     = first;
+	stack[numPending].last      = last;
+	numPending++;
+      }
+  }
+}
@@ -0,0 +1,47 @@
+// objectBVH.h
+//
+// Bounding volume hierarchy over all of the objects in a scene
+//
+// The leaves hold loose spheres and triangles directly, and hold each
+// Wavefront object as a single primitive that has its own triangle
+// BVH, so a ray visits a logarithmic number of objects.
+//
+// The tree is built with the same SAH builder as the triangle BVH
+// and stored in the same flattened form.  It must be rebuilt if the
+// scene's objects change.
+
+
+#ifndef OBJECTBVH_H
+#define OBJECTBVH_H
+
+#include "seq.h"
+#include "object.h"
+
+
+class BVH_flatNode;
+class RayPacket;
+
+
+class ObjectBVH {
+
+  BVH_flatNode *nodes;		// flattened tree; nodes[0] is the root
+  int           numNodes;
+
+  int     *objectIndices;	// object indices in leaf order (leaf offsets index into this)
+  Object **objects;		// the scene's objects (not owned)
+
+ public:
+
+  ObjectBVH( seq<Object*> &sceneObjects );
+  ~ObjectBVH();
+
+  bool rayInt( vec3 &rayStart, vec3 &rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam, HitRecord &hit );
+
+  bool occluded( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, float maxParam );
+
+  void rayIntPacket( RayPacket &packet );
+  void occludedPacket( RayPacket &packet );
+};
+
+
+#endif
@@ -0,0 +1,147 @@
+// rayPacket.cpp
+
+
+#include "headers.h"
+#include "rayPacket.h"
+#include "bvh.h"
+
+
+void RayPacket::add( vec3 rayStart, vec3 rayDir, float rayMaxParam, int rayObjIndex, int rayObjPartIndex )
+
+{
+  int i = numRays++;
+
+  origin[i]           = rayStart;
+  dir[i]              = rayDir;
+  invDir[i]           = vec3( 1.0f / rayDir.x, 1.0f / rayDir.y, 1.0f / rayDir.z );
+  maxParam[i]         = rayMaxParam;
+  thisObjIndex[i]     = rayObjIndex;
+  thisObjPartIndex[i] = rayObjPartIndex;
+  active[i]           = true;
+  found[i]            = false;
+}
+
+
+// Find the bounds of the origins and inverse directions.  The packet
+// is coherent only if, on each axis, the inverse directions are all
+// finite and of the same sign.
+
+void RayPacket::computeBounds()
+
+{
+  numActive = numRays;
+  coherent  = (numRays > 0);
+
+  centre    = vec3(0,0,0);
+  centreDir = vec3(0,0,0);
+  maxParamBound = 0;
+
+  for (int i=0; i<numRays; i++) {
+    centre    = centre + origin[i];
+    centreDir = centreDir + dir[i];
+    maxParamBound = MAX( maxParamBound, maxParam[i] );
+  }
+
+  if (numRays > 0) {
+    centre    = (1.0f / numRays) * centre;
+    centreDir = (1.0f / numRays) * centreDir;
+  }
+
+  for (int axis=0; axis<3 && coherent; axis++) {
+
+    originMin[axis] = originMax[axis] = origin[0][axis];
+    invDirMin[axis] = invDirMax[axis] = invDir[0][axis];
+
+    for (int i=1; i<numRays; i++) {
+      originMin[axis] = MIN( originMin[axis], origin[i][axis] );
+      originMax[axis] = MAX( originMax[axis], origin[i][axis] );
+      invDirMin[axis] = MIN( invDirMin[axis], invDir[i][axis] );
+      invDirMax[axis] = MAX( invDirMax[axis], invDir[i][axis] );
+    }
+
+    if (!(invDirMin[axis] > 0 || invDirMax[axis] < 0) || // mixed signs (or a zero direction component)
+	fabs(invDirMin[axis]) == INFINITY || fabs(invDirMax[axis]) == INFINITY)
+      coherent = false;
+  }
+}
+
+
+// Does every ray certainly miss the box?
+//
+// On each axis, the entry and exit parameters of any ray lie between
+// the products of the bounds on (plane - origin) and the bounds on
+// the inverse direction.  If the latest possible entry is after the
+// earliest possible exit, no ray can hit the box.  This is
+// conservative: it may not cull a box that all rays miss.
+
+bool RayPacket::frustumMisses( BBox &box )
+
+{
+  float tmin = 0;
+  float tmax = maxParamBound;
+
+  for (int axis=0; axis<3; axis++) {
+
+    float nearPlane, farPlane;
+
+    if (invDirMin[axis] > 0) {
+      nearPlane = box.min[axis];
+      farPlane  = box.max[axis];
+    } else {
+      nearPlane = box.max[axis];
+      farPlane  = box.min[axis];
+    }
+
+    float n0 = (nearPlane - originMax[axis]) * invDirMin[axis];
+    float n1 = (nearPlane - originMax[axis]) * invDirMax[axis];
+    float n2 = (nearPlane - originMin[axis]) * invDirMin[axis];
+    float n3 = (nearPlane - originMin[axis]) * invDirMax[axis];
+
+    float f0 = (farPlane - originMax[axis]) * invDirMin[axis];
+    float f1 = (farPlane - originMax[axis]) * invDirMax[axis];
+    float f2 = (farPlane - originMin[axis]) * invDirMin[axis];
+    float f3 = (farPlane - originMin[axis]) * invDirMax[axis];
+
+    float earliestEntry = MIN( MIN( n0, n1 ), MIN( n2, n3 ) );
+    float latestExit    = MAX( MAX( f0, f1 ), MAX( f2, f3 ) );
+
+    tmin = MAX( tmin, earliestEntry );
+    tmax = MIN( tmax, latestExit );
+
+    if (tmax < tmin)
+      return true;
+  }
+
+  return false;
+}
+
+
+// Shrink [first,last] to the range of active rays that hit the box.
+// Return false if none do.
+
+bool RayPacket::findRange( BBox &box, int &first, int &last )
+
+{
+  float t;
+
+  while (first <= last && !(active[first] && BVH::rayBoxInt( origin[first], invDir[first], 0, maxParam[first], box, t )))
+    first++;
+
+  if (first > last)
+    return false;
+
+  while (last > first && !(active[last] && BVH::rayBoxInt( origin[last], invDir[last], 0, maxParam[last], box, t )))
+    last--;
+
+  return true;
+}
+
+
+// Distance of the box along the packet's average direction (to
+// visit nearer children first)
+
+float RayPacket::distance( BBox &box )
+
+{
+  return (0.5 * (box.min + box.max) - centre) * centreDir;
+}
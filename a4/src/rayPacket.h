@@ -0,0 +1,75 @@
+// rayPacket.h
+//
+// A packet of coherent rays, traced through the BVHs together
+//
+// Primary rays from neighbouring pixels (and shadow rays from those
+// pixels toward the same point light) have nearly the same origin
+// and direction, so they visit nearly the same BVH nodes.  A packet
+// culls a whole node with one conservative test of its bounding
+// frustum, then finds the range of its rays that actually hit the
+// node's box.  Only that range is carried down to the children and
+// tested against the triangles of a leaf.
+//
+// The frustum bounds are valid only if all rays have the same
+// direction sign on each axis.  Otherwise the packet is 'incoherent'
+// and its rays are traced one at a time.
+
+
+#ifndef RAYPACKET_H
+#define RAYPACKET_H
+
+#include "linalg.h"
+#include "bbox.h"
+#include "object.h"
+
+
+#define PACKET_SIZE  64		// max rays in a packet
+#define PACKET_WIDTH  8		// pixels are traced in PACKET_WIDTH x PACKET_WIDTH blocks
+
+
+class RayPacket {
+
+  // Bounds on all rays, for the frustum test
+
+  float originMin[3], originMax[3];
+  float invDirMin[3], invDirMax[3];
+  float maxParamBound;		// largest maxParam[] of all rays
+
+ public:
+
+  int       numRays;
+  int       numActive;		// rays that are not yet done
+
+  vec3      origin[PACKET_SIZE];
+  vec3      dir[PACKET_SIZE];
+  vec3      invDir[PACKET_SIZE];
+  float     maxParam[PACKET_SIZE];	    // closest hit so far, or the length of a shadow ray
+  int       thisObjIndex[PACKET_SIZE];	    // originating object, or -1
+  int       thisObjPartIndex[PACKET_SIZE];  // originating part of that object, or -1
+  bool      active[PACKET_SIZE];	    // false once a shadow ray is blocked
+  bool      found[PACKET_SIZE];		    // an intersection (or blocker) was found
+  HitRecord hit[PACKET_SIZE];		    // closest intersection
+
+  bool      coherent;		// frustum bounds are valid
+  vec3      centre;		// centre of the origins
+  vec3      centreDir;		// average direction (for ordering children)
+
+  RayPacket() {
+    numRays = 0;
+  }
+
+  void clear() {
+    numRays = 0;
+  }
+
+  void add( vec3 rayStart, vec3 rayDir, float rayMaxParam, int rayObjIndex, int rayObjPartIndex );
+
+  void computeBounds();		// call after all rays are added
+
+  bool frustumMisses( BBox &box );
+  bool findRange( BBox &box, int &first, int &last );
+  float distance( BBox &box );
+};
+
+
+#endif
@@ -0,0 +1,370 @@
+// renderEngine.cpp
+
+
+#include "headers.h"
+#include "renderEngine.h"
+#include "scene.h"
+#include "accumBuffer.h"
+#include "denoiser.h"
+
+
+RenderEngine::RenderEngine( int numThreads )
+
+{
+  pool = new ThreadPool( numThreads );
+
+  nextTile  = 0;
+  tilesDone = 0;
+  cancelled = false;
+
+  scene = NULL;
+  image = NULL;
+  accum = NULL;
+  denoiser = NULL;
+  wakeup = NULL;
+}
+
+
+RenderEngine::~RenderEngine()
+
+{
+  cancel();
+  delete pool;
+}
+
+
+// Start tracing a new image.  Any render in progress is cancelled
+// first, so the caller may reuse or free the previous image after
+// this returns.
+
+void RenderEngine::start( Scene *s, vec4 *img, int w, int h, int scale, AccumBuffer *acc, Denoiser *den )
+
+{
+  cancel();
+
+  scene       = s;
+  image       = img;
+  width       = w;
+  height      = h;
+  pixelScale  = scale;
+  accum       = acc;
+  denoiser    = den;
+  previewStep = 0;
+  refine      = false;
+
+  launch();
+}
+
+
+// Start a preview pass with one ray per step x step pixels.  The
+// denoiser, if given, gets the AOVs on a pass with step 1.
+
+void RenderEngine::startPreview( Scene *s, vec4 *img, int w, int h, int scale, int step, bool refinePrevious, Denoiser *den )
+
+{
+  cancel();
+
+  scene       = s;
+  image       = img;
+  width       = w;
+  height      = h;
+  pixelScale  = scale;
+  accum       = NULL;
+  denoiser    = den;
+  previewStep = step;
+  refine      = refinePrevious;
+
+  launch();
+}
+
+
+// Split the image into tiles and start the workers on them
+
+void RenderEngine::launch()
+
+{
+  // Split the image into tiles
+
+  tiles.clear();
+  tileFinished.clear();
+
+  for (int y=0; y<height; y+=TILE_SIZE)
+    for (int x=0; x<width; x+=TILE_SIZE) {
+      tiles.add( RenderTile( x, y, MIN( x+TILE_SIZE, width ), MIN( y+TILE_SIZE, height ) ) );
+      tileFinished.add( false );
+    }
+
+  tilesDone = 0;
+  cancelled = false;
+
+  finishedTiles.clear();
+
+  startWorkers();
+}
+
+
+// Start the workers on the tiles that are not yet finished
+
+void RenderEngine::startWorkers()
+
+{
+  nextTile = 0;
+
+  // One long-running job per worker.  Each takes tiles until none
+  // are left, which balances the load without queueing every tile.
+
+  for (int i=0; i<pool->size(); i++)
+    pool->submit( [this]() { renderTiles(); } );
+}
+
+
+// Stop the workers and wait for them to drop their current tile.
+// The flag is cleared once they have stopped, so that rays traced
+// afterwards (e.g. the GL thread's, for a clicked pixel) are not
+// cancelled too.
+
+void RenderEngine::cancel()
+
+{
+  cancelled = true;
+  pool->wait();
+  cancelled = false;
+}
+
+
+// Continue a cancelled render (or pass) where it stopped.  Only the
+// tiles that were not finished are traced again.  A tile of an
+// adaptive pass that was cut short keeps the samples of its finished
+// blocks, so some of its pixels get one extra sample in this pass.
+
+void RenderEngine::resume()
+
+{
+  if (scene == NULL || isDone())
+    return;
+
+  cancel();                     // in case it is still running
+  startWorkers();
+}
+
+
+// Block until the image is done
+
+void RenderEngine::wait()
+
+{
+  pool->wait();
+}
+
+
+// Move the tiles finished since the last call into 'done'
+
+void RenderEngine::takeFinishedTiles( seq<RenderTile> &done )
+
+{
+  done.clear();
+
+  finishedLock.lock();
+
+  for (int i=0; i<finishedTiles.size(); i++)
+    done.add( finishedTiles[i] );
+
+  finishedTiles.clear();
+
+  finishedLock.unlock();
+}
+
+
+void RenderEngine::renderTiles()
+
+{
+  while (!cancelled) {
+
+    int i = nextTile++;
+
+    if (i >= tiles.size())
+      break;
+
+    if (tileFinished[i])        // before an earlier cancel()
+      continue;
+
+    if (previewStep > 0)
+      renderTilePreview( tiles[i] );
+    else if (accum != NULL)
+      renderTileAdaptive( tiles[i] );
+    else
+      renderTile( tiles[i] );
+
+    if (cancelled)
+      break;
+
+    tileFinished[i] = true;
+
+    finishedLock.lock();
+    finishedTiles.add( tiles[i] );
+    finishedLock.unlock();
+
+    if (++tilesDone == tiles.size() && wakeup != NULL)
+      wakeup();
+  }
+}
+
+
+void RenderEngine::renderTile( RenderTile &tile )
+
+{
+  // Trace the tile in blocks of PACKET_WIDTH x PACKET_WIDTH pixels,
+  // so that the scene can trace each block's rays in packets.  Pixel
+  // x is at window coordinate (x + 0.5) * pixelScale.
+
+  vec3 colours[ PACKET_WIDTH * PACKET_WIDTH ];
+
+  for (int y=tile.y0; y<tile.y1; y+=PACKET_WIDTH)
+    for (int x=tile.x0; x<tile.x1; x+=PACKET_WIDTH) {
+
+      if (cancelled)
+	return;
+
+      int nx = MIN( PACKET_WIDTH, tile.x1 - x );
+      int ny = MIN( PACKET_WIDTH, tile.y1 - y );
+
+      scene->blockColours( x * pixelScale + pixelScale/2, y * pixelScale + pixelScale/2, nx, ny, pixelScale, colours );
+
+      if (cancelled)		// some rays were cut short and are black
+	return;
+
+      if (denoiser != NULL)
+	recordAOVs( x, y, x+nx, y+ny );
+
+      for (int j=0; j<ny; j++)
+	for (int i=0; i<nx; i++) {
+	  vec3 &colour = colours[ i + j * nx ];
+	  image[ (x+i) + (y+j) * width ] = vec4( colour.x, colour.y, colour.z, 1 ); // opaque
+	}
+    }
+}
+
+
+// Add one sample to each active pixel of the tile, again in blocks
+// so that the samples can be traced in packets.  A pixel's samples
+// are jittered over the whole pixel, since they are added one pass
+// at a time.
+
+void RenderEngine::renderTileAdaptive( RenderTile &tile )
+
+{
+  PixelSample samples[ PACKET_WIDTH * PACKET_WIDTH ];
+  int         pixelX[ PACKET_WIDTH * PACKET_WIDTH ];
+  int         pixelY[ PACKET_WIDTH * PACKET_WIDTH ];
+  vec3        colours[ PACKET_WIDTH * PACKET_WIDTH ];
+
+  for (int y=tile.y0; y<tile.y1; y+=PACKET_WIDTH)
+    for (int x=tile.x0; x<tile.x1; x+=PACKET_WIDTH) {
+
+      if (cancelled)
+	return;
+
+      if (denoiser != NULL && accum->numSamples( x, y ) == 0) // first pass
+	recordAOVs( x, y, MIN( x+PACKET_WIDTH, tile.x1 ), MIN( y+PACKET_WIDTH, tile.y1 ) );
+
+      int n = 0;
+
+      for (int py=y; py<MIN( y+PACKET_WIDTH, tile.y1 ); py++)
+	for (int px=x; px<MIN( x+PACKET_WIDTH, tile.x1 ); px++)
+	  if (accum->isActive( px, py )) {
+
+	    PixelSample &s = samples[n];
+
+	    s.x     = px * pixelScale + pixelScale/2;
+	    s.y     = py * pixelScale + pixelScale/2;
+	    s.index = accum->numSamples( px, py );
+
+	    Sampler::pixelOffset( s.x, s.y, s.index, accum->maxPixelSamples(), s.xOffset, s.yOffset );
+
+	    pixelX[n] = px;
+	    pixelY[n] = py;
+	    n++;
+	  }
+
+      if (n == 0)
+	continue;
+
+      scene->traceSamples( samples, n, colours );
+
+      if (cancelled)		// some rays were cut short and are black
+	return;
+
+      for (int i=0; i<n; i++) {
+	accum->add( pixelX[i], pixelY[i], colours[i] );
+	vec3 mean = accum->mean( pixelX[i], pixelY[i] );
+	image[ pixelX[i] + pixelY[i] * width ] = vec4( mean.x, mean.y, mean.z, 1 ); // opaque
+      }
+    }
+}
+
+
+// Trace one ray for each previewStep x previewStep block of the tile
+// and fill the block with its colour.  The tile's corner is at a
+// multiple of TILE_SIZE, and so of previewStep.
+
+void RenderEngine::renderTilePreview( RenderTile &tile )
+
+{
+  PixelSample samples[ TILE_SIZE * TILE_SIZE ];
+  int         pixelX[ TILE_SIZE * TILE_SIZE ];
+  int         pixelY[ TILE_SIZE * TILE_SIZE ];
+  vec3        colours[ TILE_SIZE * TILE_SIZE ];
+
+  int n = 0;
+
+  for (int y=tile.y0; y<tile.y1; y+=previewStep)
+    for (int x=tile.x0; x<tile.x1; x+=previewStep)
+      if (!refine || x % (2*previewStep) != 0 || y % (2*previewStep) != 0) { // else traced in the previous pass
+	samples[n] = scene->pixelSample( x * pixelScale + pixelScale/2, y * pixelScale + pixelScale/2, 0, 1 );
+	pixelX[n] = x;
+	pixelY[n] = y;
+	n++;
+      }
+
+  if (cancelled)
+    return;
+
+  scene->traceSamples( samples, n, colours );
+
+  if (cancelled)		// some rays were cut short and are black
+    return;
+
+  for (int i=0; i<n; i++) {
+
+    vec3 colour = colours[i];
+
+    if (previewStep == 1) {
+
+      if (samples[i].x == scene->debugPixel.x && samples[i].y == scene->debugPixel.y)
+	colour = scene->pixelColour( samples[i].x, samples[i].y ); // again, with debugging output
+
+      if (denoiser != NULL)
+	recordAOVs( pixelX[i], pixelY[i], pixelX[i]+1, pixelY[i]+1 );
+    }
+
+    for (int py=pixelY[i]; py<MIN( pixelY[i]+previewStep, tile.y1 ); py++)
+      for (int px=pixelX[i]; px<MIN( pixelX[i]+previewStep, tile.x1 ); px++)
+	image[ px + py * width ] = vec4( colour.x, colour.y, colour.z, 1 ); // opaque
+  }
+}
+
+
+// Record the AOVs of pixels [x0,x1) x [y0,y1), from the ray through
+// each pixel's centre
+
+void RenderEngine::recordAOVs( int x0, int y0, int x1, int y1 )
+
+{
+  for (int y=y0; y<y1; y++)
+    for (int x=x0; x<x1; x++) {
+      vec3  albedo, normal;
+      float depth;
+      scene->pixelAOVs( x * pixelScale + pixelScale/2, y * pixelScale + pixelScale/2, albedo, normal, depth );
+      denoiser->setAOVs( x, y, albedo, normal, depth );
+    }
+}
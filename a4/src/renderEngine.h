@@ -0,0 +1,148 @@
+// renderEngine.h
+//
+// Multithreaded, tile-based rendering of the raytraced image.
+//
+// The image is split into TILE_SIZE x TILE_SIZE tiles which the
+// workers of a thread pool take, one at a time, and trace with
+// Scene::blockColours().  The caller (the GL thread) only starts a
+// render and then polls numTilesDone() or isDone() to decide when to
+// redraw.  If given a wakeup function, the worker that finishes the
+// last tile calls it, so the caller can sleep in between.
+//
+// cancel() sets a flag that the scene checks before tracing each
+// ray (see isCancelled()), so the workers drop their current tile
+// almost immediately and the caller can restart without waiting for
+// expensive pixels to finish.  A block with rays that were cut short
+// is discarded rather than stored.  The flag is cleared again once
+// the workers have stopped, and resume() restarts them on the tiles
+// that were not finished.
+//
+// Each finished tile is also added to a queue, which the GL thread
+// empties with takeFinishedTiles() to upload only the parts of the
+// image that have changed since its last redraw.
+//
+// Given an AccumBuffer, start() runs one pass of adaptive rendering
+// instead: each pixel that is still active gets one more sample,
+// which is added to the buffer, and the image gets the pixel's mean.
+// The caller starts passes until no pixels are active.
+//
+// Given a Denoiser, the workers also record each pixel's AOVs in it
+// (on the first pass, if adaptive).
+//
+// startPreview() runs one pass of a coarse-to-fine preview instead.
+// A pass with step s traces one ray per s x s block of pixels (at the
+// block's lower-left pixel) and fills the block with its colour.  A
+// refining pass skips the pixels at multiples of 2s, which the
+// previous pass traced, so each pass costs three times the one
+// before and no ray is traced twice.  The ray of each pixel is the
+// one that a single-sample render would trace, so a refining pass
+// with step 1 finishes a single-sample image.
+
+
+#ifndef RENDERENGINE_H
+#define RENDERENGINE_H
+
+#include <atomic>
+#include <mutex>
+#include "linalg.h"
+#include "seq.h"
+#include "threadPool.h"
+
+
+class Scene;
+class AccumBuffer;
+class Denoiser;
+
+
+#define TILE_SIZE 16            // tile width and height, in raytraced pixels (a multiple of PACKET_WIDTH)
+                                // (the largest preview step)
+
+
+class RenderTile {
+ public:
+  int x0, y0;                   // lower-left pixel (inclusive)
+  int x1, y1;                   // upper-right pixel (exclusive)
+
+  RenderTile() {}
+
+  RenderTile( int _x0, int _y0, int _x1, int _y1 ) {
+    x0 = _x0; y0 = _y0; x1 = _x1; y1 = _y1;
+  }
+};
+
+
+class RenderEngine {
+
+  ThreadPool *pool;
+
+  seq<RenderTile>   tiles;      // all tiles of the current image
+  std::atomic<int>  nextTile;   // index of the next tile to be taken by a worker
+  std::atomic<int>  tilesDone;  // number of tiles that are completely traced
+  std::atomic<bool> cancelled;  // set to make the workers stop early
+  seq<bool>         tileFinished; // tileFinished[i] if tiles[i] is completely traced
+
+  seq<RenderTile>   finishedTiles; // tiles done since the last takeFinishedTiles()
+  std::mutex        finishedLock;
+
+  Scene *scene;
+  vec4  *image;                 // width x height image, written by the workers
+  int    width, height;
+  int    pixelScale;            // size (in window pixels) of one raytraced pixel
+  AccumBuffer *accum;           // adaptive pass if not NULL
+  Denoiser    *denoiser;        // records AOVs if not NULL
+  int    previewStep;           // preview pass with one ray per previewStep x previewStep pixels (or 0 for a full pass)
+  bool   refine;                // preview pass keeps the pixels traced by the previous (coarser) pass
+  void (*wakeup)();             // called by a worker when the last tile is done (if not NULL)
+
+  void renderTiles();
+  void renderTile( RenderTile &tile );
+  void renderTileAdaptive( RenderTile &tile );
+  void renderTilePreview( RenderTile &tile );
+  void launch();
+  void startWorkers();
+  void recordAOVs( int x0, int y0, int x1, int y1 );
+
+ public:
+
+  RenderEngine( int numThreads );
+  ~RenderEngine();
+
+  void start( Scene *s, vec4 *image, int width, int height, int pixelScale, AccumBuffer *accum = NULL, Denoiser *denoiser = NULL );
+  void startPreview( Scene *s, vec4 *image, int width, int height, int pixelScale, int step, bool refine, Denoiser *denoiser = NULL );
+  void cancel();
+  void resume();
+  void wait();
+
+  void takeFinishedTiles( seq<RenderTile> &done );
+
+  int numTiles() {
+    return tiles.size();
+  }
+
+  int numTilesDone() {
+    return tilesDone;
+  }
+
+  bool isDone() {
+    return tilesDone == tiles.size();
+  }
+
+  bool isCancelled() {          // checked by the scene for every ray
+    return cancelled;
+  }
+
+  void setWakeup( void (*f)() ) {
+    wakeup = f;
+  }
+
+  int numThreads() {
+    return pool->size();
+  }
+
+  ThreadPool *threadPool() {	// for other parallel work between renders
+    return pool;
+  }
+};
+
+
+#endif
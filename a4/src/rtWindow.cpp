@@ -120,12 +120,34 @@ void RTwindow::keyCallback( GLFWwindow* window, int key, int scancode, int actio
       cout << "jittering " << (scene->jitter ? "on" : "off") << endl;
       break;
 
+    case 'D':
+      scene->denoise = !scene->denoise;
+      viewpointChanged = true;
+      redisplay = true;
+      cout << "denoising " << (scene->denoise ? "on" : "off") << endl;
+      break;
+
     case 'R':
       scene->russianRoulette = !scene->russianRoulette;
+      viewpointChanged = true;
       redisplay = true;
       cout << "Russian Roulette " << (scene->russianRoulette ? "on" : "off") << endl;
       break;
 
+    case 'U':
+      scene->pathTracing = !scene->pathTracing;
+      viewpointChanged = true;
+      redisplay = true;
+      cout << "path tracing " << (scene->pathTracing ? "on" : "off") << endl;
+      break;
+
+    case 'V':
+      scene->progressivePreview = !scene->progressivePreview;
+      viewpointChanged = true;
+      redisplay = true;
+      cout << "progressive preview " << (scene->progressivePreview ? "on" : "off") << endl;
+      break;
+
     case '/':
       cout
 	<< endl
@@ -136,6 +158,10 @@ void RTwindow::keyCallback( GLFWwindow* window, int key, int scancode, int actio
 	<< "G     increase glossiness" << endl
 	<< "g     decrease glossiness" << endl
 	<< "j     toggle pixel sample jittering" << endl
+	<< "d     toggle denoising" << endl
+	<< "r     toggle Russian roulette" << endl
+	<< "u     toggle path tracing (one glossy ray per bounce)" << endl
+	<< "v     toggle coarse-to-fine preview" << endl
 	<< "a     show/hide axes" << endl
 	<< "e     output eye position" << endl
 	<< "DEL   delete debugging rays" << endl
@@ -242,12 +268,20 @@ void RTwindow::mouseClick( vec3 mouse, int button, int keyModifiers )
 
     if (!keyModifiers) {
 
+      // Stop the raytracing threads, since they would otherwise see
+      // 'storingRays' and add their rays, too.  They continue once
+      // the pixel is traced.
+
+      scene->cancelRT();
+
       scene->storedRays.clear();
       scene->storedRayColours.clear();
       scene->storingRays = true;
       scene->pixelColour( mouse.x, windowHeight-1-mouse.y );
       scene->storingRays = false;
 
+      scene->resumeRT();
+
     } else if (keyModifiers & GLFW_MOD_SHIFT) {
 
       // A right-click on a pixel sets that as the "debugging pixel".
@@ -0,0 +1,285 @@
+// sampler.cpp
+
+
+#include "headers.h"
+#include "sampler.h"
+
+
+SamplePattern Sampler::pattern = SAMPLES_SOBOL;
+unsigned int  Sampler::seed    = 0;
+
+
+#define PIXEL_STREAM   1	// PCG stream for pixel offsets
+#define SHADING_STREAM 2	// PCG stream for everything after the primary ray
+
+
+
+// PCG32 (the "pcg32_random_r" generator of pcg-random.org)
+
+void PCG32::seed( uint64_t initState, uint64_t stream )
+
+{
+  state = 0;
+  inc   = (stream << 1) | 1;
+  next();
+  state += initState;
+  next();
+}
+
+
+uint32_t PCG32::next()
+
+{
+  uint64_t old = state;
+  state = old * 6364136223846793005ULL + inc;
+
+  uint32_t xorShifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+  uint32_t rot        = (uint32_t) (old >> 59);
+
+  return (xorShifted >> rot) | (xorShifted << ((-rot) & 31));
+}
+
+
+
+// Mix the pixel, sample, and render seed into one 64-bit seed, so
+// that neighbouring pixels get unrelated sequences.  This is the
+// SplitMix64 finalizer.
+
+static uint64_t hashSeed( int x, int y, int sampleIndex )
+
+{
+  uint64_t h = ((uint64_t) (uint32_t) x << 32) ^ (uint64_t) (uint32_t) y;
+
+  h ^= ((uint64_t) (uint32_t) sampleIndex << 16) ^ ((uint64_t) Sampler::seed << 48);
+
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h =  h ^ (h >> 31);
+
+  return h;
+}
+
+
+// The position of 'i' in a pseudo-random permutation of [0,n)
+// chosen by 'seed'.  This is Kensler's hash-based permutation (from
+// "Correlated Multi-Jittered Sampling", 2013), which needs no table:
+// it hashes i within the next power of two above n and repeats until
+// the result is below n.
+
+static int permute( uint32_t i, uint32_t n, uint32_t seed )
+
+{
+  uint32_t w = n - 1;
+
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+
+  do {
+    i ^= seed;         i *= 0xe170893d;
+    i ^= seed >> 16;   i ^= (i & w) >> 4;
+    i ^= seed >> 8;    i *= 0x0929eb3f;
+    i ^= seed >> 23;   i ^= (i & w) >> 1;
+    i *= 1 | seed >> 27;
+    i *= 0x6935fa69;   i ^= (i & w) >> 11;
+    i *= 0x74dcb303;   i ^= (i & w) >> 2;
+    i *= 0x9e501cc3;   i ^= (i & w) >> 2;
+    i *= 0xc860a3df;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= n);
+
+  return (i + seed) % n;
+}
+
+
+void Sampler::start( int x, int y, int sampleIndex )
+
+{
+  rng.seed( hashSeed( x, y, sampleIndex ), SHADING_STREAM );
+}
+
+
+void Sampler::pixelOffset( int x, int y, int sampleIndex, int numSamples, float &xOffset, float &yOffset )
+
+{
+  Sampler s;
+
+  if (pattern == SAMPLES_HALTON || pattern == SAMPLES_SOBOL) {
+
+    // One low-discrepancy set over the whole pixel, scrambled the
+    // same way for all samples of the pixel
+
+    s.rng.seed( hashSeed( x, y, 0 ), PIXEL_STREAM );
+
+    SampleSet2D set( s, numSamples );
+    set.get( sampleIndex, xOffset, yOffset );
+
+  } else {
+
+    // The grid is already stratified, so jitter within the sample's
+    // own cell.  The cells are taken in a random order, rather than
+    // row by row, in case only some of the samples are taken.
+
+    s.rng.seed( hashSeed( x, y, sampleIndex ), PIXEL_STREAM );
+
+    int n = MAX( numSamples, 1 );
+    int nx, ny;
+    gridCells( n, nx, ny );
+
+    int cell = permute( sampleIndex % n, n, (uint32_t) (hashSeed( x, y, 0 ) >> 32) );
+
+    xOffset = ((cell % nx) + s.next1D()) / nx;
+    yOffset = ((cell / nx) + s.next1D()) / ny;
+  }
+}
+
+
+void Sampler::gridCells( int n, int &nx, int &ny )
+
+{
+  nx = (int) floor( sqrt( (float) n ) );
+
+  while (n % nx != 0)		// nx = 1 always divides
+    nx--;
+
+  ny = n / nx;
+}
+
+
+bool Sampler::setPattern( const char *name )
+
+{
+  if      (strcmp( name, "random" )     == 0) pattern = SAMPLES_RANDOM;
+  else if (strcmp( name, "stratified" ) == 0) pattern = SAMPLES_STRATIFIED;
+  else if (strcmp( name, "halton" )     == 0) pattern = SAMPLES_HALTON;
+  else if (strcmp( name, "sobol" )      == 0) pattern = SAMPLES_SOBOL;
+  else
+    return false;
+
+  return true;
+}
+
+
+const char *Sampler::patternName()
+
+{
+  switch (pattern) {
+  case SAMPLES_RANDOM:     return "random";
+  case SAMPLES_STRATIFIED: return "stratified";
+  case SAMPLES_HALTON:     return "halton";
+  case SAMPLES_SOBOL:      return "sobol";
+  }
+  return "";
+}
+
+
+
+// Low-discrepancy sequences
+
+
+static uint32_t reverseBits( uint32_t i )
+
+{
+  i = (i << 16) | (i >> 16);
+  i = ((i & 0x00ff00ff) << 8) | ((i & 0xff00ff00) >> 8);
+  i = ((i & 0x0f0f0f0f) << 4) | ((i & 0xf0f0f0f0) >> 4);
+  i = ((i & 0x33333333) << 2) | ((i & 0xcccccccc) >> 2);
+  i = ((i & 0x55555555) << 1) | ((i & 0xaaaaaaaa) >> 1);
+  return i;
+}
+
+
+// Second dimension of the Sobol sequence (the first is the van der
+// Corput sequence, reverseBits())
+
+static uint32_t sobol2( uint32_t i )
+
+{
+  uint32_t r = 0;
+
+  for (uint32_t v = 1u << 31; i != 0; i >>= 1, v ^= v >> 1)
+    if (i & 1)
+      r ^= v;
+
+  return r;
+}
+
+
+static float radicalInverse3( uint32_t i )
+
+{
+  float invBase = 1.0f / 3.0f;
+  float f = invBase;
+  float r = 0;
+
+  while (i > 0) {
+    r += f * (i % 3);
+    i /= 3;
+    f *= invBase;
+  }
+
+  return r;
+}
+
+
+static float toFloat( uint32_t bits )	// in [0,1)
+
+{
+  return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+
+static float wrap( float x )		// into [0,1)
+
+{
+  x = x - floor(x);
+  return (x < 1 ? x : 0);
+}
+
+
+
+SampleSet2D::SampleSet2D( Sampler &s, int n )
+
+{
+  sampler     = &s;
+  count       = MAX( n, 1 );
+
+  scramble[0] = s.rng.next();
+  scramble[1] = s.rng.next();
+
+  shift[0]    = toFloat( scramble[0] );
+  shift[1]    = toFloat( scramble[1] );
+
+  Sampler::gridCells( count, gridX, gridY );
+}
+
+
+void SampleSet2D::get( int index, float &u, float &v )
+
+{
+  switch (Sampler::pattern) {
+
+  case SAMPLES_RANDOM:
+    u = sampler->next1D();
+    v = sampler->next1D();
+    break;
+
+  case SAMPLES_STRATIFIED:
+    u = ((index % gridX) + sampler->next1D()) / gridX;
+    v = ((index / gridX) + sampler->next1D()) / gridY;
+    break;
+
+  case SAMPLES_HALTON:
+    u = wrap( toFloat( reverseBits( index ) ) + shift[0] );
+    v = wrap( radicalInverse3( index )        + shift[1] );
+    break;
+
+  case SAMPLES_SOBOL:
+    u = toFloat( reverseBits( index ) ^ scramble[0] );
+    v = toFloat( sobol2( index )      ^ scramble[1] );
+    break;
+  }
+}
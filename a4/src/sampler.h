@@ -0,0 +1,119 @@
+// sampler.h
+//
+// Random and low-discrepancy samples for the raytracer
+//
+// Each sample of each pixel has its own random number generator,
+// seeded from the pixel coordinates and the sample index, so a render
+// is the same regardless of the number of threads or the order in
+// which pixels are traced.  The generator is PCG32 (see
+// pcg-random.org), which is small, fast, and needs no locking.
+//
+// A set of n related samples (e.g. the rays of one glossy cone, or
+// the points on one emitting triangle) is taken from a SampleSet2D,
+// which spreads the n points evenly over [0,1)^2 according to
+// Sampler::pattern.  Each set is randomly scrambled, so different
+// sets (and different pixels) get different points.
+
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+
+
+enum SamplePattern {
+  SAMPLES_RANDOM,		// independent uniform samples
+  SAMPLES_STRATIFIED,		// one jittered sample per cell of a grid
+  SAMPLES_HALTON,		// Halton sequence (bases 2 and 3), randomly shifted
+  SAMPLES_SOBOL			// Sobol (0,2)-sequence, randomly XOR-scrambled
+};
+
+
+class PCG32 {
+
+  uint64_t state;
+  uint64_t inc;
+
+ public:
+
+  PCG32() {
+    seed( 0, 0 );
+  }
+
+  void seed( uint64_t initState, uint64_t stream );
+
+  uint32_t next();
+
+  float nextFloat() {		// in [0,1)
+    return (next() >> 8) * (1.0f / 16777216.0f);
+  }
+};
+
+
+class Sampler {
+
+ public:
+
+  PCG32 rng;
+
+  static SamplePattern pattern;	// SAMPLES_SOBOL by default
+  static unsigned int  seed;	// changes all samples of a render
+
+  // Start sample 'sampleIndex' of pixel (x,y)
+
+  void start( int x, int y, int sampleIndex );
+
+  float next1D() {
+    return rng.nextFloat();
+  }
+
+  // Offset within pixel (x,y) of sample 'sampleIndex' of
+  // 'numSamples'.  For the stratified and random patterns, the
+  // samples fill the cells of a gridCells() grid in an order that is
+  // randomly permuted per pixel, so that the first few samples (all
+  // that an adaptive render takes of a converged pixel) are spread
+  // over the whole pixel.  This uses its own generator, so it does
+  // not disturb the samples taken after start().
+
+  static void pixelOffset( int x, int y, int sampleIndex, int numSamples, float &xOffset, float &yOffset );
+
+  // Split n samples into an nx x ny grid with nx * ny == n and nx as
+  // close to sqrt(n) as possible, so that every cell gets a sample
+
+  static void gridCells( int n, int &nx, int &ny );
+
+  static bool setPattern( const char *name );
+  static const char *patternName();
+};
+
+
+// One sample of a pixel: its sampler is started with (x,y,index) and
+// its primary ray passes through (x + xOffset, y + yOffset).
+
+class PixelSample {
+
+ public:
+
+  int   x, y;			// window pixel
+  int   index;			// sample number within the pixel
+  float xOffset, yOffset;	// position within the pixel, in [0,1]^2
+};
+
+
+class SampleSet2D {
+
+  Sampler  *sampler;
+  int       count;
+  uint32_t  scramble[2];
+  float     shift[2];
+  int       gridX, gridY;	// stratified grid, with gridX * gridY == count
+
+ public:
+
+  SampleSet2D( Sampler &s, int n );
+
+  void get( int index, float &u, float &v ); // sample 'index' in [0,n) of the set
+};
+
+
+#endif
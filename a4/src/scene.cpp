@@ -15,6 +15,7 @@
 #include "main.h"
 #include "material.h"
 #include "rtWindow.h"
+#include "sampler.h"
 #include "scene.h"
 #include "sphere.h"
 #include "strokefont.h"
@@ -37,6 +38,32 @@ vec3 blackColour(0, 0, 0);
 
 #define MAX_NUM_LIGHTS 4
 
+#define GLOSSY_LOBE_INSIDE 0.9  // fraction of the glossy lobe inside the cone of half angle arccos(g)
+
+#define RR_MIN_DEPTH 2  // Russian roulette applies only to rays deeper than this
+
+#define SHADOW_RAY_SHORTEN 0.9999  // shadow rays to an emitting triangle stop this fraction of the way there
+
+// Density (per steradian) of a direction whose angle from the centre
+// of a cos^m lobe has cosine 'cosAngle'
+
+static float lobePdf(float cosAngle, float m)
+
+{
+    return (cosAngle <= 0 ? 0 : (m + 1) / (2 * M_PI) * pow(cosAngle, m));
+}
+
+// Power heuristic weight of a sample from a strategy with density
+// 'pdf', against another strategy with density 'otherPdf'.  Each
+// density is multiplied by its strategy's number of samples.
+
+static float misWeight(float pdf, float otherPdf)
+
+{
+    return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}
+
+
 // Display everything
 
 void Scene::display()
@@ -50,48 +77,29 @@ void Scene::display()
     draw_RT_and_GL(WCS_to_VCS, VCS_to_CCS);
 }
 
-// Find the first object intersected
+// Find the first object intersected.  Only 'hitRec' is filled in, so
+// call the hit object's hitInfo() for the point, normal, etc.
+
+static thread_local long long threadRayCount = 0;  // rays traced by this thread but not yet added to numRaysTraced
 
-bool Scene::findFirstObjectInt(vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, vec3 &P, vec3 &N,
-                               vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat, int lightIndex)
+static thread_local Sampler sampler;  // samples for the pixel sample that this thread is tracing (see start())
+
+bool Scene::findFirstObjectInt(vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, HitRecord &hitRec,
+                               int lightIndex)
 
 {
-    if (storingRays) storedRays.add(rayStart);
+    threadRayCount++;
 
-    bool hit = false;
+    if (storingRays) storedRays.add(rayStart);
 
-    float maxParam = MAXFLOAT;
+    // The object BVH skips the originating object for non-wavefront
+    // objects (since such objects are convex)
 
-    for (int i = 0; i < objects.size(); i++) {
-        WavefrontObj *wfo = dynamic_cast<WavefrontObj *>(objects[i]);
-
-        // don't check for int with the originating object for non-wavefront objects (since such objects are convex)
-
-        if (wfo || i != thisObjIndex) {
-            vec3 point, normal, texcoords;
-            float t;
-            Material *intMat;
-            int intPartIndex;
-
-            if (objects[i]->rayInt(rayStart, rayDir, ((i != thisObjIndex) ? -1 : thisObjPartIndex), maxParam, point,
-                                   normal, texcoords, t, intMat, intPartIndex)) {
-                P = point;
-                N = normal;
-                T = texcoords;
-                param = t;
-                objIndex = i;
-                objPartIndex = intPartIndex;
-                mat = intMat;
-
-                maxParam = t;  // In future, don't intersect any farther than this
-                hit = true;
-            }
-        }
-    }
+    bool hit = objectBVH->rayInt(rayStart, rayDir, thisObjIndex, thisObjPartIndex, MAXFLOAT, hitRec);
 
     if (storingRays) {
         if (hit) {
-            storedRays.add(P);
+            storedRays.add(rayStart + hitRec.t * rayDir);
             if (lightIndex >= 0) {
                 storedRayColours.add(
                     vec3(.843, .710, .278));  // GOLD: shadow ray toward a light that is (perhaps) blocked
@@ -111,47 +119,91 @@ bool Scene::findFirstObjectInt(vec3 rayStart, vec3 rayDir, int thisObjIndex, int
     return hit;
 }
 
+// Is there any object between rayStart and rayStart + maxDist * rayDir?
+//
+// This is for shadow rays, which need only a yes/no answer, so it
+// stops at the first blocker found.  'rayDir' should be unit length
+// so that 'maxDist' is a distance.
+
+bool Scene::occluded(vec3 rayStart, vec3 rayDir, float maxDist, int thisObjIndex, int thisObjPartIndex)
+
+{
+    threadRayCount++;
+
+    bool blocked = objectBVH->occluded(rayStart, rayDir, thisObjIndex, thisObjPartIndex, maxDist);
+
+    if (storingRays) {
+        storedRays.add(rayStart);
+
+        HitRecord hitRec;
+
+        if (blocked && objectBVH->rayInt(rayStart, rayDir, thisObjIndex, thisObjPartIndex, maxDist, hitRec))
+            storedRays.add(rayStart + hitRec.t * rayDir);  // show the ray ending at the blocker
+        else
+            storedRays.add(rayStart + maxDist * rayDir);
+
+        storedRayColours.add(vec3(.843, .710, .278));  // GOLD: shadow ray toward a light
+    }
+
+    return blocked;
+}
+
 // Raytrace: This is the main raytracing routine which finds the first
 // object intersected, performs the lighting calculation, and does
 // recursive calls.
 //
-// This returns the colour received on the ray.
+// This returns the colour received on the ray.  If 'firstHit' is not
+// NULL, it is set to the object and normal that the ray hits.
+//
+// 'weight' is the ray's throughput: a bound on how much of the ray's
+// colour reaches the eye (1 for a primary ray).
 
-vec3 Scene::raytrace(vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex)
+vec3 Scene::raytrace(vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex,
+                     SampleHit *firstHit, float weight)
 
 {
+    if (firstHit != NULL) firstHit->objIndex = -1;  // nothing hit (yet)
+
     // Terminate the ray?
 
-    // Terminate based on depth.  This leads to biased sampling.
-    // Russian Roulette would be better.
+    // Terminate based on depth.  This leads to biased sampling, but
+    // maxDepth can be large with Russian roulette, below.
 
     depth++;
 
     if (depth > maxDepth) return blackColour;
 
+    // Terminate if the render has been cancelled (e.g. the viewpoint
+    // moved), so the workers give up on expensive pixels right away
+
+    if (renderEngine != NULL && renderEngine->isCancelled()) return blackColour;
+
+    // Russian roulette: Terminate a deep ray with a probability that
+    // increases as its throughput decreases, and scale up the colour
+    // of a surviving ray to compensate, which keeps the result
+    // unbiased.  Rays that contribute little to the image are rarely
+    // traced further.
+
+    float survival = 1;
+
+    if (russianRoulette && depth > RR_MIN_DEPTH) {
+        survival = MIN(1, weight);
+        if (sampler.next1D() >= survival) return blackColour;
+    }
+
     // Find the closest object intersected
 
-    vec3 P, N, texcoords;
-    float t;
-    int objIndex, objPartIndex;
-    Material *mat;
+    HitRecord hitRec;
 
     // Below, 'rayStart' is the ray staring point
     //        'rayDir' is the direction of the ray
     //        'thisObjIndex' is the index of the originating object
     //        'thisObjPartIndex' is the index of the part on the originating object (e.g. the triangle)
     //
-    // If a hit is made then at the intersection point:
-    //        'P' is the position
-    //        'N' is the normal
-    //        'texcoords' are the texture coordinates
-    //        't' is the ray parameter at intersection
-    //        'objIndex' is the index of the object that is hit
-    //        'objPartIndex' is the index of the part of object that is hit
-    //        'mat' is the material at the intersection point
+    // If a hit is made then 'hitRec' holds the ray parameter, the
+    // object and part hit, and the barycentric coordinates.
 
-    bool hit = findFirstObjectInt(rayStart, rayDir, thisObjIndex, thisObjPartIndex, P, N, texcoords, t, objIndex,
-                                  objPartIndex, mat, -1);
+    bool hit = findFirstObjectInt(rayStart, rayDir, thisObjIndex, thisObjPartIndex, hitRec, -1);
 
     // No intersection: Return background colour
 
@@ -163,10 +215,54 @@ vec3 Scene::raytrace(vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
             return blackColour;
     }
 
-    // Find reflection direction & incoming light from that direction
+    // Evaluate the surface at the hit, now that it is known to be the
+    // closest.  At the intersection point:
+    //        'P' is the position
+    //        'N' is the normal
+    //        'texcoords' are the texture coordinates
+    //        'mat' is the material at the intersection point
+
+    vec3 P, N, texcoords;
+    Material *mat;
+
+    objects[hitRec.objIndex]->hitInfo(rayStart, rayDir, hitRec, P, N, texcoords, mat);
+
+    if (firstHit != NULL) {
+        firstHit->objIndex = hitRec.objIndex;
+        firstHit->partIndex = hitRec.partIndex;
+        firstHit->normal = N;
+        firstHit->survival = survival;
+    }
+
+    vec3 colour = shade(rayDir, depth, thisObjIndex, hitRec, P, N, texcoords, mat, NULL, weight);
+
+    return (survival < 1 ? (1 / survival) * colour : colour);
+}
+
+// Shade: Find the light leaving the intersection point 'P' in the
+// direction opposite to 'rayDir'.  This adds the emitted, ambient,
+// reflected, and glossy light, and the light from point lights and
+// emitting triangles.
+//
+// If 'lightsVisible' is not NULL, bit i of *lightsVisible tells
+// whether point light i is visible from P (as already found for a
+// packet of shadow rays).  Otherwise a shadow ray is traced to each
+// light.
+
+vec3 Scene::shade(vec3 &rayDir, int depth, int thisObjIndex, HitRecord &hitRec, vec3 &P, vec3 &N, vec3 &texcoords,
+                  Material *mat, unsigned int *lightsVisible, float weight)
+
+{
+    //        'objIndex' is the index of the object that is hit
+    //        'objPartIndex' is the index of the part of object that is hit
+
+    int objIndex = hitRec.objIndex;
+    int objPartIndex = hitRec.partIndex;
 
     Object &obj = *objects[objIndex];
 
+    // Find reflection direction & incoming light from that direction
+
     vec3 E = (-1 * rayDir).normalize();
     vec3 R = (2 * (E * N)) * N - E;
 
@@ -197,51 +293,97 @@ vec3 Scene::raytrace(vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
 
     float g = mat->g;
 
+    float lobeExponent = -1;  // of the glossy lobe, if the glossy rays are sampled from one
+    float numGlossyRays = 0;
+
+    // Throughput of a reflected ray: at most kd + ks of its colour is
+    // reflected toward this ray
+
+    vec3 reflectance = kd + mat->ks;
+    float reflectedWeight = weight * MAX(reflectance.x, MAX(reflectance.y, reflectance.z));
+
     if (g == 1 || numRaySamples == 1) {
-        vec3 Iin = raytrace(P, R, depth, objIndex, objPartIndex);
+        vec3 Iin = raytrace(P, R, depth, objIndex, objPartIndex, NULL, reflectedWeight);
 
         Iout = Iout + calcIout(N, R, E, E, kd, mat->ks, mat->n, Iin);
 
     } else if (g > 0) {
         // Glossy reflection
         //
-        // Cast 'numRaySamples' random rays from P centred on direction R
-        // using glossiness 'g' to control the spread of the rays.  For
-        // glossiness 'g', the half angle of the cone of rays is
-        // arccos(g).  Average the *reflected* colours of the rays and add
-        // that average to Iout.  EACH INDIVIDUAL RAY has its own
+        // Cast 'numRaySamples' rays (or one ray, if path tracing) from
+        // P around direction R, using
+        // glossiness 'g' to control the spread of the rays.  The rays
+        // are importance sampled from a Phong lobe, with density
+        // proportional to cos^m of the angle from R, where m is chosen
+        // so that a fraction GLOSSY_LOBE_INSIDE of the lobe is within
+        // the cone of half angle arccos(g) around R.  Since the rays
+        // are distributed like the lobe, each ray's colour is weighted
+        // equally, so the average of the *reflected* colours of the
+        // rays is added to Iout.  EACH INDIVIDUAL RAY has its own
         // reflected colour according to Phong, which is determined by
-        // passing the individual ray through calcIout().
+        // passing the individual ray through calcIout().  Rays below
+        // the surface reflect nothing.
+        //
+        // Light that reaches P directly from an emitting triangle is
+        // found both by the glossy rays that hit the triangle and by
+        // the shadow rays sent to the triangle below.  The two are
+        // combined with multiple importance sampling: each ray's share
+        // of the emitted light is weighted by the power heuristic, so
+        // the glossy rays count most where the lobe is narrow and the
+        // shadow rays where the triangle is small.
         vec3 TotalGlossyIout = vec3(0, 0, 0);
         float psi = g = 1 - (1 - g) / glossinessFactor;  // glossinessFactor is controlled by pressing 'G' or 'g'
 
         lastGlossiness = g;  // for showing in the window's status message
 
         // ---------------- START YOUR CODE HERE ----------------
-        float halfangle = acos(g);
-        float dist = 1 / tan(halfangle);
-        float A, B, AandB;
+        // The fraction of the lobe with cos(angle) > g is 1 - g^(m+1)
+
+        float m = MAX(0, log(1 - GLOSSY_LOBE_INSIDE) / log(g) - 1);
+
+        lobeExponent = m;
+        numGlossyRays = (pathTracing ? 1 : numRaySamples);
+
         vec3 Iin, u, v, pointDir;
         u = R.perp1();
         v = R.perp2();
 
-        for (int i = 0; i < numRaySamples; i++) {
-            // ensure A^2 + B^2 <= 1
-            A = 1.0;
-            B = 1.0;
-            AandB = 2.0;  // set to anything >1
-            while (AandB > 1) {
-                A = randIn01();
-                B = randIn01();
-                AandB = pow(A, 2) + pow(B, 2);
+        SampleSet2D lobeSamples(sampler, (int)ceil(numGlossyRays));
+
+        for (int i = 0; i < numGlossyRays; i++) {
+            // Map a stratified sample in [0,1]^2 to the lobe
+            float su, sv;
+            lobeSamples.get(i, su, sv);
+
+            float cosAngle = pow(1 - su, 1 / (m + 1));  // 1-su is in (0,1], so cosAngle > 0
+            float sinAngle = sqrt(MAX(0, 1 - cosAngle * cosAngle));
+            float phi = 2 * M_PI * sv;
+
+            pointDir = (cosAngle * R + (sinAngle * cos(phi)) * u + (sinAngle * sin(phi)) * v).normalize();
+
+            if (pointDir * N <= 0)  // below the surface
+                continue;
+
+            SampleHit hit;
+            Iin = raytrace(P, pointDir, depth, objIndex, objPartIndex, &hit, reflectedWeight);
+
+            int e = (hit.objIndex >= 0 ? findEmitter(hit.objIndex, hit.partIndex) : -1);
+
+            if (e >= 0) {
+                SphericalTriangle sphTri(P, emitters[e].verts);
+                if (sphTri.solidAngle > 0) {
+                    float w = misWeight(numGlossyRays * lobePdf(pointDir * R, m),
+                                        numRaySamples * emitterTable.pdf(e) / sphTri.solidAngle);
+                    // The shadow rays get the rest.  Iin was scaled up
+                    // by Russian roulette, so the same is done here.
+                    Iin = Iin - ((1 - w) / hit.survival) * emitters[e].Ie;
+                }
             }
 
-            pointDir = (dist * R + A * u + B * v).normalize();
-            Iin = raytrace(P, pointDir, depth, objIndex, objPartIndex);
             TotalGlossyIout = TotalGlossyIout + calcIout(N, pointDir, E, R, kd, mat->ks, mat->n, Iin);
         }
 
-        Iout = Iout + (1.0f / numRaySamples) * TotalGlossyIout;
+        Iout = Iout + (1.0f / numGlossyRays) * TotalGlossyIout;
 
         // ---------------- END YOUR CODE HERE ----------------
     }
@@ -257,20 +399,16 @@ vec3 Scene::raytrace(vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
             float Ldist = L.length();
             L = (1.0 / Ldist) * L;
 
-            vec3 intP, intN, intTexCoords;
-            float intT;
-            int intObjIndex, intObjPartIndex;
-            Material *intMat;
-
             // Is there an object between P and the light?
-            //
-            // Note that 'intObjIndex' will return with the index of the
-            // object that is hit.  So the hit object is objects[intObjIndex].
 
-            bool found = findFirstObjectInt(P, L, objIndex, objPartIndex, intP, intN, intTexCoords, intT, intObjIndex,
-                                            intObjPartIndex, intMat, i);
+            bool visible;
 
-            if (!found || intT > Ldist) {  // no object: Add contribution from this light
+            if (lightsVisible != NULL)
+                visible = (*lightsVisible >> i) & 1;
+            else
+                visible = !occluded(P, L, Ldist, objIndex, objPartIndex);
+
+            if (visible) {  // no object: Add contribution from this light
                 vec3 Lr = (2 * (L * N)) * N - L;
                 Iout = Iout + calcIout(N, L, E, Lr, kd, mat->ks, mat->n, light.colour);
             }
@@ -278,86 +416,114 @@ vec3 Scene::raytrace(vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex,
     }
 
     // Add contributions from emitting triangles
+    //
+    // Send 'numRaySamples' shadow rays in all, each toward an emitting
+    // triangle chosen from 'emitterTable' in proportion to its power.
+    // A ray's contribution is divided by the probability of choosing
+    // its triangle, so the result is (on average) the sum over all
+    // triangles, but costs the same however many there are.
+
+    if (emitters.size() > 0) {
+        // Add to Iout the contribution from each emitting triangle,
+        // 'em', which has colour 'em.Ie'.
+        //
+        // Apply Phong *separately* to *each* shadow ray that reaches the light.
+        //
+        // Use a SampleSet2D to generate well-spread points in [0,1]^2.
 
-    for (int i = 0; i < objects.size(); i++) {
-        if (i != thisObjIndex) {
-            Triangle *tri = dynamic_cast<Triangle *>(objects[i]);
-            if (tri && tri->mat->Ie.squaredLength() > 0) {
-                // Add to Iout the contribution from the emitting triangle, 'tri',
-                // which has colour 'tri->mat->Ie'.
-                //
-                // Apply Phong *separately* to *each* shadow ray that reaches the light.
-                //
-                // Use 'randIn01()' to generate uniform random floats in [0,1].
-                //
-                // Send 'numRaySamples' rays toward the emitting triangle.
-
-                // ---------------- BEGIN YOUR CODE HERE ----------------
-
-                // Soft shadows
-
-                vec3 tempIout = vec3(0, 0, 0);
-                int raysThatHit = 0;
-
-                for (int i = 0; i < numRaySamples; i++) {
-                    // Rejection sampling:
-                    // choose A, B in [0, 1]
-                    float alpha = 1;
-                    float beta = 1;
-                    while (alpha + beta > 1) {
-                        alpha = randIn01();
-                        beta = randIn01();
-                    }
-                    float gamma = 1 - alpha - beta;
-
-                    // point on tri is defined as gamma*v0 + alpha*v1 + beta*v2
-                    vec3 gammaV0 = gamma * tri->verts[0].position;
-                    vec3 alphaV1 = alpha * tri->verts[1].position;
-                    vec3 betaV2 = beta * tri->verts[2].position;
-                    vec3 triPoint = gammaV0 + alphaV1 + betaV2;
-                    vec3 triPointDir = triPoint - P;
-                    float triPointDist = triPointDir.length();
-                    triPointDir = triPointDir.normalize();
-
-                    // Next, test intT (distance) to see if the ray is blocked
-                    vec3 intP, intN, intTexCoords;
-                    float intT;
-                    int intObjIndex, intObjPartIndex;
-                    Material *intMat;
-
-                    // Is there an object between P and the light?
-                    //
-                    // Note that 'intObjIndex' will return with the index of the
-                    // object that is hit.  So the hit object is objects[intObjIndex].
-
-                    bool found = findFirstObjectInt(P, triPointDir, objIndex, objPartIndex, intP, intN, intTexCoords,
-                                                    intT, intObjIndex, intObjPartIndex, intMat, i);
-
-                    // is dist to point on tri == to actual int point +/- epsilon?
-                    float epsilon = 0.0001;
-
-                    if (found && triPointDist < intT + epsilon && triPointDist > intT - epsilon) {
-                        // for a ray that hits...
-                        raysThatHit += 1;
-
-                        vec3 triPointDirR = (2 * (triPointDir * N)) * N - triPointDir;
-                        tempIout =
-                            tempIout + calcIout(N, triPointDir, E, triPointDirR, kd, mat->ks, mat->n, tri->mat->Ie);
-                    }
+        // ---------------- BEGIN YOUR CODE HERE ----------------
+
+        // Soft shadows
+        //
+        // The rays to a triangle are spread uniformly over its solid
+        // angle as seen from P, so each part of the triangle counts in
+        // proportion to how large it appears.  (A triangle too small to
+        // sample that way is sampled uniformly over its area instead.)
+        // Each ray only needs to know whether anything blocks it, which
+        // is an any-hit query that stops just short of the triangle.
+
+        vec3 tempIout = vec3(0, 0, 0);
+        vec3 glossyIout = vec3(0, 0, 0);  // emitted light reflected by the glossy lobe
+
+        int numSamples = (int)ceil(numRaySamples);
+
+        SampleSet2D lightSamples(sampler, numSamples);
+
+        SphericalTriangle sphTri;
+        int sphTriEmitter = -1;  // emitter of 'sphTri'
+
+        for (int i = 0; i < numRaySamples; i++) {
+            // Choose the triangle, stratifying the choices over the
+            // rays
+
+            int e = 0;
+            float selectPdf = 1;
+
+            if (emitters.size() > 1) e = emitterTable.sample((i + sampler.next1D()) / numSamples, selectPdf);
+
+            Emitter &em = emitters[e];
+
+            if (em.objIndex == objIndex && (em.partIndex < 0 || em.partIndex == objPartIndex))
+                continue;  // P is on this triangle
+
+            if (e != sphTriEmitter) {
+                sphTri = SphericalTriangle(P, em.verts);
+                sphTriEmitter = e;
+            }
+
+            // Choose the point on the triangle
+
+            float su, sv;
+            lightSamples.get(i, su, sv);
+
+            vec3 triPointDir;
+            float triPointDist;
+
+            if (sphTri.solidAngle > 0) {
+                triPointDir = sphTri.sample(su, sv);
+                triPointDist = sphTri.distance(triPointDir);
+            } else {
+                // Choose alpha, beta in [0, 1] with alpha + beta <= 1
+                // by folding the upper half of the square onto the
+                // lower half
+                if (su + sv > 1) {
+                    su = 1 - su;
+                    sv = 1 - sv;
                 }
+                vec3 triPoint = (1 - su - sv) * em.verts[0] + su * em.verts[1] + sv * em.verts[2];
+                triPointDir = triPoint - P;
+                triPointDist = triPointDir.length();
+                triPointDir = triPointDir.normalize();
+            }
 
-                // calc avg. ray (r hat)
-                vec3 avgRay = (1.0f / raysThatHit) * tempIout;
+            if (triPointDir * N <= 0)  // light from behind the surface contributes nothing
+                continue;
 
-                // calc intensity of r hat
-                vec3 intensityOfAvgRay =
-                    raysThatHit == 0 ? vec3(0, 0, 0) : (1.0f / numRaySamples) * raysThatHit * avgRay;
+            // Is there an object between P and the light?  Stop just
+            // short of the emitting triangle so that it does not
+            // block itself.
 
-                Iout = Iout + intensityOfAvgRay;
+            if (!occluded(P, triPointDir, SHADOW_RAY_SHORTEN * triPointDist, objIndex, objPartIndex)) {
+                vec3 triPointDirR = (2 * (triPointDir * N)) * N - triPointDir;
+                tempIout = tempIout + (1 / selectPdf) *
+                                          calcIout(N, triPointDir, E, triPointDirR, kd, mat->ks, mat->n, em.Ie);
 
-                // ---------------- END YOUR CODE HERE ----------------
+                // This ray's share of the light that the glossy lobe
+                // reflects (see the glossy reflection above)
+
+                if (lobeExponent >= 0 && sphTri.solidAngle > 0) {
+                    float lightPdf = selectPdf / sphTri.solidAngle;
+                    float glossyPdf = lobePdf(triPointDir * R, lobeExponent);
+                    float w = misWeight(numRaySamples * lightPdf, numGlossyRays * glossyPdf);
+                    glossyIout = glossyIout + (w * glossyPdf / lightPdf) *
+                                                  calcIout(N, triPointDir, E, R, kd, mat->ks, mat->n, em.Ie);
+                }
             }
         }
+
+        Iout = Iout + (1.0f / numRaySamples) * (tempIout + glossyIout);
+
+        // ---------------- END YOUR CODE HERE ----------------
     }
 
     return Iout;
@@ -425,25 +591,32 @@ vec3 Scene::pixelColour(int x, int y)
     // subpixels if 'jitter' is true.
 
     // ---------------- START YOUR CODE HERE ----------------
-    float total = 0.0;
-    vec3 totalColor = vec3(0, 0, 0);
-    float xOffset, yOffset;
-    for (int row = 0; row < numPixelSamples; row++) {
-        for (int col = 0; col < numPixelSamples; col++) {
-            if (jitter == false) {
-                xOffset = (col + 0.5f) / numPixelSamples;
-                yOffset = (row + 0.5f) / numPixelSamples;
-            } else {
-                xOffset = (col + 0.5f + randIn01()) / numPixelSamples;
-                yOffset = (row + 0.5f + randIn01()) / numPixelSamples;
-            }
+    if (edgeAntialiasing) {
+        // Sample the corners, and subdivide where they differ
+
+        int gridSize = edgeGridSize();
+
+        PixelSample corners[4];
+        vec3 cornerColours[4];
+        SampleHit cornerHits[4];
+
+        for (int i = 0; i < 4; i++) corners[i] = edgeSample((x + i % 2) * gridSize, (y + i / 2) * gridSize, gridSize);
 
-            vec3 dir = (llCorner + (x + xOffset) * right + (y + yOffset) * up).normalize();
-            totalColor = totalColor + raytrace(eye->position, dir, 0, -1, -1);
+        traceSamples(corners, 4, cornerColours, cornerHits);
+
+        result = edgeCellColour(x * gridSize, y * gridSize, gridSize, gridSize, cornerColours, cornerHits);
+
+    } else {
+        vec3 totalColor = vec3(0, 0, 0);
+        int numSamples = numPixelSamples * numPixelSamples;
+
+        for (int i = 0; i < numSamples; i++) {  // row by row of subpixels
+            PixelSample sample = pixelSample(x, y, i, numSamples);
+            totalColor = totalColor + sampleColour(sample);
         }
-    }
 
-    result = 1.0f / (numPixelSamples * numPixelSamples) * totalColor;
+        result = 1.0f / (numPixelSamples * numPixelSamples) * totalColor;
+    }
 
     // ---------------- END YOUR CODE HERE ----------------
 
@@ -451,6 +624,9 @@ vec3 Scene::pixelColour(int x, int y)
 
     if (storingRays) storingRays = false;
 
+    numRaysTraced += threadRayCount;  // one atomic update per pixel, not per ray
+    threadRayCount = 0;
+
     if (debug) {
         cout << "---------------- stop debugging ----------------" << endl;
         debug = false;
@@ -459,6 +635,437 @@ vec3 Scene::pixelColour(int x, int y)
     return result;
 }
 
+// Determine the colours of an nx x ny block of pixels, with lower-left
+// pixel (x0,y0) and 'step' window pixels between neighbouring pixels.
+// colours[i + j*nx] is the colour of pixel (x0 + i*step, y0 + j*step).
+//
+// The same rays as pixelColour() are traced, but through
+// traceSamples(), so that they can be traced in packets.
+
+void Scene::blockColours(int x0, int y0, int nx, int ny, int step, vec3 *colours)
+
+{
+    // Use pixelColour() when debugging a pixel in this block
+
+    bool debugPixelInBlock = (debugPixel.x >= x0 && debugPixel.x < x0 + nx * step && debugPixel.y >= y0 &&
+                              debugPixel.y < y0 + ny * step);
+
+    if (debugPixelInBlock) {
+        for (int j = 0; j < ny; j++)
+            for (int i = 0; i < nx; i++) colours[i + j * nx] = pixelColour(x0 + i * step, y0 + j * step);
+        return;
+    }
+
+    if (edgeAntialiasing) {
+        edgeBlockColours(x0, y0, nx, ny, step, colours);
+        return;
+    }
+
+    // Generate the samples in the same order as pixelColour(): pixel
+    // by pixel and, within each pixel, row by row of subpixels.  Sum
+    // each sample's colour into its pixel.
+
+    int numSamples = numPixelSamples * numPixelSamples;
+    int total = nx * ny * numSamples;
+
+    for (int i = 0; i < nx * ny; i++) colours[i] = vec3(0, 0, 0);
+
+    PixelSample samples[PACKET_SIZE];
+    int pixelOfSample[PACKET_SIZE];
+    vec3 sampleColours[PACKET_SIZE];
+    int n = 0;
+
+    for (int k = 0; k < total; k++) {
+        int pixel = k / numSamples;
+
+        pixelOfSample[n] = pixel;
+        samples[n] = pixelSample(x0 + (pixel % nx) * step, y0 + (pixel / nx) * step, k % numSamples, numSamples);
+        n++;
+
+        if (n == PACKET_SIZE || k == total - 1) {
+            traceSamples(samples, n, sampleColours);
+            for (int r = 0; r < n; r++) colours[pixelOfSample[r]] = colours[pixelOfSample[r]] + sampleColours[r];
+            n = 0;
+        }
+    }
+
+    for (int i = 0; i < nx * ny; i++) colours[i] = 1.0f / (numPixelSamples * numPixelSamples) * colours[i];
+}
+
+// Sample 'index' of the 'numSamples' samples of pixel (x,y).  This is
+// at the centre of a cell of a regular grid, or at a jittered point if
+// 'jitter' is true.
+
+PixelSample Scene::pixelSample(int x, int y, int index, int numSamples)
+
+{
+    PixelSample s;
+
+    s.x = x;
+    s.y = y;
+    s.index = index;
+
+    if (jitter == false) {
+        int n = (int)ceil(sqrt((float)numSamples));
+        s.xOffset = (index % n + 0.5f) / n;
+        s.yOffset = (index / n + 0.5f) / n;
+    } else
+        Sampler::pixelOffset(x, y, index, numSamples, s.xOffset, s.yOffset);
+
+    return s;
+}
+
+// Trace one ray for each of 'n' pixel samples and return their
+// colours.
+//
+// The primary rays are traced in packets of PACKET_SIZE rays, as are
+// the shadow rays from their intersections toward each point light.
+// The reflected, glossy, and soft shadow rays below the primary hits
+// are traced singly.  Single rays are used throughout when storing
+// rays to be drawn.
+
+#define MAX_PACKET_LIGHTS 32  // bits in the lightsVisible mask passed to shade()
+
+void Scene::traceSamples(PixelSample *samples, int n, vec3 *colours, SampleHit *hits)
+
+{
+    if (!usePackets || storingRays || maxDepth < 1 || lights.size() > MAX_PACKET_LIGHTS) {
+        for (int i = 0; i < n; i++) colours[i] = sampleColour(samples[i], (hits != NULL ? &hits[i] : NULL));
+
+    } else {
+        RayPacket packet;
+
+        for (int i = 0; i < n; i++) {
+            packet.add(eye->position, sampleDir(samples[i]), MAXFLOAT, -1, -1);
+
+            if (packet.numRays == PACKET_SIZE || i == n - 1) {
+                int first = i + 1 - packet.numRays;
+                tracePrimaryPacket(packet, &samples[first], &colours[first], (hits != NULL ? &hits[first] : NULL));
+                packet.clear();
+            }
+        }
+    }
+
+    numRaysTraced += threadRayCount;  // one atomic update per call, not per ray
+    threadRayCount = 0;
+}
+
+// Direction of the primary ray of a pixel sample
+
+vec3 Scene::sampleDir(PixelSample &s)
+
+{
+    return (llCorner + (s.x + s.xOffset) * right + (s.y + s.yOffset) * up).normalize();
+}
+
+// Trace a single pixel sample
+
+vec3 Scene::sampleColour(PixelSample &s, SampleHit *hit)
+
+{
+    sampler.start(s.x, s.y, s.index);
+
+    vec3 dir = sampleDir(s);
+
+    return raytrace(eye->position, dir, 0, -1, -1, hit);
+}
+
+// Find the AOVs of pixel (x,y) for the denoiser: the albedo, normal,
+// and distance of the first surface hit by the ray through the
+// pixel's centre.  With no hit, the albedo is 1 and the normal and
+// distance are 0.
+
+void Scene::pixelAOVs(int x, int y, vec3 &albedo, vec3 &normal, float &depth)
+
+{
+    PixelSample s;
+
+    s.x = x;
+    s.y = y;
+    s.index = 0;
+    s.xOffset = 0.5;
+    s.yOffset = 0.5;
+
+    vec3 dir = sampleDir(s);
+
+    albedo = vec3(1, 1, 1);
+    normal = vec3(0, 0, 0);
+    depth = 0;
+
+    HitRecord hitRec;
+
+    if (findFirstObjectInt(eye->position, dir, -1, -1, hitRec, -1)) {
+        vec3 P, texcoords;
+        Material *mat;
+
+        objects[hitRec.objIndex]->hitInfo(eye->position, dir, hitRec, P, normal, texcoords, mat);
+
+        float alpha;
+        vec3 colour = objects[hitRec.objIndex]->textureColour(P, hitRec.partIndex, alpha, texcoords);
+
+        albedo = vec3(colour.x * mat->kd.x, colour.y * mat->kd.y, colour.z * mat->kd.z);
+        depth = hitRec.t;  // 'dir' is unit length
+    }
+
+    numRaysTraced += threadRayCount;
+    threadRayCount = 0;
+}
+
+// Edge-adaptive antialiasing
+//
+// Rays are traced through the corners of each pixel, and the pixel
+// gets the average of its corners' colours if they all hit the same
+// object with similar normals and have similar colours.  Otherwise the
+// pixel is split into four, and each quarter is treated the same way,
+// down to cells of 1/edgeGridSize() of a pixel.  So edges get the
+// same number of rays as (numPixelSamples x numPixelSamples)
+// supersampling, while flat regions get about one ray per pixel, since
+// neighbouring pixels share corners.
+//
+// The points are on a grid of edgeGridSize() x edgeGridSize() cells
+// per pixel.  A point's grid coordinates (sx,sy) are in cells, so
+// pixel (x,y) spans [x,x+1] x [y,y+1] in window pixels and
+// [x*gridSize,(x+1)*gridSize] x [y*gridSize,(y+1)*gridSize] in cells.
+
+#define EDGE_COLOUR_TOLERANCE 0.05  // max difference in any colour channel
+#define EDGE_NORMAL_COS 0.95        // min cosine between normals
+
+// Finest subdivision: numPixelSamples rounded up to a power of two
+
+int Scene::edgeGridSize()
+
+{
+    int gridSize = 1;
+
+    while (gridSize < numPixelSamples) gridSize *= 2;
+
+    return gridSize;
+}
+
+// The sample at grid point (sx,sy).  Its pixel and index depend only
+// on the point, so a point that is shared by neighbouring pixels or
+// cells gets the same sample (and the same colour) from each.
+
+PixelSample Scene::edgeSample(int sx, int sy, int gridSize)
+
+{
+    PixelSample s;
+
+    s.x = sx / gridSize;
+    s.y = sy / gridSize;
+    s.xOffset = (sx % gridSize) / (float)gridSize;
+    s.yOffset = (sy % gridSize) / (float)gridSize;
+    s.index = (sx % gridSize) + (sy % gridSize) * gridSize;
+
+    return s;
+}
+
+// Do the corners of a cell need no further subdivision?
+
+static bool cornersAgree(vec3 *colours, SampleHit *hits)
+
+{
+    for (int i = 1; i < 4; i++) {
+        if (hits[i].objIndex != hits[0].objIndex) return false;
+
+        if (hits[0].objIndex >= 0 && hits[i].normal * hits[0].normal < EDGE_NORMAL_COS) return false;
+
+        vec3 d = colours[i] - colours[0];
+
+        if (fabs(d.x) > EDGE_COLOUR_TOLERANCE || fabs(d.y) > EDGE_COLOUR_TOLERANCE || fabs(d.z) > EDGE_COLOUR_TOLERANCE)
+            return false;
+    }
+
+    return true;
+}
+
+// Colour of the cell with lower-left grid point (sx,sy) and width
+// 'size' cells, given the colours and hits at its corners (in the
+// order lower-left, lower-right, upper-left, upper-right)
+
+vec3 Scene::edgeCellColour(int sx, int sy, int size, int gridSize, vec3 *colours, SampleHit *hits)
+
+{
+    if (size == 1 || cornersAgree(colours, hits))
+        return 0.25 * (colours[0] + colours[1] + colours[2] + colours[3]);
+
+    // Trace the midpoints of the edges and the centre
+    //
+    //    2 -- 7 -- 3
+    //    |    |    |
+    //    5 -- 6 -- 8
+    //    |    |    |
+    //    0 -- 4 -- 1
+
+    int half = size / 2;
+
+    PixelSample samples[5];
+    vec3 c[9];
+    SampleHit h[9];
+
+    samples[0] = edgeSample(sx + half, sy, gridSize);
+    samples[1] = edgeSample(sx, sy + half, gridSize);
+    samples[2] = edgeSample(sx + half, sy + half, gridSize);
+    samples[3] = edgeSample(sx + half, sy + size, gridSize);
+    samples[4] = edgeSample(sx + size, sy + half, gridSize);
+
+    traceSamples(samples, 5, &c[4], &h[4]);
+
+    for (int i = 0; i < 4; i++) {
+        c[i] = colours[i];
+        h[i] = hits[i];
+    }
+
+    // Quarters, with corners in the same order as the cell's
+
+    static const int quarterCorners[4][4] = {{0, 4, 5, 6}, {4, 1, 6, 8}, {5, 6, 2, 7}, {6, 8, 7, 3}};
+
+    vec3 total = vec3(0, 0, 0);
+
+    for (int q = 0; q < 4; q++) {
+        vec3 qc[4];
+        SampleHit qh[4];
+
+        for (int i = 0; i < 4; i++) {
+            qc[i] = c[quarterCorners[q][i]];
+            qh[i] = h[quarterCorners[q][i]];
+        }
+
+        total = total + edgeCellColour(sx + (q % 2) * half, sy + (q / 2) * half, half, gridSize, qc, qh);
+    }
+
+    return 0.25 * total;
+}
+
+// Colours of a block of pixels (as in blockColours()) with
+// edge-adaptive antialiasing.  The corner rays are traced together,
+// in packets.  With step == 1, neighbouring pixels share corners.
+
+void Scene::edgeBlockColours(int x0, int y0, int nx, int ny, int step, vec3 *colours)
+
+{
+    int gridSize = edgeGridSize();
+
+    // Columns and rows of corners
+
+    int numCols = (step == 1 ? nx + 1 : 2 * nx);
+    int numRows = (step == 1 ? ny + 1 : 2 * ny);
+
+    PixelSample *corners = new PixelSample[numCols * numRows];
+    vec3 *cornerColours = new vec3[numCols * numRows];
+    SampleHit *cornerHits = new SampleHit[numCols * numRows];
+
+    for (int j = 0; j < numRows; j++)
+        for (int i = 0; i < numCols; i++) {
+            int x = (step == 1 ? x0 + i : x0 + (i / 2) * step + i % 2);
+            int y = (step == 1 ? y0 + j : y0 + (j / 2) * step + j % 2);
+            corners[i + j * numCols] = edgeSample(x * gridSize, y * gridSize, gridSize);
+        }
+
+    for (int k = 0; k < numCols * numRows; k += PACKET_SIZE)
+        traceSamples(&corners[k], MIN(PACKET_SIZE, numCols * numRows - k), &cornerColours[k], &cornerHits[k]);
+
+    // Refine each pixel
+
+    for (int j = 0; j < ny; j++)
+        for (int i = 0; i < nx; i++) {
+            int col = (step == 1 ? i : 2 * i);
+            int row = (step == 1 ? j : 2 * j);
+
+            vec3 c[4];
+            SampleHit h[4];
+
+            for (int k = 0; k < 4; k++) {
+                int corner = (col + k % 2) + (row + k / 2) * numCols;
+                c[k] = cornerColours[corner];
+                h[k] = cornerHits[corner];
+            }
+
+            colours[i + j * nx] = edgeCellColour((x0 + i * step) * gridSize, (y0 + j * step) * gridSize, gridSize,
+                                                 gridSize, c, h);
+        }
+
+    delete[] corners;
+    delete[] cornerColours;
+    delete[] cornerHits;
+}
+
+// Trace a packet of primary rays and return the colour of each (and,
+// if 'hits' is not NULL, what each hit).  Ray r is for pixel sample
+// samples[r].
+//
+// This is raytrace() at depth 1, except that the closest hits are
+// found for the whole packet at once, and then the shadow rays toward
+// each point light are traced as one packet.
+
+void Scene::tracePrimaryPacket(RayPacket &packet, PixelSample *samples, vec3 *rayColours, SampleHit *hits)
+
+{
+    threadRayCount += packet.numRays;
+
+    objectBVH->rayIntPacket(packet);
+
+    // Evaluate the surface at each hit
+
+    vec3 P[PACKET_SIZE], N[PACKET_SIZE], texcoords[PACKET_SIZE];
+    Material *mat[PACKET_SIZE];
+    unsigned int lightsVisible[PACKET_SIZE];
+
+    for (int r = 0; r < packet.numRays; r++)
+        if (packet.found[r]) {
+            objects[packet.hit[r].objIndex]->hitInfo(packet.origin[r], packet.dir[r], packet.hit[r], P[r], N[r],
+                                                      texcoords[r], mat[r]);
+            lightsVisible[r] = 0;
+        }
+
+    // Shadow rays toward each point light.  These are made exactly as
+    // in shade(), so that they give the same result.
+
+    for (int i = 0; i < lights.size(); i++) {
+        RayPacket shadowPacket;
+        int rayOfShadow[PACKET_SIZE];
+
+        for (int r = 0; r < packet.numRays; r++)
+            if (packet.found[r]) {
+                vec3 L = lights[i]->position - P[r];
+
+                if (N[r] * L > 0) {
+                    float Ldist = L.length();
+                    L = (1.0 / Ldist) * L;
+
+                    rayOfShadow[shadowPacket.numRays] = r;
+                    shadowPacket.add(P[r], L, Ldist, packet.hit[r].objIndex, packet.hit[r].partIndex);
+                }
+            }
+
+        threadRayCount += shadowPacket.numRays;
+
+        objectBVH->occludedPacket(shadowPacket);
+
+        for (int k = 0; k < shadowPacket.numRays; k++)
+            if (!shadowPacket.found[k]) lightsVisible[rayOfShadow[k]] |= (1u << i);
+    }
+
+    // Shade
+
+    for (int r = 0; r < packet.numRays; r++)
+        if (packet.found[r]) {
+            sampler.start(samples[r].x, samples[r].y, samples[r].index);
+            rayColours[r] =
+                shade(packet.dir[r], 1, -1, packet.hit[r], P[r], N[r], texcoords[r], mat[r], &lightsVisible[r]);
+        } else
+            rayColours[r] = backgroundColour;
+
+    if (hits != NULL)
+        for (int r = 0; r < packet.numRays; r++) {
+            hits[r].objIndex = (packet.found[r] ? packet.hit[r].objIndex : -1);
+            if (packet.found[r]) {
+                hits[r].partIndex = packet.hit[r].partIndex;
+                hits[r].normal = N[r];
+            }
+        }
+}
+
 // Read the scene from an input stream
 
 void Scene::read(const char *basename, istream &in)
@@ -513,8 +1120,10 @@ void Scene::read(const char *basename, istream &in)
             eye = new Eye();
             in >> *eye;
 
-            win->arcball->setV(eye->position, eye->lookAt, eye->upDir);
-            win->fovy = eye->fovy;
+            if (win != NULL) {  // no window in batch mode
+                win->arcball->setV(eye->position, eye->lookAt, eye->upDir);
+                win->fovy = eye->fovy;
+            }
 
         } else {
             cerr << "Command '" << command << "' not recognized" << endl;
@@ -526,6 +1135,81 @@ void Scene::read(const char *basename, istream &in)
         cerr << "No lights were provided in " << basename << " so the scene would be black." << endl;
         exit(1);
     }
+
+    // Build the object BVH
+
+    if (objectBVH != NULL) delete objectBVH;
+
+    objectBVH = new ObjectBVH(objects);
+
+    findEmitters();
+}
+
+// Collect the emitting triangles of all objects into 'emitters' and
+// build the table from which they are sampled
+
+void Scene::findEmitters()
+
+{
+    emitters.clear();
+    objectFirstEmitter.clear();
+    objectNumEmitters.clear();
+
+    for (int i = 0; i < objects.size(); i++) {
+        objectFirstEmitter.add(emitters.size());
+
+        if (Triangle *tri = dynamic_cast<Triangle *>(objects[i])) {
+            if (tri->mat->Ie.squaredLength() > 0)
+                emitters.add(Emitter(tri->verts[0].position, tri->verts[1].position, tri->verts[2].position,
+                                     tri->mat->Ie, i, -1));
+
+        } else if (WavefrontObj *wfObj = dynamic_cast<WavefrontObj *>(objects[i])) {
+            BVH &bvh = wfObj->bvh;
+            seq<vec3> &verts = *bvh.vertices;
+
+            for (int j = 0; j < bvh.triangles.size(); j++) {  // in order of j, for findEmitter()
+                BVH_triangle &tri = bvh.triangles[j];
+                vec3 &Ie = bvh.materials[tri.materialID]->Ie;
+                if (Ie.squaredLength() > 0)
+                    emitters.add(Emitter(verts[tri.v0], verts[tri.v1], verts[tri.v2], Ie, i, j));
+            }
+        }
+
+        objectNumEmitters.add(emitters.size() - objectFirstEmitter[i]);
+    }
+
+    emitterTable.build(emitters);
+}
+
+// Index in 'emitters' of part 'partIndex' of object 'objIndex', or -1
+// if it does not emit light
+
+int Scene::findEmitter(int objIndex, int partIndex)
+
+{
+    int first = objectFirstEmitter[objIndex];
+    int n = objectNumEmitters[objIndex];
+
+    if (n == 0) return -1;
+
+    if (emitters[first].partIndex < 0)  // a scene triangle
+        return first;
+
+    // Binary search of the object's emitters, which are in order of partIndex
+
+    int lo = first, hi = first + n - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (emitters[mid].partIndex == partIndex)
+            return mid;
+        else if (emitters[mid].partIndex < partIndex)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
 }
 
 // Output the whole scene (mainly for debugging the reader)
@@ -547,6 +1231,12 @@ char *Scene::statusMessage()
 {
     static char buffer[1000];
 
+    if (accumBuffer != NULL) {
+        sprintf(buffer, "adaptive pass %d (%d pixels active, max %d rays per pixel), %d sample rays",
+                adaptivePass + 1, accumBuffer->numActive(), adaptiveMaxSamples, (int)numRaySamples);
+        return buffer;
+    }
+
     if (lastGlossiness > 0)
         sprintf(buffer, "%dx%d pixel rays, %d sample rays, glossiness %.6g%s", numPixelSamples, numPixelSamples,
                 (int)numRaySamples, lastGlossiness, (jitter ? ", jitter" : ""));
@@ -557,21 +1247,35 @@ char *Scene::statusMessage()
     return buffer;
 }
 
-// Draw the scene.  This sets things up and simply
-// calls pixelColour() for each pixel.
+// Draw the scene.  This sets things up and hands the image to the
+// render engine, whose worker threads call blockColours() for each
+// block of pixels.  With progressivePreview, the engine first traces
+// preview passes with one ray per PREVIEW_STEP x PREVIEW_STEP pixels,
+// then per half that, and so on, so that something is shown right
+// after the viewpoint changes.  After that, each call only checks
+// the engine's progress and redraws the window when enough new tiles
+// are done.  The main loop sleeps in between, for at most
+// DISPLAY_INTERVAL, or until the engine wakes it.
 
 void Scene::renderRT(bool restart)
 
 {
-    static int nextx, nexty;
     static float lastDisplayTime = 0;
+    static int lastTilesDone = 0;
 
     mat4 WCS_to_VCS = win->arcball->V;
 
     mat4 VCS_to_CCS = perspective(win->fovy, windowWidth / (float)windowHeight, 1, 1000);
 
+    if (renderEngine == NULL) {
+        renderEngine = new RenderEngine(numThreads);
+        renderEngine->setWakeup(glfwPostEmptyEvent);  // wake the main loop when a render or pass is done
+    }
+
     if (restart) {
-        srand(754376105);
+        // Stop the workers before the camera and image change under them
+
+        renderEngine->cancel();
 
         // Copy the window eye into the scene eye
 
@@ -580,68 +1284,315 @@ void Scene::renderRT(bool restart)
         eye->upDir = win->arcball->upDirection();
         eye->fovy = win->fovy;
 
-        vec3 rightDir = ((eye->lookAt - eye->position) ^ eye->upDir).normalize();
-
-        // Compute the image plane coordinate system
-
-        up = (2.0 * tan(eye->fovy / 2.0)) * eye->upDir.normalize();
-
-        right = (2.0 * tan(eye->fovy / 2.0) * windowWidth / (float)windowHeight) * rightDir.normalize();
-
-        llCorner = (eye->lookAt - eye->position).normalize() - 0.5 * up - 0.5 * right;
-
-        up = (1.0 / (float)(windowHeight - 1)) * up;
-        right = (1.0 / (float)(windowWidth - 1)) * right;
-
-        nextx = 0;
-        nexty = 0;
+        setupCamera(windowWidth, windowHeight);
 
         stop = false;
+        numRaysTraced = 0;
 
         // Clear the RT image
 
         if (rtImage != NULL) delete[] rtImage;
 
         rtImage = NULL;
+
+        if (accumBuffer != NULL) delete accumBuffer;
+
+        accumBuffer = NULL;
+
+        if (denoiser != NULL) delete denoiser;
+
+        denoiser = NULL;
     }
 
-    // Set up a new RT image
+    // Set up a new RT image and start tracing it
 
     if (rtImage == NULL) {
-        rtImage = new vec4[(int)(windowWidth / pixelScale * windowHeight / pixelScale)];
-        for (int i = 0; i < windowWidth / pixelScale * windowHeight / pixelScale; i++)
-            rtImage[i] = vec4(0, 0, 0, 0);  // transparent
+        rtWidth = windowWidth / pixelScale;
+        rtHeight = windowHeight / pixelScale;
+
+        rtImage = new vec4[rtWidth * rtHeight];
+        for (int i = 0; i < rtWidth * rtHeight; i++) rtImage[i] = vec4(0, 0, 0, 0);  // transparent
+        rtImageChanged = true;
+
+        // In adaptive mode, each pass adds a sample to the pixels that
+        // have not yet converged
+
+        if (adaptiveMaxSamples > 0)
+            accumBuffer =
+                new AccumBuffer(rtWidth, rtHeight, ADAPTIVE_MIN_SAMPLES, adaptiveMaxSamples, adaptiveThreshold);
+
+        adaptivePass = 0;
+
+        if (denoise) denoiser = new Denoiser(rtWidth, rtHeight);
+
+        // Start with a coarse preview, if enabled.  Otherwise start
+        // the full image.
+
+        if (progressivePreview) {
+            previewStep = PREVIEW_STEP;
+            renderEngine->startPreview(this, rtImage, rtWidth, rtHeight, pixelScale, previewStep, false);
+        } else {
+            previewStep = 0;
+            renderEngine->start(this, rtImage, rtWidth, rtHeight, pixelScale, accumBuffer, denoiser);
+        }
+
+        lastTilesDone = 0;
     }
 
     if (stop) return;
 
-    // Draw the next pixel
+    // Check on the workers
 
-    vec3 colour = pixelColour((nextx + 0.5) * pixelScale, (nexty + 0.5) * pixelScale);
+    if (renderEngine->isDone() && previewStep > 1) {  // refine the preview
+        draw_RT_and_GL(WCS_to_VCS, VCS_to_CCS);
+        previewStep /= 2;
 
-    rtImage[nextx + nexty * (int)(windowWidth / pixelScale)] = vec4(colour.x, colour.y, colour.z, 1);  // opaque
+        // The last preview pass finishes the image if the image has
+        // one ray per pixel.  Otherwise the full image is traced next.
 
-    // Move (nextx,nexty) to the next pixel
+        bool singleSample = (numPixelSamples == 1 && !edgeAntialiasing && accumBuffer == NULL);
 
-    nexty++;
-    if (nexty >= windowHeight / pixelScale) {
-        nexty = 0;
-        nextx++;
+        if (previewStep > 1 || singleSample)
+            renderEngine->startPreview(this, rtImage, rtWidth, rtHeight, pixelScale, previewStep, true, denoiser);
+        else {
+            previewStep = 0;
+            renderEngine->start(this, rtImage, rtWidth, rtHeight, pixelScale, accumBuffer, denoiser);
+        }
 
-        if (nextx >= windowWidth / pixelScale) {  // finished
-            draw_RT_and_GL(WCS_to_VCS, VCS_to_CCS);
-            nextx = 0;
-            stop = true;
-            cout << "\r           \r";
-            cout.flush();
+        lastTilesDone = 0;
+
+    } else if (renderEngine->isDone() && accumBuffer != NULL && accumBuffer->numActive() > 0) {  // start the next pass
+        draw_RT_and_GL(WCS_to_VCS, VCS_to_CCS);
+        adaptivePass++;
+        renderEngine->start(this, rtImage, rtWidth, rtHeight, pixelScale, accumBuffer);
+        lastTilesDone = 0;
+    } else if (renderEngine->isDone()) {  // finished
+        if (denoiser != NULL) {
+            denoiser->denoise(rtImage, renderEngine->threadPool());
+            rtImageChanged = true;
         }
+        draw_RT_and_GL(WCS_to_VCS, VCS_to_CCS);
+        stop = true;
+        cout << "\r           \r";
+        cout.flush();
     } else {
         float thisTime = getTime();
-        if (thisTime > lastDisplayTime + DISPLAY_INTERVAL) {
+        int tilesDone = renderEngine->numTilesDone();
+        if (thisTime > lastDisplayTime + DISPLAY_INTERVAL && tilesDone != lastTilesDone) {
             draw_RT_and_GL(WCS_to_VCS, VCS_to_CCS);
             lastDisplayTime = thisTime;
+            lastTilesDone = tilesDone;
+        }
+    }
+}
+
+// Compute the image plane coordinate system for the current eye and
+// an image of width x height pixels.
+
+void Scene::setupCamera(int width, int height)
+
+{
+    vec3 rightDir = ((eye->lookAt - eye->position) ^ eye->upDir).normalize();
+
+    up = (2.0 * tan(eye->fovy / 2.0)) * eye->upDir.normalize();
+
+    right = (2.0 * tan(eye->fovy / 2.0) * width / (float)height) * rightDir.normalize();
+
+    llCorner = (eye->lookAt - eye->position).normalize() - 0.5 * up - 0.5 * right;
+
+    up = (1.0 / (float)(height - 1)) * up;
+    right = (1.0 / (float)(width - 1)) * right;
+}
+
+// Raytrace the whole image from the scene's eye without a window
+// (and without OpenGL).  This blocks until the image is done, then
+// reports the time taken and the ray throughput.
+
+void Scene::renderBatch(int width, int height)
+
+{
+    if (eye == NULL) {
+        cerr << "No eye was provided in the scene, so there is no view to render." << endl;
+        exit(1);
+    }
+
+    if (renderEngine == NULL) renderEngine = new RenderEngine(numThreads);
+
+    setupCamera(width, height);
+
+    pixelScale = 1;
+    rtWidth = width;
+    rtHeight = height;
+
+    if (rtImage != NULL) delete[] rtImage;
+    rtImage = new vec4[rtWidth * rtHeight];
+
+    numRaysTraced = 0;
+
+    float startTime = getTime();
+
+    if (accumBuffer != NULL) delete accumBuffer;
+
+    accumBuffer = NULL;
+
+    if (denoiser != NULL) delete denoiser;
+
+    denoiser = (denoise ? new Denoiser(rtWidth, rtHeight) : NULL);
+
+    if (adaptiveMaxSamples > 0) {
+        // Adaptive: run passes until every pixel has converged
+
+        accumBuffer = new AccumBuffer(rtWidth, rtHeight, ADAPTIVE_MIN_SAMPLES, adaptiveMaxSamples, adaptiveThreshold);
+
+        for (adaptivePass = 0; accumBuffer->numActive() > 0; adaptivePass++) {
+            renderEngine->start(this, rtImage, rtWidth, rtHeight, pixelScale, accumBuffer, denoiser);
+            renderEngine->wait();
+        }
+    } else {
+        renderEngine->start(this, rtImage, rtWidth, rtHeight, pixelScale, NULL, denoiser);
+        renderEngine->wait();
+    }
+
+    float elapsed = getTime() - startTime;
+
+    if (denoiser != NULL) denoiser->denoise(rtImage, renderEngine->threadPool());
+
+    float denoiseTime = getTime() - startTime - elapsed;
+
+    cout << "Rendered " << width << "x" << height << " with ";
+
+    if (accumBuffer != NULL)
+        cout << "adaptive pixel sampling (" << accumBuffer->totalSamples() / (float)(width * height)
+             << " rays per pixel on average, max " << adaptiveMaxSamples << ", " << adaptivePass << " passes)";
+    else
+        cout << numPixelSamples << "x" << numPixelSamples << " pixel rays";
+
+    cout << " and " << (int)numRaySamples << " sample rays on " << renderEngine->numThreads() << " threads in "
+         << elapsed << " seconds" << endl
+         << "  " << numRaysTraced << " rays, " << (elapsed > 0 ? numRaysTraced / elapsed / 1.0e6 : 0)
+         << " million rays/second" << endl;
+
+    if (denoiser != NULL) cout << "  denoised in " << denoiseTime << " seconds" << endl;
+
+    stop = true;
+}
+
+// Write the raytraced image to a PPM file (8 bits per channel,
+// clamped to [0,1]) or, if the filename ends in ".pfm", to a PFM file
+// (32-bit floats, unclamped).
+
+void Scene::writeImage(const char *filename)
+
+{
+    if (rtImage == NULL) {
+        cerr << "No raytraced image to write to " << filename << endl;
+        return;
+    }
+
+    writeImage(filename, rtImage);
+}
+
+// Write an rtWidth x rtHeight image
+
+void Scene::writeImage(const char *filename, vec4 *image)
+
+{
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        cerr << "Could not open " << filename << " for writing." << endl;
+        exit(1);
+    }
+
+    const char *ext = strrchr(filename, '.');
+
+    if (ext != NULL && strcmp(ext, ".pfm") == 0) {
+        // PFM stores rows bottom-to-top, as does the image.  A negative
+        // scale indicates little-endian floats.
+
+        unsigned int endianTest = 1;
+        bool littleEndian = (*(unsigned char *)&endianTest == 1);
+
+        fprintf(out, "PF\n%d %d\n%s\n", rtWidth, rtHeight, (littleEndian ? "-1.0" : "1.0"));
+
+        float *row = new float[3 * rtWidth];
+        for (int y = 0; y < rtHeight; y++) {
+            for (int x = 0; x < rtWidth; x++) {
+                vec4 &c = image[x + y * rtWidth];
+                row[3 * x + 0] = c.x;
+                row[3 * x + 1] = c.y;
+                row[3 * x + 2] = c.z;
+            }
+            fwrite(row, sizeof(float), 3 * rtWidth, out);
+        }
+        delete[] row;
+
+    } else {
+        // PPM stores rows top-to-bottom
+
+        fprintf(out, "P6\n%d %d\n255\n", rtWidth, rtHeight);
+
+        unsigned char *row = new unsigned char[3 * rtWidth];
+        for (int y = rtHeight - 1; y >= 0; y--) {
+            for (int x = 0; x < rtWidth; x++) {
+                vec4 &c = image[x + y * rtWidth];
+                row[3 * x + 0] = (unsigned char)(255 * MIN(1, MAX(0, c.x)) + 0.5);
+                row[3 * x + 1] = (unsigned char)(255 * MIN(1, MAX(0, c.y)) + 0.5);
+                row[3 * x + 2] = (unsigned char)(255 * MIN(1, MAX(0, c.z)) + 0.5);
+            }
+            fwrite(row, 1, 3 * rtWidth, out);
         }
+        delete[] row;
+    }
+
+    fclose(out);
+}
+
+// Write the denoiser's AOVs next to the image in 'filename': for
+// "image.ppm", to "image_albedo.ppm", "image_normal.ppm", and
+// "image_depth.ppm".
+
+void Scene::writeAOVs(const char *filename)
+
+{
+    if (denoiser == NULL) {
+        cerr << "No AOVs to write (they are recorded only when denoising)" << endl;
+        return;
     }
+
+    const char *ext = strrchr(filename, '.');
+    int baseLength = (ext != NULL ? ext - filename : strlen(filename));
+
+    const char *aovNames[3] = {"albedo", "normal", "depth"};
+    AOV aovs[3] = {AOV_ALBEDO, AOV_NORMAL, AOV_DEPTH};
+
+    vec4 *image = new vec4[rtWidth * rtHeight];
+    char *aovFilename = new char[strlen(filename) + 10];
+
+    for (int i = 0; i < 3; i++) {
+        sprintf(aovFilename, "%.*s_%s%s", baseLength, filename, aovNames[i], (ext != NULL ? ext : ""));
+        denoiser->aovImage(aovs[i], image);
+        writeImage(aovFilename, image);
+    }
+
+    delete[] image;
+    delete[] aovFilename;
+}
+
+// Stop raytracing (e.g. before tracing a single pixel from the GL
+// thread).  resumeRT() continues the render afterwards.
+
+void Scene::cancelRT()
+
+{
+    if (renderEngine != NULL) renderEngine->cancel();
+}
+
+// Continue the render that cancelRT() stopped
+
+void Scene::resumeRT()
+
+{
+    if (renderEngine != NULL) renderEngine->resume();
 }
 
 // Render the scene with OpenGL
@@ -658,6 +1609,11 @@ void Scene::renderGL(mat4 &WCS_to_VCS, mat4 &VCS_to_CCS)
 
     if (segs == NULL) segs = new Segs();
 
+    if (wavefrontGPU == NULL) {
+        wavefrontGPU = new GPUProgram();
+        wavefrontGPU->init(wavefrontVertexShader, wavefrontFragmentShader, "in Scene::renderGL()");
+    }
+
     vec3 lightDir = vec3(1, 1, 1).normalize();
 
     // Set up the framebuffer
@@ -810,6 +1766,19 @@ void Scene::draw_RT_and_GL(mat4 &WCS_to_VCS, mat4 &VCS_to_CCS)
     glfwSwapBuffers(win->window);
 }
 
+// Convert pixels [x0,x1) x [y0,y1) of rtImage to 8-bit RGBA, row by
+// row, for display
+
+void Scene::displayPixels(int x0, int y0, int x1, int y1, unsigned char *pixels)
+
+{
+    for (int y = y0; y < y1; y++)
+        for (int x = x0; x < x1; x++) {
+            vec4 &c = rtImage[x + y * rtWidth];
+            for (int i = 0; i < 4; i++) *pixels++ = (unsigned char)(255 * MAX(0, MIN(1, c[i])) + 0.5);
+        }
+}
+
 void Scene::drawRTImage()
 
 {
@@ -820,7 +1789,10 @@ void Scene::drawRTImage()
         gpu->init(rtTextureVertShader, rtTextureFragShader, "in Scene::drawRTImage");
     }
 
-    // Send texture to GPU
+    // Send texture to GPU.  The texture has 8 bits per channel, which
+    // is all the display shows.  Only the tiles that the render engine
+    // finished since the last redraw are uploaded, unless the whole
+    // image has changed.
 
     if (rtImageTexID == 0) glGenTextures(1, &rtImageTexID);
 
@@ -830,8 +1802,24 @@ void Scene::drawRTImage()
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, windowWidth / pixelScale, windowHeight / pixelScale, 0, GL_RGBA, GL_FLOAT,
-                 rtImage);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    if (renderEngine != NULL) renderEngine->takeFinishedTiles(dirtyTiles);
+
+    if (rtImageChanged) {
+        unsigned char *pixels = new unsigned char[rtWidth * rtHeight * 4];
+        displayPixels(0, 0, rtWidth, rtHeight, pixels);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, rtWidth, rtHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        delete[] pixels;
+        rtImageChanged = false;
+    } else {
+        unsigned char pixels[TILE_SIZE * TILE_SIZE * 4];
+        for (int i = 0; i < dirtyTiles.size(); i++) {
+            RenderTile &t = dirtyTiles[i];
+            displayPixels(t.x0, t.y0, t.x1, t.y1, pixels);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, t.x0, t.y0, t.x1 - t.x0, t.y1 - t.y0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        }
+    }
 
     // Draw texture on a full-screen quad
 
@@ -19,13 +19,33 @@ class RTwindow;
 #include "axes.h"
 #include "drawSegs.h"
 #include "arrow.h"
+#include "renderEngine.h"
+#include "objectBVH.h"
+#include "rayPacket.h"
+#include "sampler.h"
+#include "accumBuffer.h"
+#include "denoiser.h"
+#include "emitter.h"
 
 
 #define PIXEL_SCALE 2           // initial size of raytraced pixel (for multi-res rendering.  Must be power of two.)
 #define DISPLAY_INTERVAL 0.5    // time (in seconds) between updates of raytracing in the window
+#define PREVIEW_STEP 16         // first preview pass traces one ray per PREVIEW_STEP x PREVIEW_STEP pixels (a power of two, at most TILE_SIZE)
 #define TEXT_SIZE 0.05          // size of text in [-1,1]x[-1,1] coordinate system
 
 
+// What a primary ray hits, for deciding where to antialias (also
+// what a glossy ray hits, for multiple importance sampling)
+
+class SampleHit {
+ public:
+  int   objIndex;		// -1 for no object
+  int   partIndex;
+  vec3  normal;
+  float survival;		// probability that the ray survived Russian roulette
+};
+
+
 class Scene {
 
   RTwindow *    win;		// rendering window
@@ -33,6 +53,7 @@ class Scene {
   Eye *         eye;		// viewpoint
   seq<Light *>  lights;		// all lights
   seq<Object *> objects;	// all objects
+  ObjectBVH *   objectBVH;	// BVH over all objects (built after reading the scene)
 
   vec3        Ia;		// ambient illumination
 
@@ -47,12 +68,29 @@ class Scene {
 
   GLuint rtImageTexID;
   vec4 *rtImage;		// texture storing the raytraced image
+  int rtWidth, rtHeight;	// dimensions of rtImage (in raytraced pixels)
+  bool rtImageChanged;		// all of rtImage must be sent to the texture (otherwise only the tiles finished since the last redraw)
+  seq<RenderTile> dirtyTiles;	// tiles of rtImage sent to the texture on the last redraw
   static const char *rtTextureVertShader, *rtTextureFragShader;
   GPUProgram *gpu;
   GPUProgram *wavefrontGPU;
 
   int pixelScale;             // size (in window pixels) of one raytraced pixel
 
+  RenderEngine *renderEngine; // worker threads that trace rtImage
+  AccumBuffer  *accumBuffer;  // samples of rtImage so far, in adaptive mode
+  int           adaptivePass; // number of passes over accumBuffer so far
+  int           previewStep;  // step of the preview pass being traced (or 0 if tracing the full image)
+  Denoiser     *denoiser;     // AOVs of rtImage, if denoising
+
+  seq<Emitter>  emitters;           // all emitting triangles
+  EmitterTable  emitterTable;       // for choosing emitters in proportion to their power
+  seq<int>      objectFirstEmitter; // index in 'emitters' of each object's first emitting triangle
+  seq<int>      objectNumEmitters;  // number of emitting triangles of each object
+
+  void findEmitters();
+  int  findEmitter( int objIndex, int partIndex );
+
  public:
 
   vec2 mouse;
@@ -74,8 +112,16 @@ class Scene {
   bool showBVH;
   bool showObjects;
   bool jitter;
-  bool russianRoulette;
+  bool usePackets;		// trace primary and point light shadow rays in packets
+  bool edgeAntialiasing;	// subdivide pixels only at edges (up to numPixelSamples x numPixelSamples)
+  int adaptiveMaxSamples;	// max samples per pixel in adaptive mode (0 = not adaptive)
+  float adaptiveThreshold;	// a pixel is done when its relative error is below this
+  bool denoise;			// filter rtImage with the AOV-guided denoiser when it is done
+  bool russianRoulette;		// terminate deep rays of low throughput at random
+  bool pathTracing;		// trace one glossy reflection ray per bounce (instead of numRaySamples)
+  bool progressivePreview;	// show coarse previews before the full image (in the window)
   int numPixelSamples;
+  int numThreads;		// number of raytracing threads (0 = one per core)
   float numRaySamples;
   int bvhDisplayDepth;
   bool debug;
@@ -85,15 +131,22 @@ class Scene {
 
   float sceneScale; // max dimension of scene's bounding box (used to scale the debbugging arrows)
 
+  std::atomic<long long> numRaysTraced; // since the last restart (for rays/second)
+
 
   Segs *segs; 		// draw some verts
 
   Scene() {
 
-    wavefrontGPU = new GPUProgram();
-    wavefrontGPU->init( wavefrontVertexShader, wavefrontFragmentShader, "in Scene() constructor" );
+    // No OpenGL here, so that a Scene can be built without a window
+    // (e.g. for batch rendering).  The GPU programs are created in
+    // renderGL().
 
-    segs = new Segs();
+    wavefrontGPU = NULL;
+    segs = NULL;
+    win = NULL;
+    eye = NULL;
+    objectBVH = NULL;
 
     Ia = vec3(0.1,0.1,0.1);
     maxDepth = 4;
@@ -103,18 +156,35 @@ class Scene {
     showAxes = false;
     showObjects = true;
     rtImage = NULL;
+    rtWidth = 0;
+    rtHeight = 0;
     rtImageTexID = 0;
+    rtImageChanged = false;
+    renderEngine = NULL;
+    numThreads = 0;
     gpu = NULL;
     axes = NULL;
     arrow = NULL;
     stop = false;
     jitter = false;
+    usePackets = true;
+    edgeAntialiasing = false;
+    accumBuffer = NULL;
+    adaptivePass = 0;
+    previewStep = 0;
+    adaptiveMaxSamples = 0;
+    adaptiveThreshold = 0.01;
+    denoiser = NULL;
+    denoise = false;
     russianRoulette = true;
+    pathTracing = false;
+    progressivePreview = true;
     numPixelSamples = 1;
     numRaySamples = 8.0;
     debug = false;
     debugPixel = vec2(-1,-1);
     sceneScale = 1;
+    numRaysTraced = 0;
     showBVH = false;
     bvhDisplayDepth = 2;
     buttonDown = -1;
@@ -128,17 +198,38 @@ class Scene {
   }
 
   void renderRT( bool restart );
+  void cancelRT();
+  void resumeRT();
+  void renderBatch( int width, int height );
+  void writeImage( const char *filename );
+  void writeImage( const char *filename, vec4 *image );
+  void writeAOVs( const char *filename );
+  void setupCamera( int width, int height );
   void renderGL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void draw_RT_and_GL( mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void showPixelZoom( vec2 mouse );
   void read( const char *basename, istream &in );
   void write( ostream &out );
   vec3 pixelColour( int x, int y );
-  vec3 raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex );
+  void blockColours( int x0, int y0, int nx, int ny, int step, vec3 *colours );
+  PixelSample pixelSample( int x, int y, int index, int numSamples );
+  void traceSamples( PixelSample *samples, int n, vec3 *colours, SampleHit *hits = NULL );
+  vec3 sampleDir( PixelSample &s );
+  vec3 sampleColour( PixelSample &s, SampleHit *hit = NULL );
+  void pixelAOVs( int x, int y, vec3 &albedo, vec3 &normal, float &depth );
+  void tracePrimaryPacket( RayPacket &packet, PixelSample *samples, vec3 *rayColours, SampleHit *hits = NULL );
+  int  edgeGridSize();
+  PixelSample edgeSample( int sx, int sy, int gridSize );
+  vec3 edgeCellColour( int sx, int sy, int size, int gridSize, vec3 *colours, SampleHit *hits );
+  void edgeBlockColours( int x0, int y0, int nx, int ny, int step, vec3 *colours );
+  vec3 raytrace( vec3 &rayStart, vec3 &rayDir, int depth, int thisObjIndex, int thisObjPartIndex, SampleHit *firstHit = NULL,
+		 float weight = 1 );
+  vec3 shade( vec3 &rayDir, int depth, int thisObjIndex, HitRecord &hitRec, vec3 &P, vec3 &N, vec3 &texcoords,
+	      Material *mat, unsigned int *lightsVisible, float weight = 1 );
   vec3 calcIout( vec3 N, vec3 L, vec3 E, vec3 R,
 		   vec3 Kd, vec3 Ks, float ns, vec3 In );
-  bool findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, 
-			   vec3 &P, vec3 &N, vec3 &T, float &param, int &objIndex, int &objPartIndex, Material *&mat, int lightIndex );
+  bool findFirstObjectInt( vec3 rayStart, vec3 rayDir, int thisObjIndex, int thisObjPartIndex, HitRecord &hitRec, int lightIndex );
+  bool occluded( vec3 rayStart, vec3 rayDir, float maxDist, int thisObjIndex, int thisObjPartIndex );
 
   void outputEye() { 
     cout << *eye << endl; 
@@ -147,6 +238,7 @@ class Scene {
   void display();
   void drawStoredRays( GPUProgram *gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS );
   void drawRTImage();
+  void displayPixels( int x0, int y0, int x1, int y1, unsigned char *pixels );
   char *statusMessage();
 
   static const char* wavefrontVertexShader;
@@ -188,11 +188,10 @@ void Sphere::setupVAO()
 
 // Ray / sphere intersection
 
-bool Sphere::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
-		     vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * &mat, int &intPartIndex )
+bool Sphere::rayInt( vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam, HitRecord &hit )
 
 {
-  float a,b,c,d,t0,t1;
+  float a,b,c,d,t0,t1,intParam;
 
   // Does it intersect? ... Solve a quadratic for
   // the parameter at the point of intersection
@@ -217,8 +216,21 @@ bool Sphere::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPara
   if (intParam > maxParam)
     return false; // too far away
 
+  hit.t = intParam;
+  hit.partIndex = -1;
+
+  return true;
+}
+
+
+void Sphere::hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit,
+		      vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, Material * &mat )
+
+{
   // Compute the point of intersection
 
+  float intParam = hit.t;
+
   intPoint = rayStart + intParam * rayDir;
 
   // Compute the normal at the intersection point
@@ -226,8 +238,31 @@ bool Sphere::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPara
   intNorm = (intPoint - centre).normalize();
 
   mat = this->mat;
+}
 
-  return true;
+
+// Is there an intersection with parameter in [0,maxParam)?
+
+bool Sphere::occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam )
+
+{
+  vec3 offset = rayStart - centre;
+
+  float a = rayDir * rayDir;
+  float b = 2 * (rayDir * offset);
+  float c = offset * offset - radius * radius;
+
+  float d = b*b - 4*a*c;
+
+  if (d < 0)
+    return false;
+
+  d = sqrt(d);
+
+  float t0 = (-b - d) / (2*a); // t0 <= t1
+  float t1 = (-b + d) / (2*a);
+
+  return (t0 >= 0 && t0 < maxParam) || (t1 >= 0 && t1 < maxParam);
 }
 
 
@@ -261,6 +296,9 @@ void Sphere::input( istream &stream )
 void Sphere::renderGL( GPUProgram *prog, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS, float s )
 
 {
+  if (VAO == 0)
+    setupVAO();
+
   mat->setMaterialForOpenGL( prog );
 
   mat4 MV  = WCS_to_VCS * translate( centre ) * scale( s, s, s );
@@ -35,6 +35,7 @@ class Sphere: public Object {
   public:
 
   Sphere() {
+    type = OBJ_SPHERE;
     centre = vec3(0,0,0);
     radius = 1;
     mat = new Material();
@@ -44,6 +45,7 @@ class Sphere: public Object {
   }
 
   Sphere( vec3 c, float r ) {
+    type = OBJ_SPHERE;
     centre = c;
     radius = r;
     mat = new Material();
@@ -75,17 +77,25 @@ class Sphere: public Object {
 
     //gpu.init( vertShader, fragShader, "in sphere.h" );
 
-    setupVAO();
+    VAO = 0; // VAO is set up on first renderGL(), so no OpenGL is needed to raytrace
   };
 
   ~Sphere() {}
 
-  bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
-	       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * & mat, int &intPartIndex );
+  bool rayInt( vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam, HitRecord &hit );
+
+  void hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit,
+		vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, Material * &mat );
+
+  bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam );
 
   void input( istream &stream );
   void output( ostream &stream ) const;
 
+  BBox bbox() {
+    return BBox( centre - vec3(radius,radius,radius), centre + vec3(radius,radius,radius) );
+  }
+
   vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords );
 
   void renderGL( GPUProgram *prog, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS, float scale );
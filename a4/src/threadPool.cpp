@@ -0,0 +1,139 @@
+// threadPool.cpp
+
+
+#include "threadPool.h"
+
+
+// Start 'numThreads' workers.  If 'numThreads' <= 0, start one per core.
+
+ThreadPool::ThreadPool( int numThreads )
+
+{
+  if (numThreads <= 0)
+    numThreads = numCores();
+
+  numWorkers   = numThreads;
+  numRunning   = 0;
+  shuttingDown = false;
+
+  workers = new std::thread[ numWorkers ];
+
+  for (int i=0; i<numWorkers; i++)
+    workers[i] = std::thread( [this]() { workerLoop(); } );
+}
+
+
+// Finish the queued jobs, then stop the workers
+
+ThreadPool::~ThreadPool()
+
+{
+  {
+    std::unique_lock<std::mutex> guard( lock );
+    shuttingDown = true;
+  }
+  jobAvailable.notify_all();
+
+  for (int i=0; i<numWorkers; i++)
+    workers[i].join();
+
+  delete [] workers;
+}
+
+
+void ThreadPool::submit( std::function<void()> job )
+
+{
+  {
+    std::unique_lock<std::mutex> guard( lock );
+    jobs.push_back( job );
+  }
+  jobAvailable.notify_one();
+  jobQueuedOrDone.notify_all();
+}
+
+
+// Block until the queue is empty and no job is running
+
+void ThreadPool::wait()
+
+{
+  std::unique_lock<std::mutex> guard( lock );
+
+  while (jobs.size() > 0 || numRunning > 0)
+    allJobsDone.wait( guard );
+}
+
+
+// Run queued jobs on the calling thread until 'done' returns true,
+// sleeping while there are none to run.  'done' is called with the
+// pool locked and should become true only when some job finishes.
+
+void ThreadPool::runJobsUntil( std::function<bool()> done )
+
+{
+  std::unique_lock<std::mutex> guard( lock );
+
+  while (!done()) {
+
+    if (jobs.size() == 0) {
+      jobQueuedOrDone.wait( guard );
+      continue;
+    }
+
+    std::function<void()> job = jobs.front();
+    jobs.pop_front();
+
+    runJob( job, guard );
+  }
+}
+
+
+// Run a job taken from the queue, with the lock released while it
+// runs
+
+void ThreadPool::runJob( std::function<void()> &job, std::unique_lock<std::mutex> &guard )
+
+{
+  numRunning++;
+
+  guard.unlock();
+  job();
+  guard.lock();
+
+  numRunning--;
+  if (jobs.size() == 0 && numRunning == 0)
+    allJobsDone.notify_all();
+
+  jobQueuedOrDone.notify_all();
+}
+
+
+void ThreadPool::workerLoop()
+
+{
+  std::unique_lock<std::mutex> guard( lock );
+
+  while (true) {
+
+    while (jobs.size() == 0 && !shuttingDown)
+      jobAvailable.wait( guard );
+
+    if (jobs.size() == 0) // shutting down with nothing left to do
+      return;
+
+    std::function<void()> job = jobs.front();
+    jobs.pop_front();
+
+    runJob( job, guard );
+  }
+}
+
+
+int ThreadPool::numCores()
+
+{
+  int n = std::thread::hardware_concurrency();
+
+  return (n > 0 ? n : 1);  // hardware_concurrency() may return 0 if unknown
+}
@@ -0,0 +1,63 @@
+// threadPool.h
+//
+// A fixed set of worker threads that run queued jobs.
+//
+// Use it:
+//
+//    ThreadPool *pool = new ThreadPool( 0 );   // 0 = one thread per core
+//
+//    pool->submit( [=]() { ... } );
+//    pool->wait();                             // until all jobs are done
+//
+// A job that submits jobs of its own and waits for them (e.g. to
+// build two subtrees) should wait with runJobsUntil(), which runs
+// queued jobs while it waits, so that waiting never leaves work
+// queued with no thread to run it.
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+
+
+class ThreadPool {
+
+  std::thread *workers;
+  int          numWorkers;
+
+  std::deque< std::function<void()> > jobs; // jobs not yet started
+
+  std::mutex              lock;
+  std::condition_variable jobAvailable;     // signalled when a job is queued (or on shutdown)
+  std::condition_variable allJobsDone;      // signalled when the queue empties and no job is running
+  std::condition_variable jobQueuedOrDone;  // signalled for runJobsUntil() when a job is queued or finishes
+
+  int  numRunning;                          // jobs currently executing
+  bool shuttingDown;
+
+  void workerLoop();
+  void runJob( std::function<void()> &job, std::unique_lock<std::mutex> &guard );
+
+ public:
+
+  ThreadPool( int numThreads );
+  ~ThreadPool();
+
+  void submit( std::function<void()> job );
+  void wait();
+  void runJobsUntil( std::function<bool()> done );
+
+  int size() const {
+    return numWorkers;
+  }
+
+  static int numCores();
+};
+
+
+#endif
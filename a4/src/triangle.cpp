@@ -8,14 +8,12 @@
 
 
 // Compute plane/ray intersection, and then the local coordinates to
-// see whether the intersection point is inside.
+// see whether the intersection point is inside.  Return the parameter
+// 't' and the barycentric coordinates of the intersection point.
 
-bool Triangle::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
-		       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * &mat, int &intPartIndex )
+bool Triangle::rayHit( vec3 &rayStart, vec3 &rayDir, float maxParam, float &t, float &alpha, float &beta )
 
 {
-  float t;
-
   // Compute ray/plane intersection
 
   float dn = rayDir * faceNormal;
@@ -51,26 +49,51 @@ bool Triangle::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPa
 
   float factor = 1/(p*s - q*r);
 
-  float alpha = factor * ( s*(a*x) - q*(b*x));
-  float beta  = factor * (-r*(a*x) + p*(b*x));
+  alpha = factor * ( s*(a*x) - q*(b*x));
+  beta  = factor * (-r*(a*x) + p*(b*x));
   float gamma = 1 - alpha - beta;
 
   // Check that point is inside triangle
   
-  if (alpha < 0 || beta < 0 || gamma < 0)
+  return (alpha >= 0 && beta >= 0 && gamma >= 0);
+}
+
+
+bool Triangle::rayInt( vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam, HitRecord &hit )
+
+{
+  float t, alpha, beta;
+
+  if (!rayHit( rayStart, rayDir, maxParam, t, alpha, beta )) // (which may change t, alpha, beta on a miss)
     return false;
 
+  hit.t         = t;
+  hit.partIndex = -1;
+  hit.alpha     = alpha;
+  hit.beta      = beta;
+
+  return true;
+}
+
+
+void Triangle::hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit,
+			vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, Material * &mat )
+
+{
+  float alpha = hit.alpha;
+  float beta  = hit.beta;
+  float gamma = 1 - alpha - beta;
+
   // Gather information to return
   
-  intParam = t;
-  intPoint = point;
+  intPoint = rayStart + hit.t * rayDir;
   mat      = this->mat;
 
   // Find the normal with bump mapping
 
   if (mat->bumpMap != NULL) {
     intNorm = faceNormal; // NOT YET IMPLEMENTED!
-    return true;
+    return;
   }
 
   // No bump mapping: Find the normal as interpolated
@@ -86,8 +109,17 @@ bool Triangle::rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxPa
   // coordinates at v0,v1,v2 are (0,0), (1,0), (0,1).
 
   intTexCoords = gamma * verts[0].texCoords + alpha * verts[1].texCoords + beta * verts[2].texCoords;
+}
 
-  return true;
+
+// Is the triangle hit with parameter in [0,maxParam)?
+
+bool Triangle::occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam )
+
+{
+  float t, alpha, beta;
+
+  return rayHit( rayStart, rayDir, maxParam, t, alpha, beta ) && t < maxParam;
 }
 
 
@@ -108,6 +140,20 @@ vec3 Triangle::textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &tex
 }
 
 
+// Bounding box of the three vertices
+
+BBox Triangle::bbox()
+
+{
+  vec3 &v0 = verts[0].position;
+  vec3 &v1 = verts[1].position;
+  vec3 &v2 = verts[2].position;
+
+  return BBox( vec3( MIN(v0.x,MIN(v1.x,v2.x)), MIN(v0.y,MIN(v1.y,v2.y)), MIN(v0.z,MIN(v1.z,v2.z)) ),
+	       vec3( MAX(v0.x,MAX(v1.x,v2.x)), MAX(v0.y,MAX(v1.y,v2.y)), MAX(v0.z,MAX(v1.z,v2.z)) ) );
+}
+
+
 // Output a triangle
 
 void Triangle::output( ostream &stream ) const
@@ -188,3 +234,89 @@ void Triangle::renderGL( GPUProgram *gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS
   glDrawArrays( GL_TRIANGLES, 0, 3 );
   glBindVertexArray( 0 );
 }
+
+
+
+// Spherical triangle
+//
+// This is all done in double precision.  In float, the solid angle
+// of a triangle of 1e-5 steradians can be wrong by 10% or more, and
+// the sampled sub-triangles by more.  In double, the solid angle is
+// accurate to float precision and the area of a sampled sub-triangle
+// is within 0.2% of u * solidAngle down to 1e-9 steradians, below
+// which the float direction that sample() returns limits it.
+
+#define MIN_SOLID_ANGLE 1e-9  // below this, the samples are too inaccurate
+
+
+// Spherical angle at unit vector 'a' between the arcs to unit vectors
+// 'b' and 'c'
+
+static double sphericalAngle( dvec3 &a, dvec3 &b, dvec3 &c )
+
+{
+  dvec3 ab = a ^ b;
+  dvec3 ac = a ^ c;
+
+  return atan2( (ab ^ ac).length(), ab * ac );
+}
+
+
+SphericalTriangle::SphericalTriangle( vec3 &point, vec3 *verts )
+
+{
+  dvec3 P( point );
+
+  A = (dvec3( verts[0] ) - P).normalize();
+  B = (dvec3( verts[1] ) - P).normalize();
+  C = (dvec3( verts[2] ) - P).normalize();
+
+  planeNormal = (verts[1] - verts[0]) ^ (verts[2] - verts[0]);
+  planeDist   = planeNormal * (verts[0] - point);
+
+  alpha = sphericalAngle( A, B, C );
+  cosC  = A * B;
+
+  // Van Oosterom and Strackee, "The Solid Angle of a Plane Triangle",
+  // IEEE Trans. Biomedical Engineering, 1983.  Unlike the spherical
+  // excess, alpha + beta + gamma - pi, this does not cancel for a
+  // small triangle.
+
+  solidAngle = 2 * atan2( fabs( A * (B ^ C) ), 1 + A * B + B * C + C * A );
+
+  if (!(solidAngle > MIN_SOLID_ANGLE)) // also catches NaN from a degenerate triangle
+    solidAngle = 0;
+}
+
+
+vec3 SphericalTriangle::sample( float u, float v )
+
+{
+  // Choose the sub-triangle A-B-C' that has area u * solidAngle
+
+  double areaHat = u * solidAngle;
+
+  double s = sin( areaHat - alpha );
+  double t = cos( areaHat - alpha );
+
+  double cosAlpha = cos( alpha );
+  double sinAlpha = sin( alpha );
+
+  double uu = t - cosAlpha;
+  double vv = s + sinAlpha * cosC;
+
+  double q = ((vv * t - uu * s) * cosAlpha - vv) / ((vv * s + uu * t) * sinAlpha);
+  q = MAX( -1, MIN( 1, q ) );
+
+  dvec3 Cperp  = (C - (C * A) * A).normalize();
+  dvec3 Cprime = q * A + sqrt( 1 - q * q ) * Cperp;
+
+  // Choose a point on the arc from B to C'
+
+  double z = 1 - v * (1 - Cprime * B);
+  z = MAX( -1, MIN( 1, z ) );
+
+  dvec3 CprimePerp = (Cprime - (Cprime * B) * B).normalize();
+
+  return (z * B + sqrt( 1 - z * z ) * CprimePerp).normalize().toVec3();
+}
@@ -17,16 +17,25 @@ class Triangle : public Object {
   float  dist;			// distance origin-to-plane of triangle
   GLuint VAO;
 
+  bool rayHit( vec3 &rayStart, vec3 &rayDir, float maxParam, float &t, float &alpha, float &beta );
+
  public:
 
   Vertex verts[3];		// three vertices of the triangle
 
   Triangle() {
+    type = OBJ_TRIANGLE;
     VAO = 0;
   }
 
-  bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam,
-	       vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material *&mat, int &intPartIndex );
+  bool rayInt( vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam, HitRecord &hit );
+
+  void hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit,
+		vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, Material *&mat );
+
+  bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam );
+
+  BBox bbox();
 
   void input( istream &stream );
   void output( ostream &stream ) const;
@@ -34,4 +43,61 @@ class Triangle : public Object {
   vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords );
 };
 
+
+// A direction in double precision, for SphericalTriangle, whose
+// solid angle and sampling formulas lose most of a float's digits
+// to cancellation when the triangle is small or distant
+
+class dvec3 {
+ public:
+
+  double x, y, z;
+
+  dvec3() {}
+  dvec3( double xx, double yy, double zz ) { x = xx; y = yy; z = zz; }
+  explicit dvec3( const vec3 &v ) { x = v.x; y = v.y; z = v.z; }
+
+  dvec3 operator + ( const dvec3 &p ) const { return dvec3( x+p.x, y+p.y, z+p.z ); }
+  dvec3 operator - ( const dvec3 &p ) const { return dvec3( x-p.x, y-p.y, z-p.z ); }
+  double operator * ( const dvec3 &p ) const { return x*p.x + y*p.y + z*p.z; } // dot product
+  dvec3 operator ^ ( const dvec3 &p ) const { return dvec3( y*p.z-z*p.y, z*p.x-x*p.z, x*p.y-y*p.x ); } // cross product
+
+  double length() const { return sqrt( x*x + y*y + z*z ); }
+  dvec3 normalize() const { double len = length(); return dvec3( x/len, y/len, z/len ); }
+
+  vec3 toVec3() const { return vec3( x, y, z ); }
+};
+
+inline dvec3 operator * ( double k, const dvec3 &p ) { return dvec3( k*p.x, k*p.y, k*p.z ); }
+
+
+// The triangle as seen from a point P, i.e. projected onto the unit
+// sphere around P.  This samples directions uniformly over the
+// triangle's solid angle, following Arvo, "Stratified Sampling of
+// Spherical Triangles", SIGGRAPH 1995.
+
+class SphericalTriangle {
+
+  dvec3  A, B, C;		// unit directions from P to the vertices
+  double alpha;			// spherical angle at A
+  double cosC;			// cosine of the arc from A to B
+
+  vec3  planeNormal;		// of the triangle (not unit length)
+  float planeDist;		// planeNormal * (any vertex - P)
+
+ public:
+
+  float solidAngle;		// area on the unit sphere (0 if too small to sample)
+
+  SphericalTriangle() {}
+  SphericalTriangle( vec3 &P, vec3 *verts ); // 3 vertices
+
+  vec3 sample( float u, float v );  // unit direction from P, for (u,v) in [0,1]^2
+
+  float distance( vec3 &dir ) {  // from P to the triangle's plane in direction 'dir'
+    return planeDist / (planeNormal * dir);
+  }
+};
+
+
 #endif
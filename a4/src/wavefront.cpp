@@ -15,6 +15,7 @@
 #endif
 
 #include "wavefront.h"
+#include "objParser.h"
 
 
 bool wfModel::newGroupWithNewMaterial = false;
@@ -24,6 +25,17 @@ unsigned char wfMaterial::defaultTexmap[] = { 255, 255, 255, 255, 255, 255,
                                               255, 255, 255, 255, 255, 255 };
 
 
+/* A run of consecutive triangles in the file that belong to one group
+ */
+
+class wfTriangleRun {
+ public:
+  int group;			/* index of the group */
+  int first;			/* index of the first triangle in wfModel::triangles */
+  int count;
+};
+
+
 /* Read a Wavefront model into this structure.  See ObjectFile.html
  * for a description of the Wavefront file format.  This code is from
  * the Nate Robins GLM library.
@@ -32,9 +44,6 @@ unsigned char wfMaterial::defaultTexmap[] = { 255, 255, 255, 255, 255, 255,
 void wfModel::read( const char *filename )
 
 {
-  FILE* file;
-  char  buf[1000];
-  float x, y, z;
   wfGroup    *currentGroup;
   wfMaterial *currentMaterial;
   int   nextGroupNum = 0;
@@ -51,6 +60,7 @@ void wfModel::read( const char *filename )
   vertices.clear();
   normals.clear();
   texcoords.clear();
+  triangles.clear();
   facetnorms.clear();
   materials.clear();
   groups.clear();
@@ -65,247 +75,170 @@ void wfModel::read( const char *filename )
 
   currentGroup->material = currentMaterial;
 
-  /* open the file */
+  /* parse the file, in parallel chunks */
 
-  file = fopen(filename, "r");
-  if (!file) {
+  seq<ObjChunk*> chunks;
+
+  if (!parseObjFile( filename, chunks )) {
     cerr << "wfModel::read() failed: can't open data file '" << filename << "'." << endl;
     exit(-1);
   }
 
-  /* process each line */
+  /* merge the chunks in order */
 
-  lineNum = 0;
+  int totalVertices = 0, totalTriangles = 0;
 
-  while(fscanf(file, "%s", buf) != EOF) {
+  for (int k=0; k<chunks.size(); k++) {
+    totalVertices  += chunks[k]->vertices.size();
+    totalTriangles += chunks[k]->triangles.size();
+  }
 
-    lineNum++;
+  vertices  = seq<vec3>( MAX( totalVertices, 1 ) );
+  triangles = seq<wfTriangle>( MAX( totalTriangles, 1 ) );
 
-    if (strncmp( buf, "transform", 9 ) == 0) {
+  seq<wfTriangleRun> runs;
 
-      for (int r=0; r<4; r++)
-        for (int c=0; c<4; c++) {
-          float val;
-          fscanf( file, "%f", &val );
-          objToWorldTransform[r][c] = val;
-        }
+  int firstLine = 0;		// line number before the chunk
 
-    } else {
+  for (int k=0; k<chunks.size(); k++) {
 
-      int v = 0, n = 0, t = 0;
-      wfTriangle *tri, *prevTri;
+    ObjChunk *chunk = chunks[k];
 
-      switch(buf[0]) {
+    for (int i=0; i<chunk->vertices.size(); i++)
+      vertices.add( chunk->vertices[i] );
+    for (int i=0; i<chunk->normals.size(); i++)
+      normals.add( chunk->normals[i] );
+    for (int i=0; i<chunk->texcoords.size(); i++)
+      texcoords.add( chunk->texcoords[i] );
 
-      case '#':                         /* comment */
-        /* eat up rest of line */
-        fgets(buf, sizeof(buf), file);
-        break;
+    // Faces may refer only to vertices that come before them
 
-      case 's':                         /* smoothing group ... ignore */
-        /* eat up rest of line */
-        fgets(buf, sizeof(buf), file);
-        break;
+    if (chunk->maxVindex >= 0) {
+      lineNum = firstLine + chunk->maxVindexLine;
+      checkVindex( chunk->maxVindex );
+    }
 
-      case 'v':                         /* v, vn, vt */
-        switch(buf[1]) {
+    if (chunk->minVindex < 0) {
+      lineNum = firstLine + chunk->minVindexLine;
+      checkVindex( chunk->minVindex );
+    }
 
-        case '\0':                      /* vertex */
-          fscanf(file, "%f %f %f", &x, &y, &z );
-          vertices.add( vec3(x,y,z) );
-          break;
+    // Replay the chunk's statements, adding the triangles before each
+    // to the current group
 
-        case 'n':                               /* normal */
-          fscanf(file, "%f %f %f", &x, &y, &z );
-          normals.add( vec3(x,y,z).normalize() );
-          break;
+    int nextTriangle = 0;
 
-        case 't':                               /* texcoord */
-          fscanf(file, "%f %f", &x, &y );
-          texcoords.add( vec3(x,y,0) );
-          fgets(buf, sizeof(buf), file); // skip rest of line
-          break;
+    for (int i=0; i<=chunk->statements.size(); i++) {
+
+      int numTriangles = (i < chunk->statements.size() ? chunk->statements[i].numTrianglesBefore : chunk->triangles.size());
+
+      if (nextTriangle < numTriangles) {
+
+        int g = groups.findIndex( currentGroup );
+
+        if (runs.size() == 0 || runs[runs.size()-1].group != g) {
+          wfTriangleRun run;
+          run.group = g;
+          run.first = triangles.size();
+          run.count = 0;
+          runs.add( run );
         }
+
+        runs[runs.size()-1].count  += numTriangles - nextTriangle;
+        currentGroup->numTriangles += numTriangles - nextTriangle;
+
+        for (; nextTriangle<numTriangles; nextTriangle++)
+          triangles.add( chunk->triangles[nextTriangle] );
+      }
+
+      if (i == chunk->statements.size())
         break;
 
-      case 'm':                         /* mtllib filename */
-        fgets(buf, sizeof(buf), file);
-        sscanf(buf, "%s %s", buf, buf);
-        mtllibname = strdup(buf);
-        readMaterialLibrary( buf );
+      ObjStatement &s = chunk->statements[i];
+
+      switch (s.type) {
+
+      case OBJ_TRANSFORM:
+        for (int r=0; r<4; r++)
+          for (int c=0; c<4; c++)
+            objToWorldTransform[r][c] = s.transform[4*r+c];
+        break;
+
+      case OBJ_MTLLIB:                  /* mtllib filename */
+        mtllibname = strdup(s.name);
+        readMaterialLibrary( s.name );
         break;
 
-      case 'u':                         /* usemtl name */
+      case OBJ_USEMTL:                  /* usemtl name */
 
         if (newGroupWithNewMaterial) {
           char buffer[100];
           sprintf( buffer, "g%d", nextGroupNum++ );
           currentGroup = findGroup( buffer );
         }
-      
-        fgets(buf, sizeof(buf), file);
-        sscanf(buf, "%s %s", buf, buf);
-        currentGroup->material = currentMaterial = findMaterial( buf );
+
+        currentGroup->material = currentMaterial = findMaterial( s.name );
         break;
 
-      case 'g':                         /* group */
-        /* eat up rest of line */
-        fgets(buf, sizeof(buf), file);
-        sscanf(buf, "%s", buf);
-        if (buf[0] == '\n')
+      case OBJ_GROUP:                   /* group */
+        if (s.name == NULL)
           currentGroup = findGroup( "default" );
         else
-          currentGroup = findGroup( buf );
+          currentGroup = findGroup( s.name );
         currentGroup->material = currentMaterial;
         break;
+      }
+    }
 
-      case 'f':                         /* face */
-
-        fscanf(file, "%s", buf);
-
-        /* can be one of %d, %d//%d, %d/%d, or %d/%d/%d */
-
-        tri = new wfTriangle();
-
-        if (strstr(buf, "//")) {        /* v//n */
-
-          numVN++;
-
-          /* First three vertices define a triangle */
-
-          sscanf(buf, "%d//%d", &v, &n);        v--; checkVindex(v); n--; tri->vindices[0] = v; tri->nindices[0] = n;
-          fscanf(file, "%d//%d", &v, &n);       v--; checkVindex(v); n--; tri->vindices[1] = v; tri->nindices[1] = n;
-          fscanf(file, "%d//%d", &v, &n);       v--; checkVindex(v); n--; tri->vindices[2] = v; tri->nindices[2] = n;
-
-          currentGroup->triangles.add( tri );
-
-          /* More vertices (a convex polygon) are converted to a fan of triangles: */
-
-          while(fscanf(file, "%d//%d", &v, &n) > 0) {
-
-            v--; checkVindex(v); n--;
-
-            prevTri = tri;
-            tri = new wfTriangle();
-
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->nindices[0] = prevTri->nindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->nindices[1] = prevTri->nindices[2];
-            tri->vindices[2] = v;
-            tri->nindices[2] = n;
-
-            currentGroup->triangles.add( tri );
-          }
-        
-        } else if (sscanf(buf, "%d/%d/%d", &v, &t, &n) == 3) {  /* v/t/n */
-
-          numVTN++;
-
-          v--; checkVindex(v); n--; t--;
-
-          tri->vindices[0] = v;
-          tri->tindices[0] = t;
-          tri->nindices[0] = n;
-          fscanf(file, "%d/%d/%d", &v, &t, &n); v--; checkVindex(v); n--; t--;
-          tri->vindices[1] = v;
-          tri->tindices[1] = t;
-          tri->nindices[1] = n;
-          fscanf(file, "%d/%d/%d", &v, &t, &n); v--; checkVindex(v); n--; t--;
-          tri->vindices[2] = v;
-          tri->tindices[2] = t;
-          tri->nindices[2] = n;
-
-          currentGroup->triangles.add( tri );
-        
-          while(fscanf(file, "%d/%d/%d", &v, &t, &n) > 0) {
-
-            v--; checkVindex(v); n--; t--;
-
-            prevTri = tri;
-            tri = new wfTriangle();
-
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->tindices[0] = prevTri->tindices[0];
-            tri->nindices[0] = prevTri->nindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->tindices[1] = prevTri->tindices[2];
-            tri->nindices[1] = prevTri->nindices[2];
-            tri->vindices[2] = v;
-            tri->tindices[2] = t;
-            tri->nindices[2] = n;
-
-            currentGroup->triangles.add( tri );
-          }
-        
-        } else if (sscanf(buf, "%d/%d", &v, &t) == 2) { /* v/t */
-
-          numVT++;
-
-          v--; checkVindex(v); t--;
+    for (int i=0; i<chunk->warnings.size(); i++)
+      cerr << "Warning: unrecognized Wavefront command on line " << firstLine + chunk->warnings[i].line << ": " << chunk->warnings[i].command << endl;
 
-          tri->vindices[0] = v;
-          tri->tindices[0] = t;
-          fscanf(file, "%d/%d", &v, &t);        v--; checkVindex(v); t--;
-          tri->vindices[1] = v;
-          tri->tindices[1] = t;
-          fscanf(file, "%d/%d", &v, &t);        v--; checkVindex(v); t--;
-          tri->vindices[2] = v;
-          tri->tindices[2] = t;
+    numVTN += chunk->numVTN;
+    numVT  += chunk->numVT;
+    numVN  += chunk->numVN;
+    numV   += chunk->numV;
 
-          currentGroup->triangles.add( tri );
+    firstLine += chunk->numLines;
 
-          while(fscanf(file, "%d/%d", &v, &t) > 0) {
+    delete chunk;
+  }
 
-            v--; checkVindex(v); t--;
+  // Store the triangles group by group.  They are read in that order
+  // unless the file returns to an earlier group, in which case the
+  // runs are moved.
 
-            prevTri = tri;
-            tri = new wfTriangle();
+  seq<int> nextInGroup( MAX( groups.size(), 1 ) );
+  int      numTriangles = 0;
 
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->tindices[0] = prevTri->tindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->tindices[1] = prevTri->tindices[2];
-            tri->vindices[2] = v;
-            tri->tindices[2] = t;
+  for (int g=0; g<groups.size(); g++) {
+    groups[g]->firstTriangle = numTriangles;
+    numTriangles += groups[g]->numTriangles;
+    nextInGroup.add( groups[g]->firstTriangle );
+  }
 
-            currentGroup->triangles.add( tri );
-          }
-        
-        } else {        /* v */
-        
-          numV++;
+  bool inGroupOrder = true;
 
-          sscanf(buf, "%d", &v); v--; checkVindex(v);
-          tri->vindices[0] = v;
-          fscanf(file, "%d", &v); v--; checkVindex(v);
-          tri->vindices[1] = v;
-          fscanf(file, "%d", &v); v--; checkVindex(v);
-          tri->vindices[2] = v;
+  for (int i=0; i<runs.size(); i++) {
+    if (runs[i].first != nextInGroup[ runs[i].group ])
+      inGroupOrder = false;
+    nextInGroup[ runs[i].group ] += runs[i].count;
+  }
 
-          currentGroup->triangles.add( tri );
-        
-          while(fscanf(file, "%d", &v) > 0) {
+  if (!inGroupOrder) {
 
-            v--; checkVindex(v);
+    wfTriangle *sorted = new wfTriangle[ triangles.size() ];
 
-            prevTri = tri;
-            tri = new wfTriangle();
+    for (int g=0; g<groups.size(); g++)
+      nextInGroup[g] = groups[g]->firstTriangle;
 
-            tri->vindices[0] = prevTri->vindices[0];
-            tri->vindices[1] = prevTri->vindices[2];
-            tri->vindices[2] = v;
+    for (int i=0; i<runs.size(); i++) {
+      memcpy( &sorted[ nextInGroup[ runs[i].group ] ], triangles.array() + runs[i].first, runs[i].count * sizeof(wfTriangle) );
+      nextInGroup[ runs[i].group ] += runs[i].count;
+    }
 
-            currentGroup->triangles.add( tri );
-          }
-        }
-        break;
+    memcpy( triangles.array(), sorted, triangles.size() * sizeof(wfTriangle) );
 
-      default:
-        cerr << "Warning: unrecognized Wavefront command on line " << lineNum << ": " << buf << endl;
-        break;
-      }
-    }
+    delete [] sorted;
   }
 
   // Determine a consistent format for each vertex
@@ -325,23 +258,22 @@ void wfModel::read( const char *filename )
 
   // Compute all face normals
 
-  for (int g=0; g<groups.size(); g++)
-    for (int i=0; i<groups[g]->triangles.size(); i++) {
+  for (int i=0; i<triangles.size(); i++) {
 
-      wfTriangle &tri = *groups[g]->triangles[i];
+    wfTriangle &tri = triangles[i];
 
-      vec3 d01 = vertices[ tri.vindices[1] ] - vertices[ tri.vindices[0] ];
-      vec3 d02 = vertices[ tri.vindices[2] ] - vertices[ tri.vindices[0] ];
-      vec3 n;
+    vec3 d01 = vertices[ tri.vindices[1] ] - vertices[ tri.vindices[0] ];
+    vec3 d02 = vertices[ tri.vindices[2] ] - vertices[ tri.vindices[0] ];
+    vec3 n;
 
-      if (verticesAreCW)
-        n = (d02 ^ d01).normalize();
-      else
-        n = (d01 ^ d02).normalize();
+    if (verticesAreCW)
+      n = (d02 ^ d01).normalize();
+    else
+      n = (d01 ^ d02).normalize();
 
-      tri.findex = facetnorms.size();
-      facetnorms.add( n );
-    }
+    tri.findex = facetnorms.size();
+    facetnorms.add( n );
+  }
 
   // Find bounding box
 
@@ -494,6 +426,13 @@ void wfModel::readMaterialLibrary( const char *name )
                 &currentMaterial->ambient[1],
                 &currentMaterial->ambient[2]);
         break;
+
+      case 'e':
+        fscanf( file, "%f %f %f",
+                &currentMaterial->emissive[0],
+                &currentMaterial->emissive[1],
+                &currentMaterial->emissive[2]);
+        break;
         
       default:
         /* eat up rest of line */
@@ -632,7 +571,9 @@ void wfModel::setupVAO( TextureMode textureMode )
 
     wfGroup *thisGroup = groups[i];
 
-    int numTriangles = thisGroup->triangles.size();
+    wfTriangleSpan groupTris = groupTriangles( i );
+
+    int numTriangles = groupTris.size();
 
     if (numTriangles > 0) {
       
@@ -644,9 +585,9 @@ void wfModel::setupVAO( TextureMode textureMode )
 
       VertexSignature *vertSig = new VertexSignature[ numTriangles * 3 ];
 
-      for (int j=0; j<thisGroup->triangles.size(); j++) {
+      for (int j=0; j<groupTris.size(); j++) {
       
-        wfTriangle *tri = thisGroup->triangles[j];
+        wfTriangle &tri = groupTris[j];
 
         for (int k=0; k<3; k++) {
 
@@ -654,9 +595,9 @@ void wfModel::setupVAO( TextureMode textureMode )
 
           VertexSignature vs;
 
-          vs.sig[0] = tri->vindices[k];
-          vs.sig[1] = tri->nindices[k];
-          vs.sig[2] = tri->tindices[k];
+          vs.sig[0] = tri.vindices[k];
+          vs.sig[1] = tri.nindices[k];
+          vs.sig[2] = tri.tindices[k];
 
           unsigned int l;
           for (l=0; l<nVerts; l++)
@@ -665,18 +606,18 @@ void wfModel::setupVAO( TextureMode textureMode )
 
           if (l == nVerts) {    // none found ... create a new vertex
 
-            * (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri->vindices[k] ];
+            * (vec3*) &vertexBuffer[nVerts*vertexSize] = vertices[ tri.vindices[k] ];
 
 	    if (hasVertexNormals)
-              * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri->nindices[k] ];
+              * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = normals[ tri.nindices[k] ];
 	    else
-              * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = facetnorms[ tri->findex ];
+              * (vec3*) &vertexBuffer[nVerts*vertexSize+3] = facetnorms[ tri.findex ];
 
             if (hasVertexTexCoords) {
               if (hasVertexNormals || true) // alway has vertex normals now
-                * (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri->tindices[k] ];
+                * (vec2*) &vertexBuffer[nVerts*vertexSize+6] = * (vec2*) &texcoords[ tri.tindices[k] ];
               else
-                * (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri->tindices[k] ];
+                * (vec2*) &vertexBuffer[nVerts*vertexSize+3] = * (vec2*) &texcoords[ tri.tindices[k] ];
             }
           
             vertSig[ nVerts ] = vs;
@@ -762,12 +703,17 @@ void wfModel::setupVAO( TextureMode textureMode )
   }
 
   initTextures( textureMode );
+
+  VAOsInitialized = true;
 }
 
 
 void wfModel::draw( GPUProgram * gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS )
 
 {
+  if (!VAOsInitialized)
+    setupVAO( textureMode );
+
   gpuProg->setMat4( "MV",  WCS_to_VCS );
 
   mat4 MVP = VCS_to_CCS * WCS_to_VCS;
@@ -788,7 +734,7 @@ void wfModel::draw( GPUProgram * gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS )
       //   2 = texcoord if normal present
 
       glBindVertexArray( groups[i]->VAO );
-      glDrawElements( GL_TRIANGLES, 3 * groups[i]->triangles.size(), GL_UNSIGNED_INT, 0 );
+      glDrawElements( GL_TRIANGLES, 3 * groups[i]->numTriangles, GL_UNSIGNED_INT, 0 );
       glBindVertexArray( 0 );
 
       groups[i]->material->unsetMaterial( true, true, gpuProg );
@@ -86,23 +86,51 @@ class wfTriangle {
 };
 
 
-/* A group of triangles sharing the same material
+/* A view of a contiguous range of a model's triangles
+ */
+
+
+class wfTriangleSpan {
+ public:
+  wfTriangle *first;
+  int        count;
+
+  wfTriangleSpan( wfTriangle *f, int n ) {
+    first = f;
+    count = n;
+  }
+
+  int size() const {
+    return count;
+  }
+
+  wfTriangle & operator [] ( int i ) const {
+    return first[i];
+  }
+};
+
+
+/* A group of triangles sharing the same material.  The group's
+ * triangles are a range of the model's triangles.
  */
 
 
 class wfGroup {
  public:
-  char             *name;	/* name of this group */
-  seq<wfTriangle*> triangles;	/* triangles of this group */
-  wfMaterial       *material;	/* material for group */
-  GLuint           VAO;
-  bool             VAOinitialized;
+  char       *name;		/* name of this group */
+  int        firstTriangle;	/* index of first triangle in wfModel::triangles */
+  int        numTriangles;	/* number of triangles of this group */
+  wfMaterial *material;		/* material for group */
+  GLuint     VAO;
+  bool       VAOinitialized;
 
   wfGroup() {}
 
   wfGroup( const char *gname ) {
     name = new char[ strlen(gname)+1 ];
     strcpy( name, gname );
+    firstTriangle = 0;
+    numTriangles = 0;
     VAOinitialized = false;
   }
 
@@ -112,14 +140,16 @@ class wfGroup {
 
   wfGroup( const wfGroup & source ) { // copy constructor
     name = strdup(source.name);
-    triangles = source.triangles;
+    firstTriangle = source.firstTriangle;
+    numTriangles = source.numTriangles;
     material = source.material;
   }
 
   wfGroup const &operator=( wfGroup const &src ) { // assignment operator
     if (this != &src) {
       name = strdup(src.name);
-      triangles = src.triangles;
+      firstTriangle = src.firstTriangle;
+      numTriangles = src.numTriangles;
       material = src.material;
     }
     return *this;
@@ -141,11 +171,16 @@ class wfModel {
   seq<vec3>  texcoords;		/* texture coordinates */
   seq<vec3>  facetnorms;	/* face normals */
 
+  seq<wfTriangle>  triangles;	/* triangles of all groups, stored group by group */
+
   seq<wfMaterial*> materials;	/* materials */
-  seq<wfGroup*>    groups;	/* groups (which themselves store the triangles) */
+  seq<wfGroup*>    groups;	/* groups (each a range of the triangles) */
 
   bool texturesInitialized;
 
+  TextureMode textureMode;	/* for setupVAO() */
+  bool        VAOsInitialized;	/* true once setupVAO() has been called */
+
   wfMaterial* findMaterial( const char *name );            /* find a named material */
   wfGroup*    findGroup( const char *name );               /* find a named group */
   void        readMaterialLibrary( const char *filename ); /* read all materials */
@@ -173,16 +208,22 @@ class wfModel {
 
   wfModel() {
     texturesInitialized = false;
+    VAOsInitialized = false;
+    textureMode = MIPMAP_LINEAR;
     pathname = mtllibname = NULL;
     objToWorldTransform = identity4();
   }
 
-  wfModel( const char *filename, TextureMode textureMode ) {
+  // The VAOs are set up on the first draw(), so no OpenGL is needed
+  // to read a model (e.g. for batch raytracing).
+
+  wfModel( const char *filename, TextureMode tm ) {
     texturesInitialized = false;
+    VAOsInitialized = false;
+    textureMode = tm;
     pathname = mtllibname = NULL;
     objToWorldTransform = identity4();
     read( filename );
-    setupVAO( textureMode );
   }
 
   ~wfModel() {
@@ -193,6 +234,10 @@ class wfModel {
   void setupVAO( TextureMode textureMode );
   void initTextures( TextureMode tm );        /* assign texture IDs and store all textures */
 
+  wfTriangleSpan groupTriangles( int g ) {    /* the triangles of group g */
+    return wfTriangleSpan( triangles.array() + groups[g]->firstTriangle, groups[g]->numTriangles );
+  }
+
   void checkVindex( int v ) {
     if (v < 0 || v >= vertices.size()) {
       cerr << "error on line " << lineNum
@@ -7,11 +7,73 @@
 #include "material.h"
 #include "bvh.h"
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+#endif
+
+
+bool WavefrontObj::useCache = true;
+
+
+// Read the object and build its BVH, or get both from the cache
+
+WavefrontObj::WavefrontObj( const char *filename )
+
+{
+  type = OBJ_WAVEFRONT;
+
+  if (useCache && readCache( filename ))
+    return;
+
+  obj = new wfModel( filename, MIPMAP_LINEAR ); // Read the object
+  copyWavefrontToBVH( bvh ); // Copy to the BVH
+  bvh.buildTree(); // Build the BVH
+
+  if (useCache)
+    writeCache( filename );
+}
+
 
 // Convert Wavefront object to a list of materials and triangles for the BVH.
 
 void WavefrontObj::copyWavefrontToBVH( BVH &bvh )
 
+{
+  copyMaterialsToBVH( bvh );
+
+  // Add the triangles of each group, which has the material of the
+  // same index
+
+  bvh.triangles    = seq<BVH_triangle>( MAX( obj->triangles.size(), 1 ) );
+  bvh.triangleData = seq<BVH_triangleData>( MAX( obj->triangles.size(), 1 ) );
+
+  for (int groupID=0; groupID<obj->groups.size(); groupID++) {
+    wfTriangleSpan tris = obj->groupTriangles( groupID );
+    for (int j=0; j<tris.size(); j++) {
+      wfTriangle &tri = tris[j];
+      bvh.triangles.add( BVH_triangle( tri.vindices[0], tri.vindices[1], tri.vindices[2], // indices into vertices[]
+				       tri.tindices[0], tri.tindices[1], tri.tindices[2], // indices into texcoords[]
+				       tri.nindices[0], tri.nindices[1], tri.nindices[2], // indices into normals[]
+				       groupID,                                           // index into mats[]
+				       tri.findex ) );                                    // index into facetnorms[]
+      bvh.triangleData.add( BVH_triangleData( obj->vertices[ tri.vindices[0] ],
+					      obj->vertices[ tri.vindices[1] ],
+					      obj->vertices[ tri.vindices[2] ] ) );
+    }
+  }
+}
+
+
+// Point the BVH at the object's vertex data and add one Material for
+// each group
+
+void WavefrontObj::copyMaterialsToBVH( BVH &bvh )
+
 {
   bvh.obj       = obj;
   bvh.vertices  = &obj->vertices;
@@ -20,11 +82,11 @@ void WavefrontObj::copyWavefrontToBVH( BVH &bvh )
   bvh.facetnorms= &obj->facetnorms;
 
   // Each group in the wavefront object
-  
+
   for (int groupID=0; groupID<obj->groups.size(); groupID++) {
 
     // Get this group's material
-    
+
     wfMaterial *fromMat = obj->groups[groupID]->material;
     Material *toMat = new Material();
 
@@ -55,16 +117,574 @@ void WavefrontObj::copyWavefrontToBVH( BVH &bvh )
     // Add to Materials
 
     bvh.materials.add( toMat );
+  }
+}
+
+
+
+// ---------------- Binary cache ----------------
+//
+// The cache file is a CacheHeader followed by sections, each of
+// which is a 64-bit count and then that many elements, padded to a
+// multiple of 8 bytes:
+//
+//   mtllib name (chars)
+//   vertices, normals, texcoords, facetnorms (vec3s)
+//   triangles of all groups (wfTriangles)
+//   for each group: name (chars), material name (chars), first triangle and count (ints)
+//   BVH triangles, BVH triangle data, flattened nodes, wide nodes
+//
+// The file is mapped into memory and each section is copied into
+// its array with one allocation per array.  The header records the
+// sizes of the stored classes, so a cache written by a differently
+// compiled program is rejected rather than misread.
+
+
+#define CACHE_MAGIC   "RTCACHE"	// 8 bytes, with the '\0'
+#define CACHE_VERSION 3
+
+#define RECENT_EDIT_TIME 2000000000LL	// nanoseconds; see readCache()
+
+
+class CacheHeader {
+
+public:
+
+  char      magic[8];
+  int       version;
+  int       classSizes[6];	// vec3, wfTriangle, BVH_triangle, BVH_triangleData, BVH_flatNode, WideBVH_node
+
+  long long objSize;		// of the .obj file
+  long long objModTime;		// in nanoseconds
+  unsigned long long objHash;
+
+  int       buildMethod;	// BVH build settings
+  int       maxLeafSize;
+  int       verticesAreCW;	// wfModel settings that change the geometry
+  int       newGroupWithNewMaterial;
+
+  int       numGroups;
+  int       hasVertexNormals;
+  int       hasVertexTexCoords;
+  float     radius;
+  vec3      centre, min, max;
+  mat4      objToWorldTransform;
+
+  void setClassSizes() {
+    classSizes[0] = sizeof(vec3);
+    classSizes[1] = sizeof(wfTriangle);
+    classSizes[2] = sizeof(BVH_triangle);
+    classSizes[3] = sizeof(BVH_triangleData);
+    classSizes[4] = sizeof(BVH_flatNode);
+    classSizes[5] = sizeof(WideBVH_node);
+  }
+};
+
+
+// Hash of a file's content, and its size.  Each 8-byte word is
+// combined with the hash so far and the result is fully mixed (with
+// the SplitMix64 finalizer), so that a change to any byte of the
+// file changes every bit of the hash.
+
+static inline unsigned long long mixWord( unsigned long long h )
+
+{
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+
+static bool hashFile( const char *filename, unsigned long long &hash, long long &size )
+
+{
+  FILE *f = fopen( filename, "rb" );
+  if (f == NULL)
+    return false;
+
+  const int bufferWords = 1 << 17; // 1 MB
+  unsigned long long *buffer = new unsigned long long[ bufferWords ];
+
+  hash = 14695981039346656037ULL;
+  size = 0;
+
+  size_t n;
+  while ((n = fread( buffer, 1, bufferWords * sizeof(unsigned long long), f )) > 0) {
+
+    if (n % sizeof(unsigned long long) != 0) // zero the end of the last word
+      memset( (char *) buffer + n, 0, sizeof(unsigned long long) - n % sizeof(unsigned long long) );
+
+    int numWords = (n + sizeof(unsigned long long) - 1) / sizeof(unsigned long long);
+
+    for (int i=0; i<numWords; i++)
+      hash = mixWord( hash ^ buffer[i] );
+
+    size += n;
+  }
+
+  delete [] buffer;
+  fclose( f );
+
+  return true;
+}
+
+
+// A file's size and modification time, in nanoseconds (as precise
+// as the platform and file system record it)
+
+static bool fileStats( const char *filename, long long &size, long long &modTime )
+
+{
+  struct stat st;
+
+  if (stat( filename, &st ) != 0)
+    return false;
+
+  size = st.st_size;
+
+#if defined(_WIN32)
+  modTime = st.st_mtime * 1000000000LL;
+#elif defined(MACOS) || defined(__APPLE__)
+  modTime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+  modTime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+
+  return true;
+}
+
+
+// Sequential writing and (bounds-checked) reading of sections
+
+class CacheWriter {
+
+  FILE *file;
+  bool  ok;
+
+public:
+
+  CacheWriter( FILE *f ) { file = f; ok = true; }
+
+  bool succeeded() { return ok; }
+
+  void write( const void *data, size_t size ) {
+    if (size > 0 && fwrite( data, size, 1, file ) != 1)
+      ok = false;
+  }
+
+  void section( const void *data, long long count, size_t elementSize ) {
+    static const char zeros[8] = { 0 };
+    write( &count, sizeof(count) );
+    write( data, count * elementSize );
+    write( zeros, (8 - (count * elementSize) % 8) % 8 );
+  }
+
+  template <class T> void section( seq<T> &s ) {
+    section( s.array(), s.size(), sizeof(T) );
+  }
+
+  void section( const char *str ) {
+    section( str, (str != NULL ? strlen( str ) : 0), 1 );
+  }
+};
+
+
+class CacheReader {
+
+  char *next, *end;
+  bool  ok;
+
+public:
+
+  CacheReader( char *data, size_t size ) { next = data; end = data + size; ok = true; }
+
+  bool succeeded() { return ok; }
+
+  // Return the elements of the next section, or NULL if the file is
+  // too short
+
+  char *section( long long &count, size_t elementSize ) {
+
+    count = 0;
+
+    if (!ok || end - next < (long long) sizeof(count)) {
+      ok = false;
+      return NULL;
+    }
+
+    memcpy( &count, next, sizeof(count) );
+
+    long long size = count * elementSize;
+
+    if (count < 0 || end - next - (long long) sizeof(count) < size) {
+      ok = false;
+      count = 0;
+      return NULL;
+    }
+
+    char *data = next + sizeof(count);
+    next = data + size + (8 - size % 8) % 8;
+    if (next > end)
+      next = end;
+
+    return data;
+  }
+
+  template <class T> void section( seq<T> &s ) {
+    long long count;
+    T *data = (T *) section( count, sizeof(T) );
+    s = seq<T>( MAX( count, 1 ) );
+    for (long long i=0; i<count; i++)
+      s.add( data[i] );
+  }
+
+  char *string() {
+    long long count;
+    char *data = section( count, 1 );
+    if (!ok || count == 0)
+      return NULL;
+    char *str = new char[ count+1 ];
+    memcpy( str, data, count );
+    str[count] = '\0';
+    return str;
+  }
+};
 
-    // Add the triangles of this group
 
-    for (int j=0; j<obj->groups[groupID]->triangles.size(); j++) {
-      wfTriangle *tri = obj->groups[groupID]->triangles[j];
-      bvh.triangles.add( BVH_triangle( tri->vindices[0], tri->vindices[1], tri->vindices[2], // indices into vertices[] 
-				       tri->tindices[0], tri->tindices[1], tri->tindices[2], // indices into texcoords[]
-				       tri->nindices[0], tri->nindices[1], tri->nindices[2], // indices into normals[]
-				       bvh.materials.size()-1,                               // index into mats[]
-				       tri->findex ) );                                      // index into facetnorms[]
-    }    
+// Read the object and its BVH from the cache.  Return false if there
+// is no cache, if it is not for this .obj file and these settings,
+// or if it is damaged (e.g. truncated), in which case the caller
+// reads the .obj file and writes a new cache.
+
+bool WavefrontObj::readCache( const char *filename )
+
+{
+  long long objSize, objModTime;
+
+  if (!fileStats( filename, objSize, objModTime ))
+    return false;
+
+  char *cacheFilename = new char[ strlen(filename) + strlen(WAVEFRONT_CACHE_SUFFIX) + 1 ];
+  sprintf( cacheFilename, "%s%s", filename, WAVEFRONT_CACHE_SUFFIX );
+
+  long long cacheSize, cacheModTime;
+
+  if (!fileStats( cacheFilename, cacheSize, cacheModTime )) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+  // Get the cache file's contents
+
+  char  *data = NULL;
+  size_t dataSize = 0;
+
+#ifdef _WIN32
+
+  FILE *f = fopen( cacheFilename, "rb" );
+
+  if (f == NULL) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+  fseek( f, 0, SEEK_END );
+  dataSize = ftell( f );
+  fseek( f, 0, SEEK_SET );
+
+  data = new char[ dataSize ];
+
+  if (fread( data, 1, dataSize, f ) != dataSize) {
+    fclose( f );
+    delete [] data;
+    delete [] cacheFilename;
+    return false;
+  }
+
+  fclose( f );
+
+#else
+
+  int fd = open( cacheFilename, O_RDONLY );
+
+  if (fd < 0) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat( fd, &st ) != 0 || st.st_size == 0) {
+    close( fd );
+    delete [] cacheFilename;
+    return false;
+  }
+
+  dataSize = st.st_size;
+  data = (char *) mmap( NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+  close( fd );
+
+  if (data == (char *) MAP_FAILED) {
+    delete [] cacheFilename;
+    return false;
+  }
+
+#endif
+
+  // Check that the cache goes with this file and these settings
+
+  CacheHeader header, expected;
+  expected.setClassSizes();
+
+  bool valid = (dataSize >= sizeof(CacheHeader));
+
+  if (valid) {
+    memcpy( &header, data, sizeof(CacheHeader) );
+
+    valid = (memcmp( header.magic, CACHE_MAGIC, sizeof(header.magic) ) == 0 &&
+	     header.version == CACHE_VERSION &&
+	     memcmp( header.classSizes, expected.classSizes, sizeof(header.classSizes) ) == 0 &&
+	     header.objSize == objSize &&
+	     header.buildMethod == (int) BVH::buildMethod &&
+	     header.maxLeafSize == BVH::maxLeafSize &&
+	     header.verticesAreCW == (int) wfModel::verticesAreCW &&
+	     header.newGroupWithNewMaterial == (int) wfModel::newGroupWithNewMaterial);
+  }
+
+  // A file with a new modification time (e.g. after being copied) is
+  // still the same if its content is.  The content is also checked if
+  // the cache was written within RECENT_EDIT_TIME of the file's
+  // modification time, since a file system with coarse times could
+  // give a later edit the same time.
+
+  bool hashChecked = false;
+
+  if (valid && (header.objModTime != objModTime || cacheModTime - objModTime < RECENT_EDIT_TIME)) {
+    unsigned long long objHash;
+    valid = (hashFile( filename, objHash, objSize ) && objHash == header.objHash);
+    hashChecked = true;
+  }
+
+  // Rebuild the object from the sections
+
+  if (valid) {
+
+    CacheReader in( data + sizeof(CacheHeader), dataSize - sizeof(CacheHeader) );
+
+    obj = new wfModel();
+
+    obj->textureMode = MIPMAP_LINEAR;
+    obj->pathname    = strdup( filename );
+    obj->mtllibname  = in.string();
+
+    obj->materials.add( new wfMaterial( "default" ) );
+    if (obj->mtllibname != NULL)
+      obj->readMaterialLibrary( obj->mtllibname );
+
+    in.section( obj->vertices );
+    in.section( obj->normals );
+    in.section( obj->texcoords );
+    in.section( obj->facetnorms );
+    in.section( obj->triangles );
+
+    bool rangesOk = true;
+
+    for (int g=0; g<header.numGroups && in.succeeded(); g++) {
+
+      char *groupName    = in.string();
+      char *materialName = in.string();
+
+      wfGroup *group = new wfGroup( groupName != NULL ? groupName : "" );
+      group->material = (materialName != NULL ? obj->findMaterial( materialName ) : obj->materials[0]);
+
+      long long count;
+      int *range = (int *) in.section( count, sizeof(int) );
+
+      if (count == 2 && range[0] >= 0 && range[1] >= 0 && range[0] + range[1] <= obj->triangles.size()) {
+	group->firstTriangle = range[0];
+	group->numTriangles  = range[1];
+      } else
+	rangesOk = false;
+
+      obj->groups.add( group );
+
+      delete [] groupName;
+      delete [] materialName;
+    }
+
+    obj->hasVertexNormals    = header.hasVertexNormals;
+    obj->hasVertexTexCoords  = header.hasVertexTexCoords;
+    obj->objToWorldTransform = header.objToWorldTransform;
+    obj->centre = header.centre;
+    obj->radius = header.radius;
+    obj->min    = header.min;
+    obj->max    = header.max;
+
+    // BVH
+
+    copyMaterialsToBVH( bvh );
+
+    in.section( bvh.triangles );
+    in.section( bvh.triangleData );
+
+    long long count;
+    BVH_flatNode *nodes = (BVH_flatNode *) in.section( count, sizeof(BVH_flatNode) );
+
+    if (count > 0) {
+      bvh.numNodes = count;
+      bvh.nodes = BVH::allocNodes( count );
+      memcpy( bvh.nodes, nodes, count * sizeof(BVH_flatNode) );
+    }
+
+    WideBVH_node *wideNodes = (WideBVH_node *) in.section( count, sizeof(WideBVH_node) );
+
+    if (count > 0) {
+      bvh.numWideNodes = count;
+      bvh.wideNodes = allocWideNodes( count );
+      memcpy( bvh.wideNodes, wideNodes, count * sizeof(WideBVH_node) );
+    }
+
+    // A damaged cache is discarded and rebuilt by the caller
+
+    if (!in.succeeded() || !rangesOk) {
+
+      cerr << "The cache for " << filename << " is damaged, so it will be rebuilt." << endl;
+
+      for (int i=0; i<bvh.materials.size(); i++) {
+	if (bvh.materials[i]->texture != NULL)
+	  delete bvh.materials[i]->texture;
+	delete bvh.materials[i];
+      }
+      bvh.materials.clear();
+      bvh.triangles.clear();
+      bvh.triangleData.clear();
+
+      if (bvh.nodes != NULL)
+	BVH::freeNodes( bvh.nodes );
+      if (bvh.wideNodes != NULL)
+	freeWideNodes( bvh.wideNodes );
+
+      bvh.nodes        = NULL;
+      bvh.numNodes     = 0;
+      bvh.wideNodes    = NULL;
+      bvh.numWideNodes = 0;
+
+      delete obj;
+      obj = NULL;
+
+      valid = false;
+    }
+  }
+
+#ifdef _WIN32
+  delete [] data;
+#else
+  munmap( data, dataSize );
+#endif
+
+  // If the .obj file was found to be the same by its hash, record its
+  // modification time.  This also updates the cache's own time, so
+  // that later runs needn't hash it again once the file is no longer
+  // recently modified.
+
+  if (valid && hashChecked) {
+
+    FILE *f = fopen( cacheFilename, "r+b" );
+
+    if (f != NULL) {
+      if (fseek( f, offsetof( CacheHeader, objModTime ), SEEK_SET ) == 0)
+	fwrite( &objModTime, sizeof(objModTime), 1, f );
+      fclose( f );
+    }
+  }
+
+  delete [] cacheFilename;
+
+  return valid;
+}
+
+
+// Write the object and its BVH to the cache.  If the cache can't be
+// written (e.g. the directory is read-only), the object is simply
+// read from the .obj file next time.
+
+void WavefrontObj::writeCache( const char *filename )
+
+{
+  CacheHeader header;
+
+  memset( (void *) &header, 0, sizeof(header) ); // so that the padding is written as zeros
+  memcpy( header.magic, CACHE_MAGIC, sizeof(header.magic) );
+  header.version = CACHE_VERSION;
+  header.setClassSizes();
+
+  if (!fileStats( filename, header.objSize, header.objModTime ) ||
+      !hashFile( filename, header.objHash, header.objSize ))
+    return;
+
+  header.buildMethod             = BVH::buildMethod;
+  header.maxLeafSize             = BVH::maxLeafSize;
+  header.verticesAreCW           = wfModel::verticesAreCW;
+  header.newGroupWithNewMaterial = wfModel::newGroupWithNewMaterial;
+
+  header.numGroups           = obj->groups.size();
+  header.hasVertexNormals    = obj->hasVertexNormals;
+  header.hasVertexTexCoords  = obj->hasVertexTexCoords;
+  header.objToWorldTransform = obj->objToWorldTransform;
+  header.centre              = obj->centre;
+  header.radius              = obj->radius;
+  header.min                 = obj->min;
+  header.max                 = obj->max;
+
+  // Write to a temporary file, then rename it, so that a partial
+  // cache is never read
+
+  char *cacheFilename = new char[ strlen(filename) + strlen(WAVEFRONT_CACHE_SUFFIX) + 1 ];
+  char *tempFilename  = new char[ strlen(filename) + strlen(WAVEFRONT_CACHE_SUFFIX) + 5 ];
+
+  sprintf( cacheFilename, "%s%s", filename, WAVEFRONT_CACHE_SUFFIX );
+  sprintf( tempFilename, "%s.tmp", cacheFilename );
+
+  FILE *f = fopen( tempFilename, "wb" );
+
+  if (f != NULL) {
+
+    CacheWriter out( f );
+
+    out.write( &header, sizeof(header) );
+
+    out.section( obj->mtllibname );
+
+    out.section( obj->vertices );
+    out.section( obj->normals );
+    out.section( obj->texcoords );
+    out.section( obj->facetnorms );
+    out.section( obj->triangles );
+
+    for (int g=0; g<obj->groups.size(); g++) {
+
+      wfGroup *group = obj->groups[g];
+
+      out.section( group->name );
+      out.section( group->material->name );
+
+      int range[2] = { group->firstTriangle, group->numTriangles };
+      out.section( range, 2, sizeof(int) );
+    }
+
+    out.section( bvh.triangles );
+    out.section( bvh.triangleData );
+    out.section( bvh.nodes, bvh.numNodes, sizeof(BVH_flatNode) );
+    out.section( bvh.wideNodes, bvh.numWideNodes, sizeof(WideBVH_node) );
+
+    bool ok = out.succeeded();
+
+    if (fclose( f ) == 0 && ok) {
+      remove( cacheFilename ); // rename() on Windows won't replace a file
+      rename( tempFilename, cacheFilename );
+    } else
+      remove( tempFilename );
   }
+
+  delete [] cacheFilename;
+  delete [] tempFilename;
 }
@@ -1,4 +1,14 @@
 /* wavefrontobj.h
+ *
+ * A Wavefront object with a BVH over its triangles
+ *
+ * Parsing a large .obj file and building its BVH is slow, so the
+ * result is saved in a binary cache file next to the .obj file (with
+ * WAVEFRONT_CACHE_SUFFIX appended to its name).  Later runs read the
+ * cache instead, as long as the .obj file has the same size and
+ * modification time (or, failing that, the same content hash) and
+ * the BVH build settings have not changed.  Materials and textures
+ * are always read from the .mtl file.
  */
 
 
@@ -11,9 +21,16 @@
 #include "bvh.h"
 
 
+#define WAVEFRONT_CACHE_SUFFIX ".rtcache"
+
+
 class WavefrontObj : public Object {
 
   void copyWavefrontToBVH( BVH &bvh );
+  void copyMaterialsToBVH( BVH &bvh );
+
+  bool readCache( const char *filename );
+  void writeCache( const char *filename );
 
  public:
 
@@ -21,20 +38,32 @@ class WavefrontObj : public Object {
 
   BVH bvh;			/* bounding volume hierarchy of triangle primitives */
 
-  WavefrontObj() {}
+  static bool useCache;		/* read and write the binary cache (true by default) */
 
-  WavefrontObj( const char *filename ) {
-    obj = new wfModel( filename, MIPMAP_LINEAR ); // Read the object
-    copyWavefrontToBVH( bvh ); // Copy to the BVH
-    bvh.buildTree(); // Build the BVH
+  WavefrontObj() {
+    type = OBJ_WAVEFRONT;
   }
 
+  WavefrontObj( const char *filename );
+
   void renderGL( GPUProgram * gpuProg, mat4 &WCS_to_VCS, mat4 &VCS_to_CCS ) {
     obj->draw( gpuProg, WCS_to_VCS, VCS_to_CCS );
   }
   
-  bool rayInt( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam, vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, float &intParam, Material * &mat, int &intPartIndex ) {
-    return bvh.rayInt( rayStart, rayDir, objPartIndex, maxParam, intPoint, intNorm, intTexCoords, intParam, mat, intPartIndex );
+  bool rayInt( vec3 &rayStart, vec3 &rayDir, int objPartIndex, float maxParam, HitRecord &hit ) {
+    return bvh.rayInt( rayStart, rayDir, objPartIndex, maxParam, hit );
+  }
+
+  void hitInfo( vec3 &rayStart, vec3 &rayDir, HitRecord &hit, vec3 &intPoint, vec3 &intNorm, vec3 &intTexCoords, Material * &mat ) {
+    bvh.hitInfo( rayStart, rayDir, hit, intPoint, intNorm, intTexCoords, mat );
+  }
+
+  bool occluded( vec3 rayStart, vec3 rayDir, int objPartIndex, float maxParam ) {
+    return bvh.occluded( rayStart, rayDir, objPartIndex, maxParam );
+  }
+
+  BBox bbox() {
+    return bvh.bbox();
   }
 
   vec3 textureColour( vec3 &p, int objPartIndex, float &alpha, vec3 &texCoords ) {
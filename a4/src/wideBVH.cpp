@@ -0,0 +1,366 @@
+// wideBVH.cpp
+
+
+#include "headers.h"
+#include "wideBVH.h"
+#include "bvh.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+  #define WIDE_BVH_X86
+  #include <immintrin.h>
+#endif
+
+
+static_assert( sizeof(WideBVH_node) % WIDE_BVH_ALIGNMENT == 0, "WideBVH_node should fill whole cache lines" );
+
+
+
+WideBVH_ray::WideBVH_ray( vec3 &rayStart, vec3 &rayDir )
+
+{
+  for (int i=0; i<3; i++) {
+
+    origin[i] = rayStart[i];
+    invDir[i] = 1.0f / rayDir[i]; // handles division by zero correctly (i.e. IEEE Inf)
+
+    if (invDir[i] < 0) {
+      nearPlane[i] = i+3;	// max
+      farPlane[i]  = i;		// min
+    } else {
+      nearPlane[i] = i;
+      farPlane[i]  = i+3;
+    }
+  }
+}
+
+
+
+// Scalar box test
+//
+// This is BVH::rayBoxInt() for each child.  An empty child has an
+// inverted box (min = +inf, max = -inf), so it is never hit.
+
+int wideBoxTestScalar( WideBVH_node &node, WideBVH_ray &ray, float tmax, float *tEntry )
+
+{
+  int mask = 0;
+
+  for (int i=0; i<WIDE_BVH_WIDTH; i++) {
+
+    float t0 = 0;
+    float t1 = tmax;
+
+    for (int axis=0; axis<3; axis++) {
+
+      float tNear = (node.bounds[ ray.nearPlane[axis] ][i] - ray.origin[axis]) * ray.invDir[axis];
+      float tFar  = (node.bounds[ ray.farPlane[axis]  ][i] - ray.origin[axis]) * ray.invDir[axis];
+
+      t0 = (tNear > t0) ? tNear : t0; // (a NaN leaves t0 and t1 unchanged)
+      t1 = (tFar  < t1) ? tFar  : t1;
+    }
+
+    if (t0 <= t1) {
+      mask |= (1 << i);
+      tEntry[i] = t0;
+    }
+  }
+
+  return mask;
+}
+
+
+#ifdef WIDE_BVH_X86
+
+
+// SSE box test: four children per pass
+//
+// _mm_max_ps(a,b) and _mm_min_ps(a,b) return b if a is NaN, so the
+// running t0 and t1 are always the second argument, as in the scalar
+// test.
+
+static int boxTestSSE( WideBVH_node &node, WideBVH_ray &ray, float tmax, float *tEntry )
+
+{
+  __m128 ox = _mm_set1_ps( ray.origin[0] );
+  __m128 oy = _mm_set1_ps( ray.origin[1] );
+  __m128 oz = _mm_set1_ps( ray.origin[2] );
+
+  __m128 ix = _mm_set1_ps( ray.invDir[0] );
+  __m128 iy = _mm_set1_ps( ray.invDir[1] );
+  __m128 iz = _mm_set1_ps( ray.invDir[2] );
+
+  int mask = 0;
+
+  for (int i=0; i<WIDE_BVH_WIDTH; i+=4) {
+
+    __m128 t0 = _mm_setzero_ps();
+    __m128 t1 = _mm_set1_ps( tmax );
+
+    t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node.bounds[ ray.nearPlane[0] ][i] ), ox ), ix ), t0 );
+    t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node.bounds[ ray.nearPlane[1] ][i] ), oy ), iy ), t0 );
+    t0 = _mm_max_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node.bounds[ ray.nearPlane[2] ][i] ), oz ), iz ), t0 );
+
+    t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node.bounds[ ray.farPlane[0] ][i] ), ox ), ix ), t1 );
+    t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node.bounds[ ray.farPlane[1] ][i] ), oy ), iy ), t1 );
+    t1 = _mm_min_ps( _mm_mul_ps( _mm_sub_ps( _mm_load_ps( &node.bounds[ ray.farPlane[2] ][i] ), oz ), iz ), t1 );
+
+    _mm_storeu_ps( &tEntry[i], t0 );
+
+    mask |= _mm_movemask_ps( _mm_cmple_ps( t0, t1 ) ) << i;
+  }
+
+  return mask;
+}
+
+
+// AVX box test: all eight children in one pass
+//
+// This is compiled for AVX regardless of the compiler flags, and is
+// only called if the CPU supports AVX.
+
+#if defined(__GNUC__)
+
+__attribute__((target("avx")))
+static int boxTestAVX( WideBVH_node &node, WideBVH_ray &ray, float tmax, float *tEntry )
+
+{
+  __m256 ox = _mm256_set1_ps( ray.origin[0] );
+  __m256 oy = _mm256_set1_ps( ray.origin[1] );
+  __m256 oz = _mm256_set1_ps( ray.origin[2] );
+
+  __m256 ix = _mm256_set1_ps( ray.invDir[0] );
+  __m256 iy = _mm256_set1_ps( ray.invDir[1] );
+  __m256 iz = _mm256_set1_ps( ray.invDir[2] );
+
+  __m256 t0 = _mm256_setzero_ps();
+  __m256 t1 = _mm256_set1_ps( tmax );
+
+  t0 = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node.bounds[ ray.nearPlane[0] ] ), ox ), ix ), t0 );
+  t0 = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node.bounds[ ray.nearPlane[1] ] ), oy ), iy ), t0 );
+  t0 = _mm256_max_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node.bounds[ ray.nearPlane[2] ] ), oz ), iz ), t0 );
+
+  t1 = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node.bounds[ ray.farPlane[0] ] ), ox ), ix ), t1 );
+  t1 = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node.bounds[ ray.farPlane[1] ] ), oy ), iy ), t1 );
+  t1 = _mm256_min_ps( _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( node.bounds[ ray.farPlane[2] ] ), oz ), iz ), t1 );
+
+  _mm256_storeu_ps( tEntry, t0 );
+
+  return _mm256_movemask_ps( _mm256_cmp_ps( t0, t1, _CMP_LE_OQ ) );
+}
+
+#endif
+
+#endif
+
+
+// Choose the box test for this CPU
+
+static WideBVH_boxTest chooseBoxTest( const char * &name )
+
+{
+#ifdef WIDE_BVH_X86
+
+#if defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports( "avx" )) {
+    name = "AVX";
+    return boxTestAVX;
+  }
+#endif
+
+  name = "SSE";     // all x86-64 processors have SSE2
+  return boxTestSSE;
+
+#else
+
+  name = "scalar";
+  return wideBoxTestScalar;
+
+#endif
+}
+
+
+const char     *wideBoxTestName = "scalar";
+WideBVH_boxTest wideBoxTest     = chooseBoxTest( wideBoxTestName );
+
+
+
+// Collapse a flattened tree
+//
+// Each wide node takes the children of a flat node and, while there
+// is room, replaces the child with the largest surface area by its
+// own children.  So a binary tree is collapsed by about three levels
+// per wide node.  A k-means tree (with K = 8) is copied as is.
+
+
+static float surfaceArea( BBox &b )
+
+{
+  vec3 d = b.max - b.min;
+  return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+
+// Find the flat nodes that become the children of a wide node
+
+static int gatherChildren( BVH_flatNode *flatNodes, int flatIndex, int *slots )
+
+{
+  BVH_flatNode &f = flatNodes[flatIndex];
+
+  if (f.isLeaf) { // only for a root that is a leaf
+    slots[0] = flatIndex;
+    return 1;
+  }
+
+  int n = 0;
+
+  for (int i=0; i<f.count && n<WIDE_BVH_WIDTH; i++)
+    slots[n++] = f.offset + i;
+
+  while (true) {
+
+    int   best     = -1;
+    float bestArea = -1;
+
+    for (int i=0; i<n; i++) {
+      BVH_flatNode &c = flatNodes[ slots[i] ];
+      if (!c.isLeaf && n-1 + c.count <= WIDE_BVH_WIDTH) {
+	float area = surfaceArea( c.bbox );
+	if (area > bestArea) {
+	  best = i;
+	  bestArea = area;
+	}
+      }
+    }
+
+    if (best < 0)
+      break;
+
+    BVH_flatNode &c = flatNodes[ slots[best] ];
+
+    slots[best] = c.offset;
+    for (int i=1; i<c.count; i++)
+      slots[n++] = c.offset + i;
+  }
+
+  return n;
+}
+
+
+static int countWideNodes( BVH_flatNode *flatNodes, int flatIndex, int &maxPending )
+
+{
+  int slots[ WIDE_BVH_WIDTH ];
+  int n = gatherChildren( flatNodes, flatIndex, slots );
+
+  int count = 1;
+  int childPending = 0;
+
+  for (int i=0; i<n; i++)
+    if (!flatNodes[ slots[i] ].isLeaf) {
+      int p;
+      count += countWideNodes( flatNodes, slots[i], p );
+      childPending = MAX( childPending, p );
+    }
+
+  maxPending = n + childPending;
+
+  return count;
+}
+
+
+static int fillWideNodes( BVH_flatNode *flatNodes, int flatIndex, WideBVH_node *wideNodes, int &nextFree )
+
+{
+  int wideIndex = nextFree++;
+
+  int slots[ WIDE_BVH_WIDTH ];
+  int n = gatherChildren( flatNodes, flatIndex, slots );
+
+  // Fill in the children.  Recursion may place nodes after this one,
+  // but does not move it.
+
+  for (int i=0; i<WIDE_BVH_WIDTH; i++) {
+
+    int child, count;
+    BBox box;
+
+    if (i >= n) { // no child: an inverted box is never hit
+      child = 0;
+      count = -1;
+      box   = BBox( vec3( INFINITY, INFINITY, INFINITY ), vec3( -INFINITY, -INFINITY, -INFINITY ) );
+    } else {
+      BVH_flatNode &c = flatNodes[ slots[i] ];
+      box = c.bbox;
+      if (c.isLeaf) {
+	child = c.offset;
+	count = c.count;
+      } else {
+	child = fillWideNodes( flatNodes, slots[i], wideNodes, nextFree );
+	count = 0;
+      }
+    }
+
+    WideBVH_node &w = wideNodes[wideIndex];
+
+    w.bounds[0][i] = box.min.x;
+    w.bounds[1][i] = box.min.y;
+    w.bounds[2][i] = box.min.z;
+    w.bounds[3][i] = box.max.x;
+    w.bounds[4][i] = box.max.y;
+    w.bounds[5][i] = box.max.z;
+    w.child[i]     = child;
+    w.count[i]     = count;
+  }
+
+  return wideIndex;
+}
+
+
+WideBVH_node *buildWideBVH( BVH_flatNode *flatNodes, int &numWideNodes, int &maxPending )
+
+{
+  numWideNodes = countWideNodes( flatNodes, 0, maxPending );
+
+  WideBVH_node *wideNodes = allocWideNodes( numWideNodes );
+
+  int nextFree = 0;
+  fillWideNodes( flatNodes, 0, wideNodes, nextFree );
+
+  return wideNodes;
+}
+
+
+// Allocate n cache-aligned wide nodes
+
+WideBVH_node *allocWideNodes( int n )
+
+{
+  void *mem;
+
+#ifdef _WIN32
+  mem = _aligned_malloc( n * sizeof(WideBVH_node), WIDE_BVH_ALIGNMENT );
+#else
+  if (posix_memalign( &mem, WIDE_BVH_ALIGNMENT, n * sizeof(WideBVH_node) ) != 0)
+    mem = NULL;
+#endif
+
+  if (mem == NULL) {
+    cerr << "Could not allocate " << n << " wide BVH nodes" << endl;
+    exit(1);
+  }
+
+  return (WideBVH_node *) mem;
+}
+
+
+void freeWideNodes( WideBVH_node *nodes )
+
+{
+#ifdef _WIN32
+  _aligned_free( nodes );
+#else
+  free( nodes );
+#endif
+}
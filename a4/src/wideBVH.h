@@ -0,0 +1,75 @@
+// wideBVH.h
+//
+// An 8-wide BVH for ray traversal
+//
+// A wide node stores the boxes of up to eight children in
+// structure-of-arrays form, so that one ray is tested against all of
+// them at once.  The test uses AVX (one pass over the eight children)
+// or SSE (two passes), whichever the CPU supports, and a scalar loop
+// on other processors.
+//
+// The wide tree is collapsed from a flattened binary or k-means tree
+// (see bvh.h), whose leaf triangle ranges it keeps.
+
+
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+
+#include "linalg.h"
+
+
+class BVH_flatNode;
+
+
+#define WIDE_BVH_WIDTH      8
+#define WIDE_BVH_ALIGNMENT 64	// cache line
+
+
+class WideBVH_node {
+
+public:
+
+  float bounds[6][WIDE_BVH_WIDTH]; // child boxes: minX, minY, minZ, maxX, maxY, maxZ
+  int   child[WIDE_BVH_WIDTH];	   // index of child node, or first triangle of a leaf child
+  int   count[WIDE_BVH_WIDTH];	   // number of triangles of a leaf child, 0 for a node child, -1 for no child
+};
+
+
+// A ray, set up once for all of its box tests
+
+class WideBVH_ray {
+
+public:
+
+  float origin[3];
+  float invDir[3];
+  int   nearPlane[3];		// index into WideBVH_node::bounds of the nearer plane on each axis
+  int   farPlane[3];
+
+  WideBVH_ray( vec3 &rayStart, vec3 &rayDir );
+};
+
+
+// Test a ray against all children of a node with ray parameters in
+// [0,tmax].  Return a bitmask of the children hit, and store the
+// entry parameter of each hit child in tEntry[].
+
+typedef int (*WideBVH_boxTest)( WideBVH_node &node, WideBVH_ray &ray, float tmax, float *tEntry );
+
+extern WideBVH_boxTest wideBoxTest;	// the fastest test for this CPU
+extern const char     *wideBoxTestName;	// "AVX", "SSE", or "scalar"
+
+int wideBoxTestScalar( WideBVH_node &node, WideBVH_ray &ray, float tmax, float *tEntry ); // portable reference
+
+
+// Collapse a flattened tree into wide nodes.  Return the nodes (which
+// should be freed with freeWideNodes()) and their number.  Also
+// return the most entries that traversal can have on its stack.
+
+WideBVH_node *buildWideBVH( BVH_flatNode *flatNodes, int &numWideNodes, int &maxPending );
+
+WideBVH_node *allocWideNodes( int n );
+void freeWideNodes( WideBVH_node *nodes );
+
+
+#endif